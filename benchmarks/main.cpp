@@ -0,0 +1,840 @@
+/******************************************************************************
+IPC - Simple cross-platform C++ IPC library
+Copyright (c) 2024, Marcus Tomlinson
+
+BSD 2-Clause License
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+******************************************************************************/
+
+#include <IpcClient.h>
+#include <IpcClientPool.h>
+#include <IpcCoroutine.h>
+#include <IpcServer.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <future>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+static const char* c_serverSocket = "bench.sock";
+static const int c_requestCount = 10000;
+
+// Simulated per-request work for the worker pool benchmark
+static const auto c_workDuration = std::chrono::microseconds( 50 );
+
+// Payloads from 1 B to 64 MB, each sent c_payloadBytes / size times (at least c_minRequestCount, at most
+// c_requestCount) so the large ones finish in seconds
+static const size_t c_payloadSizes[] = { 1, 64, 1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024, 64 * 1024 * 1024 };
+static const size_t c_payloadBytes = 512 * 1024 * 1024;
+static const int c_minRequestCount = 20;
+
+// The many-client runs stick to payloads up to c_maxConcurrentPayloadSize
+static const int c_concurrentClientCount = 8;
+static const size_t c_maxConcurrentPayloadSize = 64 * 1024;
+
+using Clock = std::chrono::steady_clock;
+
+// The round trip latency of each request in microseconds, and the span of time over which they were sent
+struct Samples
+{
+    std::vector<double> latencies;
+    Clock::time_point start;
+    Clock::time_point end;
+};
+
+struct Result
+{
+    std::string name;
+    size_t payloadSize = 0;
+    int clientCount = 1;
+    bool forked = false;
+
+    size_t requestCount = 0;
+    double p50 = 0;
+    double p99 = 0;
+    double p999 = 0;
+    double requestsPerSecond = 0;
+    double megabytesPerSecond = 0;
+};
+
+// Everything reported so far, for the JSON output
+static std::vector<Result> results;
+
+static double Microseconds( Clock::duration duration )
+{
+    return std::chrono::duration<double, std::micro>( duration ).count();
+}
+
+static int RequestCount( size_t payloadSize )
+{
+    return (int)std::clamp<size_t>( c_payloadBytes / payloadSize, c_minRequestCount, c_requestCount );
+}
+
+static std::string FormatSize( size_t size )
+{
+    if ( size >= 1024 * 1024 )
+    {
+        return std::to_string( size / ( 1024 * 1024 ) ) + " MB";
+    }
+    if ( size >= 1024 )
+    {
+        return std::to_string( size / 1024 ) + " KB";
+    }
+    return std::to_string( size ) + " B";
+}
+
+static double Percentile( const std::vector<double>& sorted, double fraction )
+{
+    return sorted.empty() ? 0 : sorted[std::min( sorted.size() - 1, (size_t)( fraction * sorted.size() ) )];
+}
+
+// Prints a line for the samples and adds them to results
+static void Report( const std::string& name, size_t payloadSize, int clientCount, bool forked, Samples& samples )
+{
+    auto& latencies = samples.latencies;
+    std::sort( latencies.begin(), latencies.end() );
+    double elapsed = std::chrono::duration<double>( samples.end - samples.start ).count();
+
+    Result result;
+    result.name = name;
+    result.payloadSize = payloadSize;
+    result.clientCount = clientCount;
+    result.forked = forked;
+    result.requestCount = latencies.size();
+    result.p50 = Percentile( latencies, 0.5 );
+    result.p99 = Percentile( latencies, 0.99 );
+    result.p999 = Percentile( latencies, 0.999 );
+    result.requestsPerSecond = elapsed > 0 ? latencies.size() / elapsed : 0;
+    result.megabytesPerSecond = result.requestsPerSecond * payloadSize / ( 1024 * 1024 );
+
+    printf( "%-34s %6s %2d %-10s  p50 %9.1f us  p99 %9.1f us  p999 %9.1f us  %9.0f req/sec  %7.0f MB/sec\n",
+            name.c_str(), FormatSize( payloadSize ).c_str(), clientCount, forked ? "forked" : "in-process",
+            result.p50, result.p99, result.p999, result.requestsPerSecond, result.megabytesPerSecond );
+    fflush( stdout );
+
+    results.push_back( result );
+}
+
+static bool WriteJson( const char* path )
+{
+    FILE* file = fopen( path, "w" );
+    if ( !file )
+    {
+        fprintf( stderr, "could not open %s\n", path );
+        return false;
+    }
+
+    fprintf( file, "[\n" );
+    for ( size_t i = 0; i < results.size(); ++i )
+    {
+        auto& result = results[i];
+        fprintf( file,
+                 "  {\"name\": \"%s\", \"payloadSize\": %zu, \"clients\": %d, \"forked\": %s, \"requests\": %zu, "
+                 "\"p50Us\": %.3f, \"p99Us\": %.3f, \"p999Us\": %.3f, \"requestsPerSec\": %.1f, "
+                 "\"megabytesPerSec\": %.1f}%s\n",
+                 result.name.c_str(), result.payloadSize, result.clientCount, result.forked ? "true" : "false",
+                 result.requestCount, result.p50, result.p99, result.p999, result.requestsPerSecond,
+                 result.megabytesPerSecond, i + 1 < results.size() ? "," : "" );
+    }
+    fprintf( file, "]\n" );
+
+    return fclose( file ) == 0;
+}
+
+// Sends requestCount requests one after another through client (a Client or ClientPool), adding the latency of each
+// to latencies (Returns false if one fails)
+template <typename Client>
+static bool TimedSends( Client& client, const Ipc::Message& message, int requestCount, std::vector<double>& latencies )
+{
+    Ipc::Message header( std::string( "bench" ) );
+    for ( int i = 0; i < requestCount; ++i )
+    {
+        auto start = Clock::now();
+        auto response = client.Send( header, message );
+        latencies.push_back( Microseconds( Clock::now() - start ) );
+        if ( response.IsError() )
+        {
+            fprintf( stderr, "Send() failed on request %d: %s\n", i, response.AsString().c_str() );
+            return false;
+        }
+    }
+    return true;
+}
+
+// Runs a Server on its own thread until destroyed, answering each request with a reply the size of its message
+class EchoServer final
+{
+public:
+    explicit EchoServer( size_t maxPayloadSize,
+                         const Ipc::RunOptions& runOptions = {},
+                         const Ipc::ServerOptions& serverOptions = {} )
+        : reply( maxPayloadSize, 42 )
+        , server( c_serverSocket, serverOptions )
+    {
+        runThread = std::thread(
+            [this, runOptions]
+            {
+                // The reply is a view of a buffer that outlives the server, so the callback itself copies nothing
+                server.Run( [this]( const Ipc::Message&, const Ipc::Message& message )
+                            { return Ipc::Message( reply.data(), message.Size() ); },
+                            runOptions );
+            } );
+    }
+
+    ~EchoServer()
+    {
+        server.StopListening();
+        runThread.join();
+    }
+
+    EchoServer( const EchoServer& ) = delete;
+    EchoServer& operator=( const EchoServer& ) = delete;
+
+    Ipc::ServerStats Stats()
+    {
+        return server.Stats();
+    }
+
+private:
+    std::vector<unsigned char> reply;
+    Ipc::Server server;
+    std::thread runThread;
+};
+
+// Round trips with each client on a thread of its own (and its own connection). Returns the server's stats
+static Ipc::ServerStats BenchThreadClients( const std::string& name,
+                                            const Ipc::ClientOptions& options,
+                                            size_t payloadSize,
+                                            int clientCount,
+                                            const Ipc::ServerOptions& serverOptions = {} )
+{
+    EchoServer server( payloadSize, {}, serverOptions );
+
+    int requestsPerClient = std::max( c_minRequestCount, RequestCount( payloadSize ) / clientCount );
+    std::vector<std::vector<double>> latencies( clientCount );
+    std::vector<unsigned char> payload( payloadSize, 42 );
+
+    Samples samples;
+    samples.start = Clock::now();
+    std::vector<std::thread> clientThreads;
+    for ( int i = 0; i < clientCount; ++i )
+    {
+        clientThreads.emplace_back(
+            [&, i]
+            {
+                Ipc::Client client( c_serverSocket, options );
+                TimedSends( client, Ipc::Message( payload.data(), payload.size() ), requestsPerClient, latencies[i] );
+            } );
+    }
+    for ( auto& clientThread : clientThreads )
+    {
+        clientThread.join();
+    }
+    samples.end = Clock::now();
+
+    for ( auto& clientLatencies : latencies )
+    {
+        samples.latencies.insert( samples.latencies.end(), clientLatencies.begin(), clientLatencies.end() );
+    }
+    Report( name, payloadSize, clientCount, false, samples );
+    return server.Stats();
+}
+
+// Prints the system calls the server made per request, as counted in its stats
+static void ReportSyscalls( const Ipc::ServerStats& stats )
+{
+    double requests = (double)std::max<uint64_t>( 1, stats.requestsReceived );
+    printf( "  server syscalls per request: %.2f (%.2f waiting, %.2f receiving, %.2f sending)%s\n",
+            ( stats.io.waitCalls + stats.io.recvCalls + stats.io.sendCalls ) / requests,
+            stats.io.waitCalls / requests, stats.io.recvCalls / requests, stats.io.sendCalls / requests,
+            stats.ioUring ? ", io_uring" : "" );
+    fflush( stdout );
+}
+
+#ifndef _WIN32
+static bool ReadAll( int fd, void* data, size_t size )
+{
+    auto bytes = (unsigned char*)data;
+    while ( size > 0 )
+    {
+        auto result = read( fd, bytes, size );
+        if ( result <= 0 )
+        {
+            return false;
+        }
+        bytes += result;
+        size -= (size_t)result;
+    }
+    return true;
+}
+
+static bool WriteAll( int fd, const void* data, size_t size )
+{
+    auto bytes = (const unsigned char*)data;
+    while ( size > 0 )
+    {
+        auto result = write( fd, bytes, size );
+        if ( result <= 0 )
+        {
+            return false;
+        }
+        bytes += result;
+        size -= (size_t)result;
+    }
+    return true;
+}
+
+// Round trips with each client in a process of its own, as a real peer would be. The clients are forked before the
+// server starts any threads, wait for it on startPipe, then send back their start and end times and latencies
+// (steady_clock is system-wide, so the times from each process line up)
+static void BenchForkedClients( const std::string& name,
+                                const Ipc::ClientOptions& options,
+                                size_t payloadSize,
+                                int clientCount )
+{
+    int requestsPerClient = std::max( c_minRequestCount, RequestCount( payloadSize ) / clientCount );
+
+    int startPipe[2];
+    if ( pipe( startPipe ) != 0 )
+    {
+        perror( "pipe() failed" );
+        return;
+    }
+
+    std::vector<pid_t> children;
+    std::vector<int> resultFds;
+    for ( int i = 0; i < clientCount; ++i )
+    {
+        int resultPipe[2];
+        if ( pipe( resultPipe ) != 0 )
+        {
+            perror( "pipe() failed" );
+            break;
+        }
+
+        pid_t pid = fork();
+        if ( pid == 0 )
+        {
+            close( startPipe[1] );
+            close( resultPipe[0] );
+
+            char go;
+            int exitCode = 1;
+            if ( ReadAll( startPipe[0], &go, 1 ) )
+            {
+                std::vector<unsigned char> payload( payloadSize, 42 );
+                std::vector<double> latencies;
+                latencies.reserve( requestsPerClient );
+
+                Ipc::Client client( c_serverSocket, options );
+                auto start = Clock::now();
+                TimedSends( client, Ipc::Message( payload.data(), payload.size() ), requestsPerClient, latencies );
+                auto end = Clock::now();
+
+                size_t count = latencies.size();
+                if ( WriteAll( resultPipe[1], &start, sizeof( start ) ) &&
+                     WriteAll( resultPipe[1], &end, sizeof( end ) ) &&
+                     WriteAll( resultPipe[1], &count, sizeof( count ) ) &&
+                     WriteAll( resultPipe[1], latencies.data(), count * sizeof( double ) ) )
+                {
+                    exitCode = 0;
+                }
+            }
+            _exit( exitCode );
+        }
+
+        close( resultPipe[1] );
+        if ( pid < 0 )
+        {
+            perror( "fork() failed" );
+            close( resultPipe[0] );
+            break;
+        }
+        children.push_back( pid );
+        resultFds.push_back( resultPipe[0] );
+    }
+    close( startPipe[0] );
+
+    Samples samples;
+    {
+        EchoServer server( payloadSize );
+
+        // Closing the pipe wakes any children left waiting (if we couldn't fork them all), who then give up
+        std::string go( children.size(), 'g' );
+        WriteAll( startPipe[1], go.data(), go.size() );
+        close( startPipe[1] );
+
+        samples.start = Clock::time_point::max();
+        samples.end = Clock::time_point::min();
+        for ( int fd : resultFds )
+        {
+            Clock::time_point start, end;
+            size_t count = 0;
+            if ( ReadAll( fd, &start, sizeof( start ) ) && ReadAll( fd, &end, sizeof( end ) ) &&
+                 ReadAll( fd, &count, sizeof( count ) ) )
+            {
+                std::vector<double> latencies( count );
+                if ( ReadAll( fd, latencies.data(), count * sizeof( double ) ) )
+                {
+                    samples.start = std::min( samples.start, start );
+                    samples.end = std::max( samples.end, end );
+                    samples.latencies.insert( samples.latencies.end(), latencies.begin(), latencies.end() );
+                }
+            }
+            close( fd );
+        }
+    }
+
+    for ( pid_t pid : children )
+    {
+        int status = 0;
+        waitpid( pid, &status, 0 );
+        if ( !WIFEXITED( status ) || WEXITSTATUS( status ) != 0 )
+        {
+            fprintf( stderr, "forked client %d failed\n", (int)pid );
+        }
+    }
+
+    if ( !samples.latencies.empty() )
+    {
+        Report( name, payloadSize, (int)children.size(), true, samples );
+    }
+}
+#endif
+
+// A new connection per request, served by Listen()
+static void BenchListen( const std::string& name, const Ipc::ClientOptions& options )
+{
+    Ipc::Server server( c_serverSocket );
+
+    std::atomic<bool> stop = false;
+    auto listenThread = std::thread(
+        [&server, &stop]
+        {
+            while ( !stop )
+            {
+                server.Listen( []( const Ipc::Message&, const Ipc::Message& ) { return std::string( "pong" ); } );
+            }
+        } );
+
+    Ipc::Client client( c_serverSocket, options );
+
+    Samples samples;
+    samples.start = Clock::now();
+    TimedSends( client, std::string( "ping" ), c_requestCount, samples.latencies );
+    samples.end = Clock::now();
+
+    stop = true;
+    server.StopListening();
+    listenThread.join();
+
+    Report( name, 4, 1, false, samples );
+}
+
+// Fires every request from one thread with SendAsync(), then waits for all the responses
+static void BenchSendAsync()
+{
+    EchoServer server( 4 );
+
+    Ipc::ClientOptions options;
+    options.persistentConnection = true;
+    Ipc::Client client( c_serverSocket, options );
+
+    Samples samples;
+    samples.latencies.resize( c_requestCount );
+    std::atomic<int> responseCount = 0;
+    std::promise<void> allResponded;
+
+    samples.start = Clock::now();
+    for ( int i = 0; i < c_requestCount; ++i )
+    {
+        auto sent = Clock::now();
+        client.SendAsync( std::string( "bench" ), std::string( "ping" ),
+                          [&, i, sent]( Ipc::Message response )
+                          {
+                              samples.latencies[i] = Microseconds( Clock::now() - sent );
+                              if ( response.IsError() )
+                              {
+                                  fprintf( stderr, "SendAsync() failed: %s\n", response.AsString().c_str() );
+                              }
+                              if ( ++responseCount == c_requestCount )
+                              {
+                                  allResponded.set_value();
+                              }
+                          } );
+    }
+    allResponded.get_future().wait();
+    samples.end = Clock::now();
+
+    Report( "SendAsync(), 1 thread", 4, 1, false, samples );
+}
+
+// Sends the requests in batches, each request's latency being that of its whole batch
+static void BenchSendBatch( int batchSize )
+{
+    EchoServer server( 4 );
+
+    Ipc::ClientOptions options;
+    options.persistentConnection = true;
+    Ipc::Client client( c_serverSocket, options );
+
+    Samples samples;
+    samples.start = Clock::now();
+    for ( int i = 0; i < c_requestCount / batchSize; ++i )
+    {
+        std::vector<std::pair<Ipc::Message, Ipc::Message>> requests;
+        for ( int j = 0; j < batchSize; ++j )
+        {
+            requests.emplace_back( std::string( "bench" ), std::string( "ping" ) );
+        }
+
+        auto start = Clock::now();
+        auto responses = client.SendBatch( requests );
+        samples.latencies.insert( samples.latencies.end(), batchSize, Microseconds( Clock::now() - start ) );
+        if ( responses.empty() || responses[0].IsError() )
+        {
+            fprintf( stderr, "SendBatch() failed on batch %d\n", i );
+            break;
+        }
+    }
+    samples.end = Clock::now();
+
+    Report( "SendBatch(), " + std::to_string( batchSize ) + " per batch", 4, 1, false, samples );
+}
+
+// How the client threads of BenchRunWorkers() send: with a Client (and connection) each, pipelining their requests over
+// one shared Client, or through one ClientPool
+enum class Callers
+{
+    OwnClients,
+    SharedClient,
+    ClientPool
+};
+
+static void BenchRunWorkers( size_t workerCount, int clientCount, Callers callers )
+{
+    Ipc::Server server( c_serverSocket );
+
+    Ipc::RunOptions runOptions;
+    runOptions.workerCount = workerCount;
+    auto runThread = std::thread(
+        [&server, &runOptions]
+        {
+            server.Run(
+                []( const Ipc::Message&, const Ipc::Message& )
+                {
+                    auto until = Clock::now() + c_workDuration;
+                    while ( Clock::now() < until )
+                    {
+                    }
+                    return std::string( "pong" );
+                },
+                runOptions );
+        } );
+
+    Ipc::ClientOptions clientOptions;
+    clientOptions.persistentConnection = true;
+
+    int requestsPerClient = c_requestCount / clientCount;
+    std::vector<std::vector<double>> latencies( clientCount );
+    Ipc::Client shared( c_serverSocket, clientOptions );
+
+    Ipc::ClientPoolOptions poolOptions;
+    poolOptions.maxConnections = clientCount;
+    poolOptions.maxIdleConnections = clientCount;
+    Ipc::ClientPool pool( c_serverSocket, poolOptions );
+
+    Samples samples;
+    samples.start = Clock::now();
+    std::vector<std::thread> clientThreads;
+    for ( int i = 0; i < clientCount; ++i )
+    {
+        clientThreads.emplace_back(
+            [&, i]
+            {
+                Ipc::Message message( std::string( "ping" ) );
+                if ( callers == Callers::ClientPool )
+                {
+                    TimedSends( pool, message, requestsPerClient, latencies[i] );
+                    return;
+                }
+                Ipc::Client own( c_serverSocket, clientOptions );
+                TimedSends( callers == Callers::SharedClient ? shared : own, message, requestsPerClient, latencies[i] );
+            } );
+    }
+    for ( auto& clientThread : clientThreads )
+    {
+        clientThread.join();
+    }
+    samples.end = Clock::now();
+
+    server.StopListening();
+    runThread.join();
+
+    for ( auto& clientLatencies : latencies )
+    {
+        samples.latencies.insert( samples.latencies.end(), clientLatencies.begin(), clientLatencies.end() );
+    }
+    const char* suffix = callers == Callers::SharedClient ? ", 1 client"
+                         : callers == Callers::ClientPool ? ", client pool"
+                                                          : "";
+    Report( "Run(), " + std::to_string( workerCount ) + " workers" + suffix, 4, clientCount, false, samples );
+}
+
+// Time to the first byte of a c_streamedSize response, streamed in c_streamPartSize parts through RunStreaming() or
+// returned whole from Run(), each request's latency being that until its first part (or the whole) arrives
+static const size_t c_streamedSize = 64 * 1024 * 1024;
+static const size_t c_streamPartSize = 1024 * 1024;
+static const int c_streamedRequestCount = 20;
+
+static void BenchStreaming( bool streamed )
+{
+    Ipc::Server server( c_serverSocket );
+
+    std::vector<unsigned char> part( c_streamPartSize, 'x' );
+    auto runThread = std::thread(
+        [&server, &part, streamed]
+        {
+            if ( !streamed )
+            {
+                server.Run( []( const Ipc::Message&, const Ipc::Message& )
+                            { return std::vector<unsigned char>( c_streamedSize, 'x' ); } );
+                return;
+            }
+            server.RunStreaming(
+                [&part]( const Ipc::Message&, const Ipc::Message&, Ipc::Stream& stream )
+                {
+                    for ( size_t sent = c_streamPartSize; sent < c_streamedSize; sent += c_streamPartSize )
+                    {
+                        if ( !stream.Write( Ipc::Message( part.data(), part.size() ) ) )
+                        {
+                            break;
+                        }
+                    }
+                    return Ipc::Message( part.data(), part.size() );
+                } );
+        } );
+
+    Ipc::ClientOptions options;
+    options.persistentConnection = true;
+    Ipc::Client client( c_serverSocket, options );
+
+    Samples samples;
+    samples.start = Clock::now();
+    for ( int i = 0; i < c_streamedRequestCount; ++i )
+    {
+        auto start = Clock::now();
+        std::optional<Clock::time_point> firstPart;
+        auto response = client.SendStreaming( std::string( "bench" ), std::string( "stream" ),
+                                              [&firstPart]( Ipc::Message )
+                                              {
+                                                  if ( !firstPart )
+                                                  {
+                                                      firstPart = Clock::now();
+                                                  }
+                                              } );
+        samples.latencies.push_back( Microseconds( firstPart.value_or( Clock::now() ) - start ) );
+        if ( response.IsError() )
+        {
+            fprintf( stderr, "SendStreaming() failed on request %d\n", i );
+            break;
+        }
+    }
+    samples.end = Clock::now();
+
+    server.StopListening();
+    runThread.join();
+
+    Report( streamed ? "first part, 1 MB parts" : "first part, whole", c_streamedSize, 1, false, samples );
+}
+
+#ifdef __cpp_impl_coroutine
+static Ipc::Task<void> SendCoRequests(
+    Ipc::Client& client, Ipc::Executor& executor, int requestCount, int& remaining, std::vector<double>& latencies )
+{
+    for ( int i = 0; i < requestCount; ++i )
+    {
+        auto start = Clock::now();
+        auto response = co_await client.SendCo( std::string( "bench" ), std::string( "ping" ) );
+        latencies.push_back( Microseconds( Clock::now() - start ) );
+        if ( response.IsError() )
+        {
+            fprintf( stderr, "SendCo() failed: %s\n", response.AsString().c_str() );
+            break;
+        }
+    }
+    if ( --remaining == 0 )
+    {
+        executor.Stop();
+    }
+}
+
+// The same number of concurrent callers as blocking threads, then as coroutines on one executor thread
+static void BenchCoroutines( int callerCount )
+{
+    EchoServer server( 4 );
+
+    Ipc::ClientOptions options;
+    options.persistentConnection = true;
+    Ipc::Client client( c_serverSocket, options );
+    int requestsPerCaller = c_requestCount / callerCount;
+
+    std::vector<std::vector<double>> latencies( callerCount );
+    Samples threadSamples;
+    threadSamples.start = Clock::now();
+    std::vector<std::thread> callerThreads;
+    for ( int i = 0; i < callerCount; ++i )
+    {
+        callerThreads.emplace_back(
+            [&, i] { TimedSends( client, std::string( "ping" ), requestsPerCaller, latencies[i] ); } );
+    }
+    for ( auto& callerThread : callerThreads )
+    {
+        callerThread.join();
+    }
+    threadSamples.end = Clock::now();
+    for ( auto& callerLatencies : latencies )
+    {
+        threadSamples.latencies.insert( threadSamples.latencies.end(), callerLatencies.begin(), callerLatencies.end() );
+    }
+
+    Ipc::Executor executor;
+    int remaining = callerCount;
+    Samples coroutineSamples;
+    coroutineSamples.start = Clock::now();
+    for ( int i = 0; i < callerCount; ++i )
+    {
+        executor.Spawn(
+            SendCoRequests( client, executor, requestsPerCaller, remaining, coroutineSamples.latencies ) );
+    }
+    executor.Run();
+    coroutineSamples.end = Clock::now();
+
+    Report( "threads + Send()", 4, callerCount, false, threadSamples );
+    Report( "coroutines + SendCo()", 4, callerCount, false, coroutineSamples );
+}
+#endif
+
+// IpcBench [--json <path>]
+// (Prints a line per benchmark, and with --json also writes the results to path as a JSON array)
+int main( int argc, char* argv[] )
+{
+    const char* jsonPath = nullptr;
+    for ( int i = 1; i < argc; ++i )
+    {
+        if ( strcmp( argv[i], "--json" ) == 0 && i + 1 < argc )
+        {
+            jsonPath = argv[++i];
+        }
+        else
+        {
+            fprintf( stderr, "usage: %s [--json <path>]\n", argv[0] );
+            return 1;
+        }
+    }
+
+    Ipc::ClientOptions perCall;
+    perCall.persistentConnection = false;
+    BenchListen( "Listen(), connection per call", perCall );
+
+    Ipc::ClientOptions persistent;
+    persistent.persistentConnection = true;
+    BenchListen( "Listen(), persistent connection", persistent );
+
+    BenchSendAsync();
+    BenchSendBatch( 100 );
+
+    // Round trip latency across payload sizes, through the socket and (for those worth it) through shared memory
+    Ipc::ClientOptions sharedMemory = persistent;
+    sharedMemory.sharedMemory = true;
+    sharedMemory.sharedMemorySize = 2 * c_payloadSizes[std::size( c_payloadSizes ) - 1];
+    for ( size_t payloadSize : c_payloadSizes )
+    {
+        BenchThreadClients( "echo, socket", persistent, payloadSize, 1 );
+        if ( payloadSize >= 64 * 1024 )
+        {
+            BenchThreadClients( "echo, shared memory", sharedMemory, payloadSize, 1 );
+        }
+    }
+
+    // Many clients at once, in this process and in processes of their own
+    for ( size_t payloadSize : c_payloadSizes )
+    {
+        if ( payloadSize > c_maxConcurrentPayloadSize )
+        {
+            break;
+        }
+        BenchThreadClients( "echo, socket", persistent, payloadSize, c_concurrentClientCount );
+#ifndef _WIN32
+        BenchForkedClients( "echo, socket", persistent, payloadSize, 1 );
+        BenchForkedClients( "echo, socket", persistent, payloadSize, c_concurrentClientCount );
+#endif
+    }
+
+    // Receiving through epoll and through io_uring (where available), by latency and by the system calls it takes
+    for ( size_t payloadSize : { (size_t)64, (size_t)4096, c_maxConcurrentPayloadSize } )
+    {
+        for ( bool ioUring : { false, true } )
+        {
+            Ipc::ServerOptions serverOptions;
+            serverOptions.ioUring = ioUring;
+            ReportSyscalls( BenchThreadClients( ioUring ? "echo, io_uring" : "echo, epoll", persistent, payloadSize,
+                                                c_concurrentClientCount, serverOptions ) );
+        }
+    }
+
+    // Run() throughput as the worker pool grows towards the core count
+    size_t coreCount = std::max<size_t>( 2, std::thread::hardware_concurrency() );
+    for ( size_t workerCount = 1; workerCount <= coreCount; workerCount *= 2 )
+    {
+        BenchRunWorkers( workerCount, (int)workerCount * 2, Callers::OwnClients );
+        BenchRunWorkers( workerCount, (int)workerCount * 2, Callers::SharedClient );
+        BenchRunWorkers( workerCount, (int)workerCount * 2, Callers::ClientPool );
+    }
+
+    // Time to first byte of a large response, streamed and whole
+    BenchStreaming( false );
+    BenchStreaming( true );
+
+#ifdef __cpp_impl_coroutine
+    BenchCoroutines( 64 );
+#endif
+
+    if ( jsonPath && !WriteJson( jsonPath ) )
+    {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,116 @@
+/******************************************************************************
+IPC - Simple cross-platform C++ IPC library
+Copyright (c) 2024, Marcus Tomlinson
+
+BSD 2-Clause License
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+******************************************************************************/
+
+#include <IpcBufferPool.h>
+
+#include <algorithm>
+
+using namespace Ipc;
+using namespace Private;
+
+BufferPool::BufferPool( const BufferPoolOptions& options )
+    : highWaterMark( std::clamp<size_t>( options.highWaterMark, c_minClassSize, SIZE_MAX / 2 ) )
+    , maxBuffersPerClass( options.maxBuffersPerClass )
+{
+    size_t classCount = 1;
+    while ( ClassSize( classCount ) <= highWaterMark )
+    {
+        ++classCount;
+    }
+    spareBuffers.resize( classCount );
+}
+
+std::vector<unsigned char> BufferPool::Take( size_t size )
+{
+    std::vector<unsigned char> buffer;
+
+    // Smallest class that fits size
+    size_t sizeClass = 0;
+    while ( sizeClass < spareBuffers.size() && ClassSize( sizeClass ) < size )
+    {
+        ++sizeClass;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        ++stats.takes;
+        if ( sizeClass < spareBuffers.size() && !spareBuffers[sizeClass].empty() )
+        {
+            buffer = std::move( spareBuffers[sizeClass].back() );
+            spareBuffers[sizeClass].pop_back();
+            ++stats.hits;
+            --stats.pooledBuffers;
+            stats.pooledBytes -= buffer.capacity();
+        }
+    }
+
+    if ( sizeClass < spareBuffers.size() )
+    {
+        buffer.reserve( ClassSize( sizeClass ) );
+    }
+    if ( buffer.size() < size )
+    {
+        buffer.resize( size );
+    }
+    return buffer;
+}
+
+void BufferPool::Return( std::vector<unsigned char>&& buffer )
+{
+    // Largest class the buffer can serve in full
+    size_t sizeClass = spareBuffers.size();
+    while ( sizeClass > 0 && ClassSize( sizeClass - 1 ) > buffer.capacity() )
+    {
+        --sizeClass;
+    }
+
+    std::lock_guard<std::mutex> lock( mutex );
+    ++stats.returns;
+    if ( sizeClass == 0 || buffer.capacity() > highWaterMark ||
+         spareBuffers[sizeClass - 1].size() >= maxBuffersPerClass )
+    {
+        ++stats.drops;
+        return;
+    }
+
+    ++stats.pooledBuffers;
+    stats.pooledBytes += buffer.capacity();
+    spareBuffers[sizeClass - 1].push_back( std::move( buffer ) );
+}
+
+BufferPoolStats BufferPool::Stats() const
+{
+    std::lock_guard<std::mutex> lock( mutex );
+    return stats;
+}
+
+// (highWaterMark is kept to under half of SIZE_MAX, so that no class past the last one overflows either)
+size_t BufferPool::ClassSize( size_t sizeClass ) const
+{
+    return c_minClassSize << sizeClass;
+}
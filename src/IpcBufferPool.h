@@ -0,0 +1,101 @@
+/******************************************************************************
+IPC - Simple cross-platform C++ IPC library
+Copyright (c) 2024, Marcus Tomlinson
+
+BSD 2-Clause License
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+******************************************************************************/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace Ipc
+{
+
+struct BufferPoolOptions
+{
+    // Largest buffer the pool keeps for reuse. Payloads bigger than this get a buffer of their own, freed after use
+    size_t highWaterMark = 1024 * 1024;
+
+    // Most spare buffers kept per size class (size classes are the powers of two from 256 bytes to highWaterMark)
+    size_t maxBuffersPerClass = 16;
+};
+
+struct BufferPoolStats
+{
+    // Buffers handed out, and how many of those were reused rather than freshly allocated
+    uint64_t takes = 0;
+    uint64_t hits = 0;
+
+    // Buffers handed back, and how many of those were dropped (too large, or their size class was already full)
+    uint64_t returns = 0;
+    uint64_t drops = 0;
+
+    // Spare buffers currently held, and their total capacity
+    size_t pooledBuffers = 0;
+    size_t pooledBytes = 0;
+};
+
+namespace Private
+{
+
+// Receive buffers recycled across requests, sorted into power of two size classes. A buffer is always taken with
+// its class's full capacity, so once returned it can serve any later payload of that class without reallocating.
+// Nor is a reused buffer cleared: std::vector zero-fills whatever it grows into, so a buffer keeps the size it has
+// grown to and only bytes it has never held before are ever filled (those receiving into it overwrite them anyway)
+class BufferPool final
+{
+public:
+    explicit BufferPool( const BufferPoolOptions& options = {} );
+
+    BufferPool( const BufferPool& ) = delete;
+    BufferPool& operator=( const BufferPool& ) = delete;
+
+    // A buffer of at least size bytes, possibly more (left over from its last use), so callers keep track of the size
+    // they asked for. Its contents are unspecified
+    std::vector<unsigned char> Take( size_t size );
+
+    void Return( std::vector<unsigned char>&& buffer );
+
+    BufferPoolStats Stats() const;
+
+private:
+    static constexpr size_t c_minClassSize = 256;
+
+    size_t ClassSize( size_t sizeClass ) const;
+
+    size_t highWaterMark;
+    size_t maxBuffersPerClass;
+
+    mutable std::mutex mutex;
+    std::vector<std::vector<std::vector<unsigned char>>> spareBuffers;
+    BufferPoolStats stats;
+};
+
+}  // namespace Private
+
+}  // namespace Ipc
@@ -28,9 +28,14 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <IpcClient.h>
 
+#include <IpcClientConnection.h>
 #include <IpcCommon.h>
+#include <IpcMessageBuilder.h>
+#include <IpcPoller.h>
 
+#include <algorithm>
 #include <mutex>
+#include <thread>
 
 using namespace Ipc;
 
@@ -40,74 +45,310 @@ namespace Ipc::Private
 class ClientImpl
 {
 public:
-    explicit ClientImpl( const std::filesystem::path& path )
+    ClientImpl( const std::filesystem::path& path, const ClientOptions& options )
         : socketPath( path.string() )
+        , options( options )
+        , bufferPool( std::make_shared<BufferPool>( options.bufferPool ) )
+        , metrics( std::make_shared<Metrics>() )
     {
     }
 
-    static bool Send( SOCKET clientSocket, const Message& message )
+    // Returns an empty string if header and message can be sent, otherwise an error description
+    std::string Validate( const Message& header, const Message& message ) const
     {
-        int sendResult = send( clientSocket, reinterpret_cast<const char*>( message.AsRaw() ), (int)message.Size(), 0 );
-        if ( sendResult == SOCKET_ERROR )
+        if ( !initError.empty() )
         {
-            return false;
+            return initError;
         }
-        return true;
+        return validateRequest( header, message );
     }
 
-    std::vector<unsigned char> Receive( SOCKET clientSocket )
+    // Runs exchange( connection, staleConnection ) on the persistent connection, retrying once on a new connection if
+    // the old one turned out to be stale. Without persistentConnection, each call gets a connection of its own so
+    // that concurrent calls don't wait on each other
+    // (Returns the connection used, sets error to the exchange's error if it failed)
+    // Connections are made under timeouts.connect, by totalDeadline
+    template <typename Exchange>
+    std::shared_ptr<ClientConnection>
+        WithConnection( std::string& error, const Timeouts& timeouts, Deadline totalDeadline, Exchange exchange )
     {
-        std::vector<unsigned char> result;
-
-        int recvResult = 0;
-        int recvFlags = 0;
-        do
+        bool staleConnection = false;
+        if ( !options.persistentConnection )
         {
-            recvResult = recv( clientSocket, reinterpret_cast<char*>( recvBytes ), c_recvBufferSize, recvFlags );
-            if ( recvResult > 0 )
+            auto connection = Connect( error, deadlineAfter( timeouts.connect, totalDeadline ) );
+            if ( connection )
             {
-                result.insert( result.end(), recvBytes, recvBytes + recvResult );
-#ifdef _WIN32
-                u_long opt = 1;
-                ioctlsocket( clientSocket, FIONBIO, &opt );
-#else
-                recvFlags = MSG_DONTWAIT;
-#endif
+                error = exchange( *connection, staleConnection );
             }
-            else if ( recvResult < 0 )
+            return connection;
+        }
+
+        bool reusedConnection = false;
+        auto connection = GetConnection( error, deadlineAfter( timeouts.connect, totalDeadline ), reusedConnection );
+        if ( connection )
+        {
+            error = exchange( *connection, staleConnection );
+            if ( !error.empty() && reusedConnection && staleConnection )
             {
-                auto const errorCode = lastError();
-#ifdef _WIN32
-                if ( errorCode != WSAEWOULDBLOCK )
-#else
-                if ( errorCode != EWOULDBLOCK )
-#endif
+                // The server dropped our idle connection, so reconnect and try once more
+                DropConnection( connection );
+                connection =
+                    GetConnection( error, deadlineAfter( timeouts.connect, totalDeadline ), reusedConnection );
+                if ( connection )
                 {
-                    result.clear();
+                    error = exchange( *connection, staleConnection );
                 }
             }
-        } while ( recvResult > 0 );
+        }
 
-#ifdef _WIN32
-        u_long opt = 0;
-        ioctlsocket( clientSocket, FIONBIO, &opt );
-#endif
+        // (A request that merely timed out waiting for its response leaves the connection fine for others)
+        if ( !error.empty() && connection && connection->Failed() )
+        {
+            DropConnection( connection );
+        }
+        return connection;
+    }
+
+    // Returns the persistent connection, making a new one by connectDeadline if there is none yet
+    std::shared_ptr<ClientConnection>
+        GetConnection( std::string& error, Deadline connectDeadline, bool& reusedConnection )
+    {
+        std::lock_guard<std::mutex> lock( connectionMutex );
+        reusedConnection = connection != nullptr;
+        if ( !connection )
+        {
+            connection = Connect( error, connectDeadline );
+        }
+        return connection;
+    }
+
+    // Stops handing out connection (unless it has already been replaced)
+    void DropConnection( const std::shared_ptr<ClientConnection>& connection )
+    {
+        std::lock_guard<std::mutex> lock( connectionMutex );
+        if ( this->connection == connection )
+        {
+            this->connection.reset();
+        }
+    }
+
+    // Sends one request and waits for its response (see ClientConnection::Exchange())
+    Message Send( const Message& header,
+                  const Message& message,
+                  uint8_t frameFlags,
+                  unsigned char* responseBuffer,
+                  size_t responseCapacity,
+                  const Timeouts& timeouts )
+    {
+        return RunExchange( timeouts,
+                            [&]( ClientConnection& connection, Deadline totalDeadline, Message& response,
+                                 bool& staleConnection )
+                            {
+                                return connection.Exchange( header, message, frameFlags, responseBuffer,
+                                                            responseCapacity, timeouts, totalDeadline, response,
+                                                            staleConnection );
+                            } );
+    }
 
-        return result;
+    // Sends one request and waits for its response, either of them streamed in parts (see
+    // ClientConnection::ExchangeStream())
+    Message SendStreaming( const Message& header,
+                           const Message& first,
+                           bool more,
+                           const std::function<bool( Message& chunk )>& nextChunk,
+                           const std::function<void( Message chunk )>& onChunk )
+    {
+        return RunExchange( options.timeouts,
+                            [&]( ClientConnection& connection, Deadline totalDeadline, Message& response,
+                                 bool& staleConnection )
+                            {
+                                return connection.ExchangeStream( header, first, more, nextChunk, onChunk,
+                                                                  options.timeouts, totalDeadline, response,
+                                                                  staleConnection );
+                            } );
+    }
+
+    // Runs exchange( connection, totalDeadline, response, staleConnection ) under timeouts (see WithConnection()),
+    // returning the response or the error
+    template <typename Exchange>
+    Message RunExchange( const Timeouts& timeouts, Exchange exchange )
+    {
+        auto totalDeadline = deadlineAfter( timeouts.total );
+        std::unique_lock<std::mutex> exchangeLock( exchangeMutex, std::defer_lock );
+        if ( options.ackHandshake )
+        {
+            exchangeLock.lock();
+        }
+
+        std::string error;
+        Message response( nullptr, 0 );
+        WithConnection( error, timeouts, totalDeadline,
+                        [&]( ClientConnection& connection, bool& staleConnection )
+                        { return exchange( connection, totalDeadline, response, staleConnection ); } );
+
+        if ( !error.empty() )
+        {
+            return Message( error, true );
+        }
+        return response;
+    }
+
+    std::shared_ptr<ClientConnection> Connect( std::string& error, Deadline deadline )
+    {
+        auto newConnection = std::make_shared<ClientConnection>( options, bufferPool, metrics );
+        error = newConnection->Connect( socketAddr, deadline );
+        if ( !error.empty() )
+        {
+            return nullptr;
+        }
+        return newConnection;
     }
 
     std::string initError;
     std::string socketPath = "";
+    ClientOptions options;
     sockaddr_un socketAddr;
-    unsigned char recvBytes[c_recvBufferSize] = {};
+    std::shared_ptr<BufferPool> bufferPool;
 
-    std::mutex sendMutex;
+    // Shared with the connections, which may outlive the client while a SendAsync() callback holds one
+    std::shared_ptr<Metrics> metrics;
+
+    std::mutex connectionMutex;
+    std::shared_ptr<ClientConnection> connection;
+
+    // Serializes whole exchanges when each one needs the socket to itself (see ClientOptions::ackHandshake)
+    std::mutex exchangeMutex;
+
+    // Starts the I/O thread that reads the responses to SendAsync() requests, unless it is running already
+    // (Returns an empty string on success, otherwise an error description)
+    std::string StartAsync()
+    {
+        std::lock_guard<std::mutex> lock( ioMutex );
+        if ( !ioPoller )
+        {
+            ioPoller = std::make_shared<Poller>();
+        }
+        if ( !ioPoller->InitError().empty() )
+        {
+            return ioPoller->InitError();
+        }
+        if ( !ioThread.joinable() )
+        {
+            ioThread = std::thread( [this] { IoLoop(); } );
+        }
+        return "";
+    }
+
+    // Hands connection, with SendAsync() requests outstanding, to the I/O thread (see StartAsync())
+    void ServeAsync( const std::shared_ptr<ClientConnection>& connection )
+    {
+        {
+            std::lock_guard<std::mutex> lock( ioMutex );
+            ioConnections.push_back( connection );
+        }
+        ioPoller->Wake();
+    }
+
+    // Waits for any outstanding SendAsync() requests to complete, then stops the I/O thread
+    void StopAsync()
+    {
+        {
+            std::lock_guard<std::mutex> lock( ioMutex );
+            ioStopping = true;
+        }
+
+        if ( ioThread.joinable() )
+        {
+            ioPoller->Wake();
+            ioThread.join();
+        }
+    }
+
+    // Serves whichever connections become readable, so that a slow response on one holds up none of the others, until
+    // none have SendAsync() requests outstanding and the client is stopping
+    void IoLoop()
+    {
+        struct Served
+        {
+            std::shared_ptr<ClientConnection> connection;
+            Deadline nextDeadline;
+        };
+        std::vector<Served> served;
+        std::vector<void*> ready;
+        while ( true )
+        {
+            // Connections handed over meanwhile are served straight away, as they may have responses in already
+            std::vector<std::shared_ptr<ClientConnection>> handedOver;
+            {
+                std::lock_guard<std::mutex> lock( ioMutex );
+                handedOver.swap( ioConnections );
+                if ( handedOver.empty() && served.empty() && ioStopping )
+                {
+                    return;
+                }
+            }
+            for ( auto& connection : handedOver )
+            {
+                if ( std::none_of( served.begin(), served.end(),
+                                   [&connection]( const Served& s ) { return s.connection == connection; } ) )
+                {
+                    auto poller = ioPoller;
+                    connection->SetReaderIdle( [poller] { poller->Wake(); } );
+                    ioPoller->Add( connection->socket, connection.get() );
+                    served.push_back( { connection, c_noDeadline } );
+                    ready.push_back( connection.get() );
+                }
+            }
+
+            // Woken up or timed out rather than by a socket, everything is looked at again
+            bool all = handedOver.empty() && ready.empty();
+            for ( auto it = served.begin(); it != served.end(); )
+            {
+                if ( !all && std::find( ready.begin(), ready.end(), it->connection.get() ) == ready.end() )
+                {
+                    ++it;
+                }
+                else if ( it->connection->ServeAvailable( it->nextDeadline ) )
+                {
+                    ++it;
+                }
+                else
+                {
+                    ioPoller->Remove( it->connection->socket );
+                    it = served.erase( it );
+                }
+            }
+
+            if ( !handedOver.empty() )
+            {
+                ready.clear();
+                continue;
+            }
+
+            auto nextDeadline = c_noDeadline;
+            for ( auto& s : served )
+            {
+                nextDeadline = std::min( nextDeadline, s.nextDeadline );
+            }
+            if ( !ioPoller->Wait( ready, timeoutMsUntil( nextDeadline ) ) )
+            {
+                ready.clear();
+            }
+        }
+    }
+
+    // Connections handed over to the I/O thread, which polls those with SendAsync() requests outstanding
+    std::mutex ioMutex;
+    std::shared_ptr<Poller> ioPoller;
+    std::vector<std::shared_ptr<ClientConnection>> ioConnections;
+    std::thread ioThread;
+    bool ioStopping = false;
 };
 
 }  // namespace Ipc::Private
 
-Client::Client( const std::filesystem::path& socketPath )
-    : p( std::make_unique<Private::ClientImpl>( socketPath ) )
+Client::Client( const std::filesystem::path& socketPath, const ClientOptions& options )
+    : p( std::make_unique<Private::ClientImpl>( socketPath, options ) )
 {
 #ifdef _WIN32
     WSADATA wsd;
@@ -118,20 +359,13 @@ Client::Client( const std::filesystem::path& socketPath )
     }
 #endif
 
-    if ( p->socketPath.length() > sizeof( sockaddr_un::sun_path ) )
-    {
-        p->initError = "socket path too long: " + p->socketPath;
-        return;
-    }
-
-    memset( &p->socketAddr, 0, sizeof( p->socketAddr ) );
-    p->socketAddr.sun_family = AF_UNIX;
-    strncpy( p->socketAddr.sun_path, p->socketPath.c_str(), p->socketPath.length() );
+    p->initError = Private::initSocketAddress( p->socketPath, p->socketAddr );
 }
 
 Client::~Client()
 {
-    std::lock_guard<std::mutex> lock( p->sendMutex );
+    p->StopAsync();
+    p->connection.reset();
 #ifdef _WIN32
     WSACleanup();
 #endif
@@ -139,72 +373,201 @@ Client::~Client()
 
 Message Client::Send( const Message& header, const Message& message )
 {
-    if ( !p->initError.empty() )
+    return Send( header, message, nullptr, 0 );
+}
+
+Message Client::Send( const Message& header, const Message& message, const Timeouts& timeouts )
+{
+    auto error = p->Validate( header, message );
+    if ( !error.empty() )
     {
-        return Message( p->initError, true );
+        return Message( error, true );
     }
 
-    std::lock_guard<std::mutex> lock( p->sendMutex );
+    return p->Send( header, message, 0, nullptr, 0, timeouts );
+}
 
-    if ( header.Size() == 0 )
+Message
+    Client::Send( const Message& header, const Message& message, unsigned char* responseBuffer, size_t responseCapacity )
+{
+    auto error = p->Validate( header, message );
+    if ( !error.empty() )
     {
-        return Message( "header can not be empty", true );
+        return Message( error, true );
     }
-    if ( message.Size() == 0 )
+
+    return p->Send( header, message, 0, responseBuffer, responseCapacity, p->options.timeouts );
+}
+
+std::vector<Message> Client::SendBatch( const std::vector<std::pair<Message, Message>>& requests )
+{
+    std::vector<Message> responses;
+    responses.reserve( requests.size() );
+
+    // Each request fails alike if the batch as a whole does
+    auto fail = [&responses, &requests]( const std::string& error )
+    {
+        responses.clear();
+        for ( size_t i = 0; i < requests.size(); ++i )
+        {
+            responses.emplace_back( error, true );
+        }
+        return std::move( responses );
+    };
+
+    if ( requests.empty() )
     {
-        return Message( "message can not be empty", true );
+        return responses;
     }
 
-    SOCKET clientSocket = socket( AF_UNIX, SOCK_STREAM, PF_UNSPEC );
-    if ( clientSocket == INVALID_SOCKET )
+    size_t packedSize = 0;
+    for ( auto& request : requests )
     {
-        return Message( "socket() failed (error: " + std::to_string( lastError() ) + ")", true );
+        auto error = p->Validate( request.first, request.second );
+        if ( error.empty() && !request.second.Fds().empty() )
+        {
+            error = "file descriptors can not be sent in a batch";
+        }
+        if ( !error.empty() )
+        {
+            return fail( error );
+        }
+        packedSize += c_batchItemHeaderSize + request.first.Size() + request.second.Size();
     }
 
-#ifdef _WIN32
-    int timeout = 2000;
-    setsockopt( clientSocket, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<const char*>( &timeout ), sizeof( timeout ) );
-    setsockopt( clientSocket, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>( &timeout ), sizeof( timeout ) );
-#else
-    struct timeval timeout;
-    timeout.tv_sec = 2;
-    timeout.tv_usec = 0;
-    setsockopt( clientSocket, SOL_SOCKET, SO_SNDTIMEO, static_cast<const void*>( &timeout ), sizeof( timeout ) );
-    setsockopt( clientSocket, SOL_SOCKET, SO_RCVTIMEO, static_cast<const void*>( &timeout ), sizeof( timeout ) );
-#endif
+    // All the requests go out packed into the message of one frame
+    auto packed = p->bufferPool->Take( packedSize );
+    size_t offset = 0;
+    for ( auto& request : requests )
+    {
+        encodeBatchItem( (uint32_t)request.first.Size(), request.second.Size(), &packed[offset] );
+        offset += c_batchItemHeaderSize;
+        memcpy( &packed[offset], request.first.AsRaw(), request.first.Size() );
+        offset += request.first.Size();
+        memcpy( &packed[offset], request.second.AsRaw(), request.second.Size() );
+        offset += request.second.Size();
+    }
 
-    if ( connect( clientSocket, reinterpret_cast<const sockaddr*>( &p->socketAddr ), sizeof( p->socketAddr ) ) ==
-         SOCKET_ERROR )
+    auto response = p->Send( Message( nullptr, 0 ), Message( packed.data(), packedSize ), c_frameFlagBatch,
+                             nullptr, 0, p->options.timeouts );
+    p->bufferPool->Return( std::move( packed ) );
+    if ( response.IsError() )
     {
-        closesocket( clientSocket );
-        return Message( "connect() failed (error: " + std::to_string( lastError() ) + ")", true );
+        return fail( response.AsString() );
     }
 
-    // Send header data
-    if ( !p->Send( clientSocket, header ) )
+    // And their responses come back packed into one, in the same order
+    uint32_t flags = 0;
+    uint64_t bodyLength = 0;
+    for ( offset = 0; offset < response.Size(); offset += c_batchItemHeaderSize + bodyLength )
     {
-        closesocket( clientSocket );
-        return Message( "header send() failed (error: " + std::to_string( lastError() ) + ")", true );
+        if ( responses.size() == requests.size() ||
+             !decodeBatchItem( response.AsRaw() + offset, response.Size() - offset, false, flags, bodyLength ) )
+        {
+            return fail( "batch recv() failed (invalid response)" );
+        }
+
+        auto itemResponse =
+            Private::MessageBuilder::Allocate( bodyLength, ( flags & c_frameFlagError ) != 0, p->bufferPool );
+        if ( bodyLength > 0 )
+        {
+            memcpy( Private::MessageBuilder::Data( itemResponse ), response.AsRaw() + offset + c_batchItemHeaderSize,
+                    bodyLength );
+        }
+        responses.push_back( std::move( itemResponse ) );
     }
+    if ( responses.size() != requests.size() )
+    {
+        return fail( "batch recv() failed (invalid response)" );
+    }
+
+    return responses;
+}
 
-    // Receive ack
-    auto recvBytes = p->Receive( clientSocket );
-    if ( recvBytes.empty() || recvBytes[0] != 1 )
+Message Client::SendStreaming( const Message& header,
+                               const Message& message,
+                               const std::function<void( Message chunk )>& onChunk )
+{
+    auto error = p->Validate( header, message );
+    if ( !error.empty() )
     {
-        closesocket( clientSocket );
-        return Message( "ack recv() failed (error: " + std::to_string( lastError() ) + ")", true );
+        return Message( error, true );
     }
 
-    // Send message data
-    if ( !p->Send( clientSocket, message ) )
+    return p->SendStreaming( header, message, false, nullptr, onChunk );
+}
+
+Message Client::SendStreaming( const Message& header,
+                               const std::function<bool( Message& chunk )>& nextChunk,
+                               const std::function<void( Message chunk )>& onChunk )
+{
+    // The first part goes along with the header, so has to be had up front (there being no more parts is only known
+    // once they've all been sent, so the request is ended by an empty part, see Streams in IpcCommon.h)
+    Message first( nullptr, 0 );
+    if ( !nextChunk( first ) )
+    {
+        first = Message( nullptr, 0 );
+    }
+
+    auto error = p->Validate( header, first );
+    if ( !error.empty() )
     {
-        closesocket( clientSocket );
-        return Message( "message send() failed (error: " + std::to_string( lastError() ) + ")", true );
+        return Message( error, true );
     }
 
-    // Receive some data
-    recvBytes = p->Receive( clientSocket );
+    return p->SendStreaming( header, first, true, nextChunk, onChunk );
+}
 
-    closesocket( clientSocket );
-    return recvBytes;
+void Client::SendAsync( const Message& header,
+                        const Message& message,
+                        const std::function<void( Message response )>& callback )
+{
+    auto error = p->Validate( header, message );
+    if ( !error.empty() )
+    {
+        callback( Message( error, true ) );
+        return;
+    }
+
+    // Ack mode never has more than one request in flight anyway
+    if ( p->options.ackHandshake )
+    {
+        callback( Send( header, message ) );
+        return;
+    }
+
+    error = p->StartAsync();
+    if ( !error.empty() )
+    {
+        callback( Message( error, true ) );
+        return;
+    }
+
+    auto request = std::make_unique<Private::PendingRequest>();
+    request->callback = callback;
+    request->timeouts = p->options.timeouts;
+    request->totalDeadline = deadlineAfter( request->timeouts.total );
+
+    auto connection = p->WithConnection( error, request->timeouts, request->totalDeadline,
+                                         [&]( Private::ClientConnection& c, bool& staleConnection )
+                                         { return c.ExchangeAsync( header, message, request, staleConnection ); } );
+
+    if ( !error.empty() )
+    {
+        callback( Message( error, true ) );
+        return;
+    }
+    p->ServeAsync( connection );
+}
+
+std::future<Message> Client::SendAsync( const Message& header, const Message& message )
+{
+    auto promise = std::make_shared<std::promise<Message>>();
+    SendAsync( header, message, [promise]( Message response ) { promise->set_value( std::move( response ) ); } );
+    return promise->get_future();
+}
+
+ClientStats Client::Stats() const
+{
+    return Private::clientStats( *p->metrics, *p->bufferPool );
 }
@@ -28,10 +28,19 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #pragma once
 
+#include <IpcBufferPool.h>
 #include <IpcMessage.h>
+#include <IpcMetrics.h>
+#include <IpcSocketType.h>
 
+#include <chrono>
+#include <cstddef>
 #include <filesystem>
+#include <functional>
+#include <future>
 #include <memory>
+#include <utility>
+#include <vector>
 
 namespace Ipc
 {
@@ -39,20 +48,151 @@ namespace Ipc
 namespace Private
 {
 class ClientImpl;
+class SendAwaitable;
 }
 
+// How long each stage of a request may take before it fails with a "timed out" error (0 for no limit). Limits are
+// kept on the monotonic clock, so they hold however many system calls a stage takes and whatever the wall clock does
+struct Timeouts
+{
+    // Connecting to the server, including shared memory setup
+    std::chrono::microseconds connect = std::chrono::seconds( 2 );
+
+    // Sending the request (and, with ackHandshake, waiting for the ack)
+    std::chrono::microseconds send = std::chrono::seconds( 2 );
+
+    // Waiting for the response once the request is sent
+    std::chrono::microseconds receive = std::chrono::seconds( 2 );
+
+    // The whole call, capping the others
+    std::chrono::microseconds total = std::chrono::microseconds( 0 );
+};
+
+struct ClientOptions
+{
+    // Keep one connection open across Send() calls (reconnecting on failure) rather than connecting per call
+    bool persistentConnection = false;
+
+    // Wait for the server to confirm it has taken each request's header before sending its message, e.g. so that a
+    // large message isn't sent to a server that has already dropped the connection
+    // (Costs an extra round trip per request and rules out pipelining, so it is off by default)
+    bool ackHandshake = false;
+
+    // Pass large payloads through shared memory ring buffers set up with the server, rather than through the socket
+    // (Best combined with persistentConnection, as each new connection sets up its own region. Falls back to the
+    // socket if the server doesn't allow it, or for payloads that don't fit in a ring's free space)
+    bool sharedMemory = false;
+
+    // Size of each of the two rings (requests and responses) when sharedMemory is enabled
+    size_t sharedMemorySize = 32 * 1024 * 1024;
+
+    // Recycling of the buffers large responses are received into (they go back to the pool when the returned
+    // Message is destroyed)
+    BufferPoolOptions bufferPool;
+
+    // The largest response to accept in one frame, so that a server can't have the client allocate whatever its frame
+    // claims. The connection is dropped on a larger one (0 for no limit)
+    size_t maxMessageSize = 1024 * 1024 * 1024;
+
+    // Limits for every call, unless overridden per call (see Send())
+    Timeouts timeouts;
+
+    // The kind of socket to connect with, which must match the server's (see ServerOptions::socketType)
+    SocketType socketType = SocketType::Stream;
+};
+
+struct ClientStats
+{
+    // Requests sent (a batch counting as one), and connections opened and still open
+    uint64_t requestsSent = 0;
+    uint64_t connectionsOpened = 0;
+    size_t activeConnections = 0;
+
+    IoStats io;
+    ErrorStats errors;
+
+    // Where each request's time goes: connecting (per connection rather than per request), waiting for the server's
+    // ack (with ackHandshake), sending the request, waiting for its response once sent, and the whole round trip
+    LatencyHistogram connectLatency;
+    LatencyHistogram ackLatency;
+    LatencyHistogram sendLatency;
+    LatencyHistogram responseLatency;
+    LatencyHistogram roundTripLatency;
+
+    BufferPoolStats bufferPool;
+};
+
 class Client final
 {
 public:
-    explicit Client( const std::filesystem::path& socketPath );
+    explicit Client( const std::filesystem::path& socketPath, const ClientOptions& options = {} );
     ~Client();
 
     Client( const Client& ) = delete;
     Client& operator=( const Client& ) = delete;
 
     // Sends a message to the server and returns the response
+    // (Safe to call from many threads at once. With persistentConnection their requests are pipelined over the one
+    // connection and each caller gets its own response back, in whatever order the server answers them)
+    // (File descriptors attached to message are passed to the server, and any it attaches to the response come back
+    // attached to the returned Message, see Message::AttachFd())
     Message Send( const Message& header, const Message& message );
 
+    // As above, but the response is received straight into responseBuffer if it fits, in which case the returned
+    // Message is a view of it (errors, and responses larger than responseCapacity, are returned as from Send())
+    Message
+        Send( const Message& header, const Message& message, unsigned char* responseBuffer, size_t responseCapacity );
+
+    // As Send( header, message ), but under timeouts rather than ClientOptions::timeouts
+    // (A request that times out waiting for its response leaves a persistent connection open for other requests,
+    // its response being discarded if it arrives later)
+    Message Send( const Message& header, const Message& message, const Timeouts& timeouts );
+
+    // Sends many requests, given as header / message pairs, in one frame and returns their responses in the same order
+    // (Use IsError() on each response. The server handles each request as if sent on its own, with its Run() workers
+    // possibly handling several at once, but sends all the responses back together once the last is ready. File
+    // descriptors can't be passed in a batch)
+    std::vector<Message> SendBatch( const std::vector<std::pair<Message, Message>>& requests );
+
+    // Sends a message to a server that streams its response in parts (see Server::RunStreaming()), handing each part to
+    // onChunk as it arrives and returning the last, so that a response of any size takes no more memory than its
+    // largest part, and its first parts can be used while the rest are still being produced
+    // (onChunk runs on whichever thread is reading responses, as SendAsync()'s callback does, and each part it is
+    // handed may carry file descriptors. The receive timeout bounds the wait for each part rather than the whole
+    // response. A response the server doesn't stream is simply returned whole)
+    Message SendStreaming( const Message& header,
+                           const Message& message,
+                           const std::function<void( Message chunk )>& onChunk );
+
+    // As above, but the message is streamed too, its parts coming from nextChunk until it returns false. Each part is
+    // sent once the server has room for it, as it only holds a few waiting for its callback to read them
+    // (nextChunk may point chunk at a buffer of its own that it reuses, as each part is sent before the next is asked
+    // for. Without onChunk the response is returned whole, as from Send())
+    Message SendStreaming( const Message& header,
+                           const std::function<bool( Message& chunk )>& nextChunk,
+                           const std::function<void( Message chunk )>& onChunk = nullptr );
+
+    // Sends a message to the server without waiting for the response, which is handed to callback once it arrives
+    // (Use IsError() on the response to determine if the call was successful. callback runs on the client's I/O
+    // thread, or on whichever thread happened to read the response, so it should be quick. The header and message
+    // need not outlive the call, they are sent before SendAsync() returns)
+    void SendAsync( const Message& header,
+                    const Message& message,
+                    const std::function<void( Message response )>& callback );
+
+    // As above, but the response is delivered through the returned future
+    std::future<Message> SendAsync( const Message& header, const Message& message );
+
+#ifdef __cpp_impl_coroutine
+    // As above, but awaited from a coroutine: Message response = co_await client.SendCo( header, message );
+    // (Include IpcCoroutine.h to use this. The coroutine resumes on the Executor it was running on, or otherwise on
+    // the client's I/O thread)
+    Private::SendAwaitable SendCo( const Message& header, const Message& message );
+#endif
+
+    // Stats() returns a snapshot of the client's counters
+    ClientStats Stats() const;
+
 private:
     std::unique_ptr<Private::ClientImpl> p;
 };
@@ -0,0 +1,1072 @@
+/******************************************************************************
+IPC - Simple cross-platform C++ IPC library
+Copyright (c) 2024, Marcus Tomlinson
+
+BSD 2-Clause License
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+******************************************************************************/
+
+#pragma once
+
+#include <IpcClient.h>
+
+#include <IpcCommon.h>
+#include <IpcMessageBuilder.h>
+#include <IpcSharedMemory.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+
+namespace Ipc::Private
+{
+
+// A request sent on a connection and waiting for its response
+struct PendingRequest
+{
+    uint64_t requestId = 0;
+
+    // Sent in the request's frame, e.g. c_frameFlagBatch
+    uint8_t frameFlags = 0;
+    Message response = Message( nullptr, 0 );
+    std::string error;
+
+    // Nobody but the sender completes a request until it is marked as sent
+    bool sent = false;
+    bool done = false;
+
+    // When it started to be sent, and when it had been
+    Metrics::Clock::time_point sendStartedAt;
+    Metrics::Clock::time_point sentAt;
+
+    // Its limits, the deadline for the whole call (fixed when the call began), and the deadline for its response
+    // (fixed once it is sent)
+    Timeouts timeouts;
+    Deadline totalDeadline = c_noDeadline;
+    Deadline responseDeadline = c_noDeadline;
+
+    // Set by Send() calls that want the response received straight into a buffer of their own
+    unsigned char* responseBuffer = nullptr;
+    size_t responseCapacity = 0;
+
+    // Set for SendAsync() requests, which no thread waits on. These are heap allocated, and deleted once the callback
+    // has run
+    std::function<void( Message )> callback;
+
+    // Set for SendStreaming() requests, handed each part of a streamed response as it arrives (parts of any other
+    // request's response are kept in parts, and joined with the last)
+    std::function<void( Message chunk )> onChunk;
+    std::vector<Message> parts;
+
+    // How many more parts of a streamed request the server will take (see c_streamWindow)
+    size_t credits = 0;
+};
+
+// One connection to the server. Requests from any number of threads are pipelined over it, each tagged with its own
+// request ID. There is no reader thread: whichever waiting thread holds the reader role reads responses off the
+// socket and hands each to the thread waiting for it, until its own arrives and the role passes on
+class ClientConnection final
+{
+public:
+    ClientConnection( const ClientOptions& options,
+                      const std::shared_ptr<BufferPool>& bufferPool,
+                      const std::shared_ptr<Metrics>& metrics )
+        : options( options )
+        , bufferPool( bufferPool )
+        , metrics( metrics )
+        , recordSize( recordSizeOf( options.socketType ) )
+        , stagingBuffer( stagingBufferSizeOf( options.socketType ) )
+    {
+    }
+
+    ~ClientConnection()
+    {
+        if ( connected )
+        {
+            metrics->Add( Counter::ConnectionsClosed );
+        }
+        closeFds( receivedFds );
+        if ( socket != INVALID_SOCKET )
+        {
+            closesocket( socket );
+        }
+    }
+
+    ClientConnection( const ClientConnection& ) = delete;
+    ClientConnection& operator=( const ClientConnection& ) = delete;
+
+    // Connects, setting up shared memory if enabled, by deadline
+    std::string Connect( const sockaddr_un& socketAddr, Deadline deadline )
+    {
+        auto connectStart = Metrics::Clock::now();
+
+        socket = ::socket( AF_UNIX, socketTypeOf( options.socketType ), PF_UNSPEC );
+        if ( socket == INVALID_SOCKET )
+        {
+            metrics->Add( Counter::ConnectErrors );
+            return "socket() failed (error: " + std::to_string( lastError() ) + ")";
+        }
+        disableSigPipe( socket );
+
+        // A blocking connect() is bounded by the send timeout
+        bool connectFailed = !sendTimeout.Apply( socket, deadline ) ||
+                             connect( socket, reinterpret_cast<const sockaddr*>( &socketAddr ),
+                                      sizeof( socketAddr ) ) == SOCKET_ERROR;
+        if ( connectFailed )
+        {
+            if ( isWouldBlock( lastError() ) )
+            {
+                setTimedOut();
+            }
+            metrics->Add( Counter::ConnectErrors );
+            return "connect() failed (" + lastErrorDescription() + ")";
+        }
+        connected = true;
+        metrics->Add( Counter::ConnectionsOpened );
+        metrics->Record( Phase::Connect, connectStart );
+
+        if ( options.sharedMemory )
+        {
+            return SetupSharedMemory( deadline );
+        }
+
+        return "";
+    }
+
+    // Whether the connection has failed, and can no longer be used
+    bool Failed()
+    {
+        std::lock_guard<std::mutex> lock( pendingMutex );
+        return !failure.empty();
+    }
+
+    // Whether the connection can take more requests: it hasn't failed and, if nothing is in flight on it, the server
+    // hasn't hung up (with no response due, anything readable means it has)
+    bool Healthy()
+    {
+        std::lock_guard<std::mutex> lock( pendingMutex );
+        if ( !failure.empty() )
+        {
+            return false;
+        }
+        if ( !pending.empty() || reading || !abandoned.empty() )
+        {
+            return true;
+        }
+        return !waitForSocket( socket, false, std::chrono::steady_clock::now() );
+    }
+
+    // Offers the server a shared memory region for this connection's payloads, keeping it only if the server accepts
+    // (Returns an error only if the connection itself failed, otherwise we carry on without shared memory)
+    std::string SetupSharedMemory( Deadline deadline )
+    {
+        auto region = std::make_unique<SharedMemory>();
+        if ( !region->Create( options.sharedMemorySize ).empty() )
+        {
+            return "";
+        }
+
+        // The region goes to the server as a descriptor passed with the frame, or failing that (on Windows) by name
+        FrameHeader frame;
+        frame.flags = c_frameFlagSharedMemorySetup;
+#ifdef _WIN32
+        frame.bodyLength = region->Name().size();
+        IoBuffer name = { region->Name().data(), region->Name().size() };
+        const std::vector<int>* fds = nullptr;
+#else
+        frame.flags |= c_frameFlagFds;
+        frame.fdCount = 1;
+        IoBuffer name = { nullptr, 0 };
+        std::vector<int> regionFd = { region->Fd() };
+        const std::vector<int>* fds = &regionFd;
+#endif
+
+        unsigned char frameBytes[c_frameHeaderSize];
+        encodeFrameHeader( frame, frameBytes );
+
+        IoBuffer setup[] = { { frameBytes, c_frameHeaderSize }, name };
+        if ( !sendAllV( socket, setup, 2, { deadline, &sendTimeout }, metrics.get(), fds, recordSize ) )
+        {
+            metrics->Add( Counter::SendErrors );
+            return "shared memory setup send() failed (" + lastErrorDescription() + ")";
+        }
+
+        // Nothing else is reading yet, so the reply is ours to read
+        FrameHeader responseFrame;
+        bool peerClosed = false;
+        if ( Receive( frameBytes, c_frameHeaderSize, peerClosed, deadline ) != c_frameHeaderSize )
+        {
+            metrics->Add( Counter::ReceiveErrors );
+            return "shared memory setup recv() failed (" + lastErrorDescription() + ")";
+        }
+        if ( !decodeFrameHeader( frameBytes, responseFrame ) )
+        {
+            metrics->Add( Counter::ReceiveErrors );
+            return "shared memory setup recv() failed (invalid frame)";
+        }
+        if ( !frameSizeAllowed( responseFrame, options.maxMessageSize ) )
+        {
+            metrics->Add( Counter::ProtocolErrors );
+            return "shared memory setup recv() failed (message too large)";
+        }
+
+        std::vector<unsigned char> reply( responseFrame.bodyLength );
+        if ( Receive( reply.data(), reply.size(), peerClosed, deadline ) != reply.size() )
+        {
+            metrics->Add( Counter::ReceiveErrors );
+            return "shared memory setup recv() failed (" + lastErrorDescription() + ")";
+        }
+
+        // Either way the descriptor is no longer needed, the server has mapped the region or never will
+        region->Release();
+        if ( !( responseFrame.flags & c_frameFlagError ) )
+        {
+            sharedMemory = std::move( region );
+        }
+        return "";
+    }
+
+    // Runs one request / response exchange, receiving the response into responseBuffer if given and it fits
+    // (Returns an empty string on success, otherwise an error description, after which the connection is unusable.
+    // staleConnection is set when the exchange failed before the server could have acted on it, i.e. it is safe to
+    // retry on a new connection)
+    std::string Exchange( const Message& header,
+                          const Message& message,
+                          uint8_t frameFlags,
+                          unsigned char* responseBuffer,
+                          size_t responseCapacity,
+                          const Timeouts& timeouts,
+                          Deadline totalDeadline,
+                          Message& response,
+                          bool& staleConnection )
+    {
+        PendingRequest request;
+        request.frameFlags = frameFlags;
+        request.responseBuffer = responseBuffer;
+        request.responseCapacity = responseCapacity;
+        request.timeouts = timeouts;
+        request.totalDeadline = totalDeadline;
+        auto error = SendRequest( header, message, request, staleConnection );
+        if ( !error.empty() )
+        {
+            return error;
+        }
+
+        std::unique_lock<std::mutex> lock( pendingMutex );
+        ReadUntil( lock, [&request] { return request.done; } );
+        response = std::move( request.response );
+
+        // Answered before we had marked it as sent, so it was received into a buffer of its own
+        if ( responseBuffer && response.Size() > 0 && response.Size() <= responseCapacity &&
+             response.AsRaw() != responseBuffer && !response.IsError() )
+        {
+            memcpy( responseBuffer, response.AsRaw(), response.Size() );
+            auto fds = response.TakeFds();
+            response = Message( responseBuffer, response.Size() );
+            for ( int fd : fds )
+            {
+                response.AttachFd( fd );
+            }
+        }
+        return request.error;
+    }
+
+    // Runs one exchange whose request and/or response is streamed in parts. A request with more parts after first
+    // (more) gets them from nextChunk, sending each once the server has room for it, and each part of the response
+    // is handed to onChunk as it arrives
+    // (Returns as Exchange() does)
+    std::string ExchangeStream( const Message& header,
+                                const Message& first,
+                                bool more,
+                                const std::function<bool( Message& chunk )>& nextChunk,
+                                const std::function<void( Message chunk )>& onChunk,
+                                const Timeouts& timeouts,
+                                Deadline totalDeadline,
+                                Message& response,
+                                bool& staleConnection )
+    {
+        PendingRequest request;
+        request.frameFlags = more ? c_frameFlagChunk : 0;
+        request.timeouts = timeouts;
+        request.totalDeadline = totalDeadline;
+        request.onChunk = onChunk;
+        request.credits = c_streamWindow;
+        auto error = SendRequest( header, first, request, staleConnection );
+        if ( !error.empty() )
+        {
+            return error;
+        }
+
+        // Once answered (typically with an error) the server wants no more parts, but the stream still has to be ended
+        std::string partError;
+        while ( more )
+        {
+            Message chunk( nullptr, 0 );
+            more = nextChunk( chunk );
+            if ( more && chunk.Size() == 0 )
+            {
+                continue;
+            }
+            if ( more && !fdsAllowed( chunk.Fds() ) )
+            {
+                partError = c_fdsError;
+                more = false;
+                chunk = Message( nullptr, 0 );
+            }
+            if ( more )
+            {
+                std::unique_lock<std::mutex> lock( pendingMutex );
+                ReadUntil( lock, [&request] { return request.done || request.credits > 0; } );
+                if ( !failure.empty() )
+                {
+                    break;
+                }
+                if ( request.done )
+                {
+                    more = false;
+                    chunk = Message( nullptr, 0 );
+                }
+                else
+                {
+                    --request.credits;
+                }
+            }
+            if ( !WritePart( request, chunk, more ) )
+            {
+                break;
+            }
+        }
+
+        std::unique_lock<std::mutex> lock( pendingMutex );
+        ReadUntil( lock, [&request] { return request.done; } );
+        response = std::move( request.response );
+        return partError.empty() ? request.error : partError;
+    }
+
+    // Sends a request whose response is handed to request->callback once it arrives, by whichever thread reads it
+    // (Returns an empty string if the request was sent, in which case the connection now owns request. Otherwise
+    // returns an error description as Exchange() does, without having called the callback)
+    std::string ExchangeAsync( const Message& header,
+                               const Message& message,
+                               std::unique_ptr<PendingRequest>& request,
+                               bool& staleConnection )
+    {
+        auto error = SendRequest( header, message, *request, staleConnection );
+        if ( error.empty() )
+        {
+            request.release();
+        }
+        RunCallbacks();
+        return error;
+    }
+
+    // Reads whichever responses have already arrived, and times out the overdue requests, without waiting for more
+    // (for the client's I/O thread, which polls every connection with SendAsync() requests outstanding so that a slow
+    // response on one holds up none of the others)
+    // (Returns whether SendAsync() requests are still outstanding, setting nextDeadline to when the next one is due)
+    bool ServeAvailable( Deadline& nextDeadline )
+    {
+        std::unique_lock<std::mutex> lock( pendingMutex );
+        ReadUntil( lock, [this] { return !AsyncOutstanding(); }, true );
+        nextDeadline = NextResponseDeadline();
+        return AsyncOutstanding();
+    }
+
+    // Has readerIdle called whenever another thread stops reading while SendAsync() requests are outstanding, as
+    // whatever it read ahead for them is then past a poller's notice
+    void SetReaderIdle( std::function<void()> readerIdle )
+    {
+        std::lock_guard<std::mutex> lock( pendingMutex );
+        this->readerIdle = std::move( readerIdle );
+    }
+
+private:
+    // Sends a request, leaving it registered as pending only if that succeeded
+    std::string
+    SendRequest( const Message& header, const Message& message, PendingRequest& request, bool& staleConnection )
+    {
+        staleConnection = false;
+        auto sendDeadline = deadlineAfter( request.timeouts.send, request.totalDeadline );
+        std::lock_guard<std::mutex> lock( sendMutex );
+
+        // Registered before it is sent, as the response may well arrive before we get to wait for it
+        {
+            std::lock_guard<std::mutex> pendingLock( pendingMutex );
+            if ( !failure.empty() )
+            {
+                staleConnection = true;
+                return failure;
+            }
+            request.requestId = nextRequestId++;
+            request.sendStartedAt = Metrics::Clock::now();
+            pending.push_back( &request );
+        }
+
+        uint8_t frameFlags = request.frameFlags;
+        if ( options.ackHandshake && !( frameFlags & c_frameFlagChunk ) )
+        {
+            frameFlags |= c_frameFlagAck;
+        }
+        auto error = WriteRequest( header, message, request.requestId, frameFlags, sendDeadline, staleConnection );
+        auto sentAt = Metrics::Clock::now();
+
+        std::lock_guard<std::mutex> pendingLock( pendingMutex );
+        if ( !error.empty() && !request.done )
+        {
+            pending.erase( std::find( pending.begin(), pending.end(), &request ) );
+            Fail( error );
+            return error;
+        }
+
+        metrics->Add( Counter::Requests );
+        metrics->Record( Phase::Send, sentAt - request.sendStartedAt );
+
+        // Until now nobody else would complete the request, we do so here if it failed or was answered meanwhile
+        request.sentAt = sentAt;
+        request.responseDeadline = deadlineAfter( request.timeouts.receive, request.totalDeadline );
+        request.sent = true;
+        if ( !request.done && !failure.empty() )
+        {
+            pending.erase( std::find( pending.begin(), pending.end(), &request ) );
+            request.error = failure;
+            request.done = true;
+        }
+        if ( request.done && request.callback )
+        {
+            completed.emplace_back( &request );
+        }
+        return "";
+    }
+
+    // Sends a later part of a streamed request, the last if !more (sendMutex must not be held)
+    // (Returns false if the connection failed, in which case so has request)
+    bool WritePart( PendingRequest& request, const Message& chunk, bool more )
+    {
+        std::string error;
+        {
+            std::lock_guard<std::mutex> lock( sendMutex );
+            bool staleConnection = false;
+            error = WriteRequest( Message( nullptr, 0 ), chunk, request.requestId, more ? c_frameFlagChunk : 0,
+                                  deadlineAfter( request.timeouts.send, request.totalDeadline ), staleConnection );
+        }
+
+        std::lock_guard<std::mutex> pendingLock( pendingMutex );
+        if ( !error.empty() )
+        {
+            Fail( error );
+            return false;
+        }
+
+        // The server can't get on with the request until it has this part, so its response is due that much later
+        request.responseDeadline = deadlineAfter( request.timeouts.receive, request.totalDeadline );
+        return true;
+    }
+
+    // (A send that timed out part way through leaves the connection unusable, but is not retried on a new one)
+    std::string WriteRequest( const Message& header,
+                              const Message& message,
+                              uint64_t requestId,
+                              uint8_t frameFlags,
+                              Deadline deadline,
+                              bool& staleConnection )
+    {
+        // Send frame, header, and message data together (unless the server has to ack the header first)
+        FrameHeader frame;
+        frame.flags = frameFlags;
+        frame.headerLength = (uint32_t)header.Size();
+        frame.bodyLength = message.Size();
+        frame.requestId = requestId;
+        if ( !message.Fds().empty() )
+        {
+            frame.flags |= c_frameFlagFds;
+            frame.fdCount = (uint16_t)message.Fds().size();
+        }
+
+        IoBuffer buffers[] = {
+            { nullptr, c_frameHeaderSize }, { header.AsRaw(), header.Size() }, { message.AsRaw(), message.Size() } };
+
+        // Large payloads go through shared memory if we have it, leaving just the frame for the socket (payloads are
+        // written under sendMutex, so the server finds them in the ring in the same order as their frames)
+        bool viaSharedMemory = sharedMemory && !( frame.flags & c_frameFlagAck ) &&
+                               header.Size() + message.Size() >= c_sharedMemoryMinSize &&
+                               sharedMemory->Write( c_requestRing, buffers + 1, 2 );
+        if ( viaSharedMemory )
+        {
+            frame.flags |= c_frameFlagSharedMemory;
+            metrics->Add( Counter::BytesOut, header.Size() + message.Size() );
+        }
+
+        unsigned char frameBytes[c_frameHeaderSize];
+        encodeFrameHeader( frame, frameBytes );
+        buffers[0].data = frameBytes;
+
+        if ( !( frame.flags & c_frameFlagAck ) )
+        {
+            if ( !sendAllV( socket, buffers, viaSharedMemory ? 1 : 3, { deadline, &sendTimeout }, metrics.get(),
+                            &message.Fds(), recordSize ) )
+            {
+                staleConnection = !isTimedOut( lastError() );
+                metrics->Add( Counter::SendErrors );
+                return "send() failed (" + lastErrorDescription() + ")";
+            }
+            return "";
+        }
+
+        // Only one request is ever in flight in ack mode (see Client::Send()), so the ack is ours to read
+        if ( !sendAllV( socket, buffers, 2, { deadline, &sendTimeout }, metrics.get(), &message.Fds(), recordSize ) )
+        {
+            staleConnection = !isTimedOut( lastError() );
+            metrics->Add( Counter::SendErrors );
+            return "header send() failed (" + lastErrorDescription() + ")";
+        }
+
+        auto ackWaitStart = Metrics::Clock::now();
+        unsigned char ack = 0;
+        bool peerClosed = false;
+        if ( Receive( &ack, 1, peerClosed, deadline ) != 1 || ack != 1 )
+        {
+            staleConnection = !isTimedOut( lastError() );
+            metrics->Add( Counter::ReceiveErrors );
+            return "ack recv() failed (" + lastErrorDescription() + ")";
+        }
+        metrics->Record( Phase::AckWait, ackWaitStart );
+
+        if ( !sendAll(
+                 socket, message.AsRaw(), message.Size(), { deadline, &sendTimeout }, metrics.get(), recordSize ) )
+        {
+            metrics->Add( Counter::SendErrors );
+            return "message send() failed (" + lastErrorDescription() + ")";
+        }
+        return "";
+    }
+
+    // Reads responses and hands them out until done() holds, or waits while another thread does so, timing out
+    // requests whose responses are overdue (lock must hold pendingMutex). With availableOnly, returns rather than
+    // wait for a response to arrive or for another thread to read it
+    template <typename Done>
+    void ReadUntil( std::unique_lock<std::mutex>& lock, Done done, bool availableOnly = false )
+    {
+        while ( !done() )
+        {
+            if ( availableOnly )
+            {
+                ExpireRequests();
+                RunCallbacks( lock );
+                if ( done() || reading || !failure.empty() )
+                {
+                    return;
+                }
+                if ( stagingBegin == stagingEnd && !waitForSocket( socket, false, std::chrono::steady_clock::now() ) )
+                {
+                    return;
+                }
+            }
+
+            auto deadline = NextResponseDeadline();
+            if ( reading )
+            {
+                if ( deadline == c_noDeadline )
+                {
+                    responded.wait( lock );
+                }
+                else if ( responded.wait_until( lock, deadline ) == std::cv_status::timeout )
+                {
+                    ExpireRequests();
+                }
+                continue;
+            }
+
+            // Take the reader role until a response arrives, whoever it is for, or the first response is overdue
+            reading = true;
+            lock.unlock();
+
+            FrameHeader frame;
+            bool timedOut = false;
+            auto error = ReadFrame( frame, deadline, timedOut );
+            if ( timedOut )
+            {
+                lock.lock();
+                reading = false;
+                ExpireRequests();
+                responded.notify_all();
+                RunCallbacks( lock );
+                continue;
+            }
+
+            // Receive straight into the caller's buffer if it gave one the response fits in (only once the request is
+            // marked as sent, as until then its sender may yet give up on it), by the request's deadline
+            unsigned char* into = nullptr;
+            Deadline bodyDeadline = deadlineAfter( options.timeouts.receive );
+            if ( error.empty() )
+            {
+                lock.lock();
+                auto it = std::find_if( pending.begin(), pending.end(),
+                                        [&frame]( PendingRequest* r ) { return r->requestId == frame.requestId; } );
+                if ( it != pending.end() )
+                {
+                    bodyDeadline = ( *it )->sent ? ( *it )->responseDeadline
+                                                 : deadlineAfter( ( *it )->timeouts.receive, ( *it )->totalDeadline );
+                }
+                if ( it != pending.end() && ( *it )->sent && ( *it )->responseBuffer && ( *it )->parts.empty() &&
+                     !( frame.flags & ( c_frameFlagError | c_frameFlagChunk | c_frameFlagCredit ) ) &&
+                     frame.bodyLength <= ( *it )->responseCapacity )
+                {
+                    receiving = *it;
+                    into = receiving->responseBuffer;
+                }
+                lock.unlock();
+            }
+
+            Message response( nullptr, 0 );
+            if ( error.empty() )
+            {
+                error = ReadResponse( frame, into, bodyDeadline, response );
+            }
+
+            lock.lock();
+            auto it = std::find_if( pending.begin(), pending.end(),
+                                    [&frame]( PendingRequest* r ) { return r->requestId == frame.requestId; } );
+
+            // A part of a streamed response goes to its request's onChunk while we still hold the reader role, so the
+            // parts are handed on one at a time and in order (the request counting as being received meanwhile, so
+            // that nobody completes it)
+            bool part = ( frame.flags & ( c_frameFlagChunk | c_frameFlagCredit ) ) != 0;
+            if ( error.empty() && part && it != pending.end() )
+            {
+                auto request = *it;
+                request->responseDeadline = deadlineAfter( request->timeouts.receive, request->totalDeadline );
+                if ( frame.flags & c_frameFlagCredit )
+                {
+                    ++request->credits;
+                }
+                else if ( !request->onChunk )
+                {
+                    request->parts.push_back( std::move( response ) );
+                }
+                else
+                {
+                    receiving = request;
+                    lock.unlock();
+                    request->onChunk( std::move( response ) );
+                    lock.lock();
+                }
+            }
+
+            reading = false;
+            receiving = nullptr;
+
+            it = std::find_if( pending.begin(), pending.end(),
+                               [&frame]( PendingRequest* r ) { return r->requestId == frame.requestId; } );
+            auto abandonedIt = std::find( abandoned.begin(), abandoned.end(), frame.requestId );
+            if ( error.empty() && it == pending.end() && abandonedIt == abandoned.end() )
+            {
+                metrics->Add( Counter::ProtocolErrors );
+                error = "response recv() failed (unexpected request ID)";
+            }
+
+            if ( !error.empty() )
+            {
+                Fail( error );
+            }
+            else if ( it == pending.end() )
+            {
+                // The response to a request that timed out, which nobody wants any more (forgotten once the last of
+                // its frames is in)
+                if ( !part )
+                {
+                    abandoned.erase( abandonedIt );
+                }
+            }
+            else if ( !part )
+            {
+                auto request = *it;
+                pending.erase( it );
+                auto now = Metrics::Clock::now();
+                metrics->Record( Phase::RoundTrip, now - request->sendStartedAt );
+                if ( request->sent )
+                {
+                    metrics->Record( Phase::Response, now - request->sentAt );
+                }
+                request->response = MessageBuilder::Join( request->parts, std::move( response ), bufferPool );
+                request->done = true;
+                if ( request->sent && request->callback )
+                {
+                    completed.emplace_back( request );
+                }
+            }
+            responded.notify_all();
+            RunCallbacks( lock );
+        }
+
+        if ( !availableOnly && readerIdle && AsyncOutstanding() )
+        {
+            readerIdle();
+        }
+    }
+
+    // Whether any SendAsync() request is still waiting for its response (pendingMutex must be held)
+    bool AsyncOutstanding() const
+    {
+        return std::any_of( pending.begin(), pending.end(),
+                            []( PendingRequest* r ) { return r->callback != nullptr; } );
+    }
+
+    // The earliest deadline of the sent requests waiting for their responses (pendingMutex must be held)
+    Deadline NextResponseDeadline() const
+    {
+        Deadline deadline = c_noDeadline;
+        for ( auto request : pending )
+        {
+            if ( request->sent )
+            {
+                deadline = std::min( deadline, request->responseDeadline );
+            }
+        }
+        return deadline;
+    }
+
+    // Fails the sent requests whose responses are overdue, leaving the connection open, and remembers them so that
+    // their responses can be told apart from stray ones if they arrive after all (pendingMutex must be held)
+    void ExpireRequests()
+    {
+        auto now = std::chrono::steady_clock::now();
+        auto expired = std::partition( pending.begin(), pending.end(),
+                                       [this, now]( PendingRequest* r )
+                                       { return !r->sent || r == receiving || r->responseDeadline > now; } );
+        if ( expired == pending.end() )
+        {
+            return;
+        }
+
+        for ( auto it = expired; it != pending.end(); ++it )
+        {
+            metrics->Add( Counter::ReceiveErrors );
+            abandoned.push_back( ( *it )->requestId );
+            ( *it )->error = "response recv() failed (timed out)";
+            ( *it )->done = true;
+            if ( ( *it )->callback )
+            {
+                completed.emplace_back( *it );
+            }
+        }
+        pending.erase( expired, pending.end() );
+
+        // A server that never answers must not grow the list without bound
+        if ( abandoned.size() > c_maxAbandonedRequests )
+        {
+            Fail( "response recv() failed (too many requests timed out)" );
+        }
+        responded.notify_all();
+    }
+
+    // Reads the next frame header by deadline. If none has begun to arrive by then, sets timedOut rather than
+    // returning an error, as the connection is still fine
+    std::string ReadFrame( FrameHeader& frame, Deadline deadline, bool& timedOut )
+    {
+        unsigned char frameBytes[c_frameHeaderSize];
+        bool peerClosed = false;
+        auto received = Receive( frameBytes, c_frameHeaderSize, peerClosed, deadline );
+        if ( received == 0 && !peerClosed && isTimedOut( lastError() ) )
+        {
+            timedOut = true;
+            return "";
+        }
+        if ( received != c_frameHeaderSize )
+        {
+            metrics->Add( Counter::ReceiveErrors );
+            return "response recv() failed (" + lastErrorDescription() + ")";
+        }
+        if ( !decodeFrameHeader( frameBytes, frame ) )
+        {
+            metrics->Add( Counter::ProtocolErrors );
+            return "response recv() failed (invalid frame)";
+        }
+        if ( !frameSizeAllowed( frame, options.maxMessageSize ) )
+        {
+            metrics->Add( Counter::ProtocolErrors );
+            return "response recv() failed (message too large)";
+        }
+        return "";
+    }
+
+    // Receives a response's body into into if given, otherwise straight into a new Message (small responses need no
+    // heap allocation at all)
+    std::string ReadResponse( const FrameHeader& frame, unsigned char* into, Deadline deadline, Message& response )
+    {
+        bool responseIsError = ( frame.flags & c_frameFlagError ) != 0;
+        response = into ? Message( into, frame.bodyLength )
+                        : MessageBuilder::Allocate( frame.bodyLength, responseIsError, bufferPool );
+
+        // Any file descriptors came with the frame, so have already arrived
+        if ( frame.flags & c_frameFlagFds )
+        {
+            std::vector<int> fds;
+            if ( !takeFrameFds( frame, receivedFds, fds ) )
+            {
+                metrics->Add( Counter::ProtocolErrors );
+                return "response recv() failed (file descriptors missing)";
+            }
+            for ( int fd : fds )
+            {
+                response.AttachFd( fd );
+            }
+        }
+
+        auto responseData = MessageBuilder::Data( response );
+        bool peerClosed = false;
+        if ( frame.flags & c_frameFlagSharedMemory )
+        {
+            if ( !sharedMemory || !sharedMemory->Read( c_responseRing, responseData, response.Size() ) )
+            {
+                metrics->Add( Counter::ProtocolErrors );
+                return "response recv() failed (shared memory out of sync)";
+            }
+            metrics->Add( Counter::BytesIn, response.Size() );
+        }
+        else if ( Receive( responseData, response.Size(), peerClosed, deadline ) != response.Size() )
+        {
+            metrics->Add( Counter::ReceiveErrors );
+            return "response recv() failed (" + lastErrorDescription() + ")";
+        }
+
+        return "";
+    }
+
+    // Fails every sent request still waiting, along with the connection (pendingMutex must be held)
+    // (Requests still being sent are left to their senders, see SendRequest(), and the one whose response is being
+    // received into its caller's buffer is left to the reader, which finds the connection shut down)
+    void Fail( const std::string& error )
+    {
+        if ( failure.empty() )
+        {
+            failure = error;
+            shutdown( socket, SHUT_RDWR );
+        }
+
+        auto unsent = std::partition( pending.begin(), pending.end(),
+                                      [this]( PendingRequest* r ) { return !r->sent || r == receiving; } );
+        for ( auto it = unsent; it != pending.end(); ++it )
+        {
+            ( *it )->error = error;
+            ( *it )->done = true;
+            if ( ( *it )->callback )
+            {
+                completed.emplace_back( *it );
+            }
+        }
+        pending.erase( unsent, pending.end() );
+        responded.notify_all();
+    }
+
+    // Receives exactly length bytes, starting with any already read ahead. Each read scatters into data and then the
+    // staging buffer, so a small response (or several pipelined ones) costs one recv() call while a large one still
+    // lands straight in place (only called by the reader, or in ack mode where the socket is ours alone)
+    // (Returns how many bytes were received by deadline, which is less than length on failure)
+    size_t Receive( void* data, size_t length, bool& peerClosed, Deadline deadline )
+    {
+        peerClosed = false;
+
+        auto bytes = static_cast<unsigned char*>( data );
+        size_t staged = std::min( length, stagingEnd - stagingBegin );
+        if ( staged > 0 )
+        {
+            memcpy( bytes, stagingBuffer.data() + stagingBegin, staged );
+            stagingBegin += staged;
+        }
+
+        size_t total = staged;
+        IoDeadline ioDeadline = { deadline, &receiveTimeout };
+        while ( total < length )
+        {
+            if ( !beginIo( socket, ioDeadline ) )
+            {
+                return total;
+            }
+
+            IoBuffer buffers[] = { { bytes + total, length - total }, { stagingBuffer.data(), stagingBuffer.size() } };
+            auto received = recvV( socket, buffers, 2, metrics.get(), &receivedFds, recvFlagsOf( options.socketType ) );
+            if ( received == 0 )
+            {
+                peerClosed = true;
+                return total;
+            }
+            if ( received < 0 )
+            {
+                if ( waitToRetryIo( socket, false, ioDeadline ) )
+                {
+                    continue;
+                }
+                return total;
+            }
+            if ( (size_t)received > length - total + stagingBuffer.size() )
+            {
+                setMessageTooLong();
+                return total;
+            }
+            if ( (size_t)received < length - total )
+            {
+                total += received;
+                continue;
+            }
+            stagingBegin = 0;
+            stagingEnd = received - ( length - total );
+            total = length;
+        }
+        return total;
+    }
+
+    // As below, from a thread holding pendingMutex through lock
+    void RunCallbacks( std::unique_lock<std::mutex>& lock )
+    {
+        if ( !completed.empty() )
+        {
+            lock.unlock();
+            RunCallbacks();
+            lock.lock();
+        }
+    }
+
+    // Hands completed SendAsync() requests to their callbacks (pendingMutex must not be held)
+    void RunCallbacks()
+    {
+        std::vector<std::unique_ptr<PendingRequest>> requests;
+        {
+            std::lock_guard<std::mutex> lock( pendingMutex );
+            requests.swap( completed );
+        }
+
+        for ( auto& request : requests )
+        {
+            request->callback( request->error.empty() ? std::move( request->response )
+                                                      : Message( request->error, true ) );
+        }
+    }
+
+public:
+    SOCKET socket = INVALID_SOCKET;
+
+private:
+    ClientOptions options;
+    std::shared_ptr<BufferPool> bufferPool;
+    std::shared_ptr<Metrics> metrics;
+    std::unique_ptr<SharedMemory> sharedMemory;
+    bool connected = false;
+
+    // Held while writing a request, so that requests go out whole and in request ID order
+    std::mutex sendMutex;
+    SocketTimeout sendTimeout{ SO_SNDTIMEO };
+
+    // Writes are split into records of this size over a SOCK_SEQPACKET socket (see sendAll())
+    const size_t recordSize;
+
+    // Only touched by the reader
+    SocketTimeout receiveTimeout{ SO_RCVTIMEO };
+
+    // Requests registered and still waiting for their response (a short list, searched in place)
+    std::mutex pendingMutex;
+    uint64_t nextRequestId = 1;
+    std::condition_variable responded;
+    std::vector<PendingRequest*> pending;
+    bool reading = false;
+    std::string failure;
+
+    // The request whose response the reader is receiving into its caller's buffer
+    PendingRequest* receiving = nullptr;
+
+    // Requests that timed out waiting for their responses, which are discarded should they arrive
+    static const size_t c_maxAbandonedRequests = 1024;
+    std::vector<uint64_t> abandoned;
+
+    // Bytes read ahead of the response being received, and file descriptors received ahead of the frame that claims
+    // them, only touched by the reader
+    std::vector<unsigned char> stagingBuffer;
+    size_t stagingBegin = 0;
+    size_t stagingEnd = 0;
+    std::vector<int> receivedFds;
+
+    // SendAsync() requests whose callbacks are yet to run
+    std::vector<std::unique_ptr<PendingRequest>> completed;
+
+    // Tells the client's I/O thread to look at the connection again (see SetReaderIdle())
+    std::function<void()> readerIdle;
+};
+
+// Returns an empty string if header and message can be sent, otherwise an error description
+static inline std::string validateRequest( const Message& header, const Message& message )
+{
+    if ( header.Size() == 0 )
+    {
+        return "header can not be empty";
+    }
+    if ( message.Size() == 0 )
+    {
+        return "message can not be empty";
+    }
+    if ( header.Size() > UINT32_MAX )
+    {
+        return "header too large";
+    }
+    if ( !header.Fds().empty() )
+    {
+        return "file descriptors can only be attached to the message";
+    }
+    if ( !fdsAllowed( message.Fds() ) )
+    {
+        return c_fdsError;
+    }
+    return "";
+}
+
+// Fills in socketAddr for socketPath (returns an empty string on success, otherwise an error description)
+static inline std::string initSocketAddress( const std::string& socketPath, sockaddr_un& socketAddr )
+{
+    if ( socketPath.length() > sizeof( sockaddr_un::sun_path ) )
+    {
+        return "socket path too long: " + socketPath;
+    }
+
+    memset( &socketAddr, 0, sizeof( socketAddr ) );
+    socketAddr.sun_family = AF_UNIX;
+    strncpy( socketAddr.sun_path, socketPath.c_str(), socketPath.length() );
+    return "";
+}
+
+// A snapshot of the counters shared by a client's connections
+static inline ClientStats clientStats( const Metrics& metrics, const BufferPool& bufferPool )
+{
+    ClientStats stats;
+    stats.requestsSent = metrics.Count( Counter::Requests );
+    stats.connectionsOpened = metrics.Count( Counter::ConnectionsOpened );
+    stats.activeConnections = stats.connectionsOpened - metrics.Count( Counter::ConnectionsClosed );
+    stats.io = metrics.Io();
+    stats.errors = metrics.Errors();
+    stats.connectLatency = metrics.Histogram( Phase::Connect );
+    stats.ackLatency = metrics.Histogram( Phase::AckWait );
+    stats.sendLatency = metrics.Histogram( Phase::Send );
+    stats.responseLatency = metrics.Histogram( Phase::Response );
+    stats.roundTripLatency = metrics.Histogram( Phase::RoundTrip );
+    stats.bufferPool = bufferPool.Stats();
+    return stats;
+}
+
+}  // namespace Ipc::Private
@@ -0,0 +1,365 @@
+/******************************************************************************
+IPC - Simple cross-platform C++ IPC library
+Copyright (c) 2024, Marcus Tomlinson
+
+BSD 2-Clause License
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+******************************************************************************/
+
+#include <IpcClientPool.h>
+
+#include <IpcClientConnection.h>
+#include <IpcCommon.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+using namespace Ipc;
+
+namespace Ipc::Private
+{
+
+class ClientPoolImpl
+{
+public:
+    ClientPoolImpl( const std::filesystem::path& path, const ClientPoolOptions& options )
+        : options( options )
+        , bufferPool( std::make_shared<BufferPool>( options.client.bufferPool ) )
+        , metrics( std::make_shared<Metrics>() )
+    {
+        slotCount = options.maxConnections > 0 ? options.maxConnections
+                                               : std::max<size_t>( 1, std::thread::hardware_concurrency() );
+        slots = std::make_unique<Slot[]>( slotCount );
+
+        initError = initSocketAddress( path.string(), socketAddr );
+    }
+
+    Message Send( const Message& header, const Message& message )
+    {
+        return Send( header, message, options.client.timeouts );
+    }
+
+    Message Send( const Message& header, const Message& message, const Timeouts& timeouts )
+    {
+        auto error = !initError.empty() ? initError : validateRequest( header, message );
+        if ( !error.empty() )
+        {
+            return Message( error, true );
+        }
+
+        auto totalDeadline = deadlineAfter( timeouts.total );
+        bool exclusive = false;
+        auto acquired = Acquire( exclusive, totalDeadline );
+        if ( !acquired )
+        {
+            return Message( "no connection came free (timed out)", true );
+        }
+        auto& slot = *acquired;
+
+        // Retry once on a new connection if the one we were handed turned out to be stale (see
+        // ClientImpl::WithConnection())
+        Message response( nullptr, 0 );
+        bool reusedConnection = false;
+        bool staleConnection = false;
+        for ( int attempt = 0; attempt < 2; ++attempt )
+        {
+            auto connection =
+                GetConnection( slot, exclusive, deadlineAfter( timeouts.connect, totalDeadline ), error,
+                               reusedConnection );
+            if ( !connection )
+            {
+                break;
+            }
+
+            error = connection->Exchange( header, message, 0, nullptr, 0, timeouts, totalDeadline, response,
+                                          staleConnection );
+            if ( !error.empty() && connection->Failed() )
+            {
+                DropConnection( slot, connection );
+            }
+            if ( error.empty() || !reusedConnection || !staleConnection )
+            {
+                break;
+            }
+        }
+
+        Release( slot );
+
+        if ( !error.empty() )
+        {
+            return Message( error, true );
+        }
+        return response;
+    }
+
+    ClientPoolStats Stats() const
+    {
+        ClientPoolStats stats;
+        for ( size_t i = 0; i < slotCount; ++i )
+        {
+            if ( slots[i].open.load( std::memory_order_relaxed ) )
+            {
+                ++stats.openConnections;
+                stats.idleConnections += slots[i].users.load( std::memory_order_relaxed ) == 0 ? 1 : 0;
+            }
+        }
+        stats.sharedCalls = sharedCalls.load( std::memory_order_relaxed );
+        stats.idleConnectionsClosed = idleConnectionsClosed.load( std::memory_order_relaxed );
+        stats.healthCheckFailures = healthCheckFailures.load( std::memory_order_relaxed );
+        stats.client = clientStats( *metrics, *bufferPool );
+        return stats;
+    }
+
+    std::string initError;
+
+private:
+    // One connection, and how many calls are using it. Calls claim an idle slot by moving users from 0 to 1, and
+    // share a busy one by incrementing it, so handing out connections takes no lock. The mutex only guards replacing
+    // the connection itself
+    struct alignas( 64 ) Slot
+    {
+        std::atomic<uint32_t> users = 0;
+        std::atomic<bool> open = false;
+        std::atomic<int64_t> lastUsed = 0;
+
+        std::mutex mutex;
+        std::shared_ptr<ClientConnection> connection;
+    };
+
+    // Claims an idle slot, preferring one with a connection already open, otherwise shares the least busy
+    // (exclusive is set if the slot is ours alone. Returns null if, with slots never shared, none came free by
+    // deadline)
+    Slot* Acquire( bool& exclusive, Deadline deadline )
+    {
+        // Each thread starts its search from a slot of its own, so threads seldom race for the same one
+        static std::atomic<size_t> nextThread = 0;
+        thread_local size_t threadIndex = nextThread++;
+        size_t start = threadIndex % slotCount;
+
+        exclusive = true;
+        if ( auto slot = TryAcquireIdle( start ) )
+        {
+            return slot;
+        }
+
+        if ( options.client.ackHandshake )
+        {
+            Slot* slot = nullptr;
+            auto acquired = [&] { return ( slot = TryAcquireIdle( start ) ) != nullptr; };
+            std::unique_lock<std::mutex> lock( slotFreedMutex );
+            if ( deadline == c_noDeadline )
+            {
+                slotFreed.wait( lock, acquired );
+            }
+            else if ( !slotFreed.wait_until( lock, deadline, acquired ) )
+            {
+                return nullptr;
+            }
+            return slot;
+        }
+
+        exclusive = false;
+        size_t leastBusy = start;
+        for ( size_t i = 1; i < slotCount; ++i )
+        {
+            size_t index = ( start + i ) % slotCount;
+            if ( slots[index].users.load( std::memory_order_relaxed ) <
+                 slots[leastBusy].users.load( std::memory_order_relaxed ) )
+            {
+                leastBusy = index;
+            }
+        }
+        slots[leastBusy].users.fetch_add( 1, std::memory_order_acquire );
+        sharedCalls.fetch_add( 1, std::memory_order_relaxed );
+        return &slots[leastBusy];
+    }
+
+    Slot* TryAcquireIdle( size_t start )
+    {
+        for ( bool wantOpen : { true, false } )
+        {
+            for ( size_t i = 0; i < slotCount; ++i )
+            {
+                auto& slot = slots[( start + i ) % slotCount];
+                uint32_t idle = 0;
+                if ( slot.open.load( std::memory_order_relaxed ) == wantOpen &&
+                     slot.users.load( std::memory_order_relaxed ) == 0 &&
+                     slot.users.compare_exchange_strong( idle, 1, std::memory_order_acquire ) )
+                {
+                    return &slot;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    // Done with slot, closing its connection if that leaves too many idle
+    void Release( Slot& slot )
+    {
+        slot.lastUsed.store( std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed );
+        if ( slot.users.fetch_sub( 1, std::memory_order_release ) != 1 )
+        {
+            return;
+        }
+
+        if ( options.client.ackHandshake )
+        {
+            {
+                std::lock_guard<std::mutex> lock( slotFreedMutex );
+            }
+            slotFreed.notify_one();
+        }
+
+        if ( !slot.open.load( std::memory_order_relaxed ) || IdleCount() <= options.maxIdleConnections )
+        {
+            return;
+        }
+
+        // Unless someone has claimed it meanwhile
+        uint32_t idle = 0;
+        if ( slot.users.compare_exchange_strong( idle, 1, std::memory_order_acquire ) )
+        {
+            std::shared_ptr<ClientConnection> connection;
+            {
+                std::lock_guard<std::mutex> lock( slot.mutex );
+                connection = std::move( slot.connection );
+                slot.open = false;
+            }
+            idleConnectionsClosed.fetch_add( 1, std::memory_order_relaxed );
+            slot.users.fetch_sub( 1, std::memory_order_release );
+        }
+    }
+
+    size_t IdleCount() const
+    {
+        size_t idle = 0;
+        for ( size_t i = 0; i < slotCount; ++i )
+        {
+            if ( slots[i].open.load( std::memory_order_relaxed ) &&
+                 slots[i].users.load( std::memory_order_relaxed ) == 0 )
+            {
+                ++idle;
+            }
+        }
+        return idle;
+    }
+
+    // Returns slot's connection, health checking it first if it has sat idle a while, or connects a new one by
+    // connectDeadline if there is none (returns null, setting error, if that fails)
+    std::shared_ptr<ClientConnection> GetConnection(
+        Slot& slot, bool exclusive, Deadline connectDeadline, std::string& error, bool& reusedConnection )
+    {
+        std::lock_guard<std::mutex> lock( slot.mutex );
+        if ( slot.connection && exclusive )
+        {
+            auto idleFor = std::chrono::steady_clock::now().time_since_epoch() -
+                           std::chrono::steady_clock::duration( slot.lastUsed.load( std::memory_order_relaxed ) );
+            if ( idleFor >= options.healthCheckInterval && !slot.connection->Healthy() )
+            {
+                healthCheckFailures.fetch_add( 1, std::memory_order_relaxed );
+                slot.connection.reset();
+                slot.open = false;
+            }
+        }
+
+        reusedConnection = slot.connection != nullptr;
+        if ( !slot.connection )
+        {
+            auto connection = std::make_shared<ClientConnection>( options.client, bufferPool, metrics );
+            error = connection->Connect( socketAddr, connectDeadline );
+            if ( !error.empty() )
+            {
+                return nullptr;
+            }
+            slot.connection = std::move( connection );
+            slot.open = true;
+        }
+        return slot.connection;
+    }
+
+    // Stops handing out connection (unless it has already been replaced)
+    void DropConnection( Slot& slot, const std::shared_ptr<ClientConnection>& connection )
+    {
+        std::lock_guard<std::mutex> lock( slot.mutex );
+        if ( slot.connection == connection )
+        {
+            slot.connection.reset();
+            slot.open = false;
+        }
+    }
+
+    ClientPoolOptions options;
+    sockaddr_un socketAddr;
+    std::shared_ptr<BufferPool> bufferPool;
+    std::shared_ptr<Metrics> metrics;
+
+    size_t slotCount = 0;
+    std::unique_ptr<Slot[]> slots;
+
+    // Only used with ackHandshake, where calls wait for a slot to come free rather than share one
+    std::mutex slotFreedMutex;
+    std::condition_variable slotFreed;
+
+    std::atomic<uint64_t> sharedCalls = 0;
+    std::atomic<uint64_t> idleConnectionsClosed = 0;
+    std::atomic<uint64_t> healthCheckFailures = 0;
+};
+
+}  // namespace Ipc::Private
+
+ClientPool::ClientPool( const std::filesystem::path& socketPath, const ClientPoolOptions& options )
+    : p( std::make_unique<Private::ClientPoolImpl>( socketPath, options ) )
+{
+#ifdef _WIN32
+    WSADATA wsd;
+    if ( WSAStartup( WINSOCK_VERSION, &wsd ) != 0 )
+    {
+        p->initError = "WSAStartup() failed";
+    }
+#endif
+}
+
+ClientPool::~ClientPool()
+{
+    p.reset();
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+Message ClientPool::Send( const Message& header, const Message& message )
+{
+    return p->Send( header, message );
+}
+
+Message ClientPool::Send( const Message& header, const Message& message, const Timeouts& timeouts )
+{
+    return p->Send( header, message, timeouts );
+}
+
+ClientPoolStats ClientPool::Stats() const
+{
+    return p->Stats();
+}
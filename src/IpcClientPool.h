@@ -0,0 +1,105 @@
+/******************************************************************************
+IPC - Simple cross-platform C++ IPC library
+Copyright (c) 2024, Marcus Tomlinson
+
+BSD 2-Clause License
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+******************************************************************************/
+
+#pragma once
+
+#include <IpcClient.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+
+namespace Ipc
+{
+
+namespace Private
+{
+class ClientPoolImpl;
+}
+
+struct ClientPoolOptions
+{
+    // Options for each of the pool's connections (which are always persistent)
+    ClientOptions client;
+
+    // Most connections open at once (0 for one per hardware thread). A call takes a connection nobody else is using
+    // if there is one, otherwise it pipelines its request over the least busy
+    // (With client.ackHandshake connections are never shared, the call waits for one to come free instead, failing
+    // if none does within its timeouts.total)
+    size_t maxConnections = 0;
+
+    // Most connections kept open while nobody is using them, any more are closed as they fall idle
+    size_t maxIdleConnections = 4;
+
+    // A connection left idle this long is checked before its next use, and replaced if the server has hung up on it
+    std::chrono::milliseconds healthCheckInterval = std::chrono::seconds( 1 );
+};
+
+struct ClientPoolStats
+{
+    // Connections currently open, and how many of those nobody is using
+    size_t openConnections = 0;
+    size_t idleConnections = 0;
+
+    // Calls that found every connection busy, and pipelined their request over one in use
+    uint64_t sharedCalls = 0;
+
+    // Connections closed for being one idle too many, and those a health check found the server had hung up on
+    uint64_t idleConnectionsClosed = 0;
+    uint64_t healthCheckFailures = 0;
+
+    // Counters of all the pool's connections together
+    ClientStats client;
+};
+
+// Keeps a set of persistent connections to one server for many threads to send over at once. Where a single Client's
+// callers take turns writing to, and reading from, its one socket, a pool's callers each get a connection of their
+// own for as long as there are enough to go round, so throughput scales with the threads calling
+class ClientPool final
+{
+public:
+    explicit ClientPool( const std::filesystem::path& socketPath, const ClientPoolOptions& options = {} );
+    ~ClientPool();
+
+    ClientPool( const ClientPool& ) = delete;
+    ClientPool& operator=( const ClientPool& ) = delete;
+
+    // As Client::Send(), over one of the pool's connections (safe to call from any number of threads at once)
+    Message Send( const Message& header, const Message& message );
+    Message Send( const Message& header, const Message& message, const Timeouts& timeouts );
+
+    // Stats() returns a snapshot of the pool's counters
+    ClientPoolStats Stats() const;
+
+private:
+    std::unique_ptr<Private::ClientPoolImpl> p;
+};
+
+}  // namespace Ipc
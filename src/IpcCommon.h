@@ -28,6 +28,17 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #pragma once
 
+#include <IpcMessage.h>
+#include <IpcMetrics.h>
+#include <IpcSocketType.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
 #ifdef _WIN32
 
 // note, winsock2.h needs to be included *first*, hence the empty line
@@ -41,10 +52,15 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #pragma comment( lib, "Ws2_32.lib" )
 
+static const int SHUT_RDWR = SD_BOTH;
+
 #else
 
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <unistd.h>
 
@@ -52,11 +68,29 @@ using SOCKET = int;
 static const int INVALID_SOCKET = -1;
 static const int SOCKET_ERROR = -1;
 
-static int ( *closesocket )( int ) = close;
+static inline int closesocket( int socket )
+{
+    return close( socket );
+}
 
 #endif
 
-static const size_t c_recvBufferSize = 512;
+// Writing to a socket whose peer has gone away must fail with an error rather than raise SIGPIPE
+#ifdef MSG_NOSIGNAL
+static const int c_sendFlags = MSG_NOSIGNAL;
+#else
+static const int c_sendFlags = 0;
+#endif
+
+static inline void disableSigPipe( SOCKET socket )
+{
+#ifdef SO_NOSIGPIPE
+    int opt = 1;
+    setsockopt( socket, SOL_SOCKET, SO_NOSIGPIPE, static_cast<const void*>( &opt ), sizeof( opt ) );
+#else
+    (void)socket;
+#endif
+}
 
 static inline int lastError()
 {
@@ -66,3 +100,745 @@ static inline int lastError()
     return errno;
 #endif
 }
+
+static inline bool isWouldBlock( int errorCode )
+{
+#ifdef _WIN32
+    return errorCode == WSAEWOULDBLOCK;
+#else
+    return errorCode == EWOULDBLOCK || errorCode == EAGAIN;
+#endif
+}
+
+static inline bool setNonBlocking( SOCKET socket )
+{
+#ifdef _WIN32
+    u_long opt = 1;
+    return ioctlsocket( socket, FIONBIO, &opt ) == 0;
+#else
+    return fcntl( socket, F_SETFL, fcntl( socket, F_GETFL, 0 ) | O_NONBLOCK ) == 0;
+#endif
+}
+
+// Deadlines
+// ---------
+// Every wait on a socket is bounded by a point in time on the monotonic clock, rather than by a fixed timeout per
+// call, so that however many calls an operation takes it gives up when its time is up.
+
+using Deadline = std::chrono::steady_clock::time_point;
+static const Deadline c_noDeadline = Deadline::max();
+
+// timeout from now, capped at limit (a zero timeout means no limit of its own)
+static inline Deadline deadlineAfter( std::chrono::microseconds timeout, Deadline limit = c_noDeadline )
+{
+    if ( timeout.count() <= 0 )
+    {
+        return limit;
+    }
+    auto now = std::chrono::steady_clock::now();
+    return timeout < limit - now ? now + timeout : limit;
+}
+
+static inline void setTimedOut()
+{
+#ifdef _WIN32
+    WSASetLastError( WSAETIMEDOUT );
+#else
+    errno = ETIMEDOUT;
+#endif
+}
+
+// For a SOCK_SEQPACKET record longer than the peer could have sent
+static inline void setMessageTooLong()
+{
+#ifdef _WIN32
+    WSASetLastError( WSAEMSGSIZE );
+#else
+    errno = EMSGSIZE;
+#endif
+}
+
+static inline bool isTimedOut( int errorCode )
+{
+#ifdef _WIN32
+    return errorCode == WSAETIMEDOUT;
+#else
+    return errorCode == ETIMEDOUT;
+#endif
+}
+
+// "timed out" if the last error was a deadline passing, otherwise "error: <code>"
+static inline std::string lastErrorDescription()
+{
+    int errorCode = lastError();
+    return isTimedOut( errorCode ) ? "timed out" : "error: " + std::to_string( errorCode );
+}
+
+// The milliseconds left until deadline, rounded up, as poll() takes them (-1 for no deadline)
+static inline int timeoutMsUntil( Deadline deadline )
+{
+    if ( deadline == c_noDeadline )
+    {
+        return -1;
+    }
+    auto remaining = deadline - std::chrono::steady_clock::now();
+    return remaining <= remaining.zero()
+               ? 0
+               : (int)std::min<int64_t>( INT32_MAX,
+                                         std::chrono::ceil<std::chrono::milliseconds>( remaining ).count() );
+}
+
+// Waits until deadline for socket to become writable (or readable), returning false on error or once the deadline
+// has passed (with the last error set to timed out). A deadline already passed just checks the socket
+static inline bool waitForSocket( SOCKET socket, bool forWrite, Deadline deadline )
+{
+    while ( true )
+    {
+        int timeoutMs = timeoutMsUntil( deadline );
+
+#ifdef _WIN32
+        WSAPOLLFD pollFd = {};
+        pollFd.fd = socket;
+        pollFd.events = forWrite ? POLLWRNORM : POLLRDNORM;
+        int pollResult = WSAPoll( &pollFd, 1, timeoutMs );
+#else
+        pollfd pollFd = {};
+        pollFd.fd = socket;
+        pollFd.events = forWrite ? POLLOUT : POLLIN;
+        int pollResult = poll( &pollFd, 1, timeoutMs );
+        if ( pollResult < 0 && errno == EINTR )
+        {
+            continue;
+        }
+#endif
+        if ( pollResult != 0 )
+        {
+            return pollResult > 0;
+        }
+        if ( timeoutMs == 0 )
+        {
+            setTimedOut();
+            return false;
+        }
+    }
+}
+
+// Bounds the calls on a blocking socket by a deadline, which only SO_SNDTIMEO / SO_RCVTIMEO (option) can do. The
+// timeout is set in power of two steps no longer than the time left, so it seldom needs changing between calls: a
+// call that times out early just retries, rechecking the deadline
+class SocketTimeout final
+{
+public:
+    explicit SocketTimeout( int option )
+        : option( option )
+    {
+    }
+
+    // Call before each blocking call on socket. Returns false once the deadline has passed (with the last error set
+    // to timed out)
+    bool Apply( SOCKET socket, Deadline deadline )
+    {
+        std::chrono::microseconds timeout( 0 );
+        if ( deadline != c_noDeadline )
+        {
+            auto remaining =
+                std::chrono::duration_cast<std::chrono::microseconds>( deadline - std::chrono::steady_clock::now() );
+            if ( remaining.count() <= 0 )
+            {
+                setTimedOut();
+                return false;
+            }
+
+            // Keep the current timeout unless it is too long, or much shorter than it need be
+            if ( current.count() > 0 && current <= remaining && current * 4 > remaining )
+            {
+                return true;
+            }
+            timeout = std::chrono::microseconds( 1 );
+            while ( timeout * 2 <= remaining )
+            {
+                timeout *= 2;
+            }
+        }
+        else if ( current.count() == 0 )
+        {
+            return true;
+        }
+
+#ifdef _WIN32
+        DWORD value = timeout.count() > 0 ? (DWORD)std::max<int64_t>( 1, timeout.count() / 1000 ) : 0;
+        setsockopt( socket, SOL_SOCKET, option, reinterpret_cast<const char*>( &value ), sizeof( value ) );
+#else
+        timeval value;
+        value.tv_sec = (time_t)( timeout.count() / 1000000 );
+        value.tv_usec = (suseconds_t)( timeout.count() % 1000000 );
+        setsockopt( socket, SOL_SOCKET, option, static_cast<const void*>( &value ), sizeof( value ) );
+#endif
+        current = timeout;
+        return true;
+    }
+
+private:
+    int option;
+
+    // Zero while the socket's calls may block indefinitely
+    std::chrono::microseconds current{ 0 };
+};
+
+// How long the I/O functions below may wait: until deadline, bounding each call on a blocking socket through
+// socketTimeout (non-blocking sockets leave it null, and wait in poll() instead)
+struct IoDeadline
+{
+    Deadline deadline = c_noDeadline;
+    SocketTimeout* socketTimeout = nullptr;
+};
+
+// Readies socket for an I/O call under deadline, or returns false if the deadline has passed
+static inline bool beginIo( SOCKET socket, const IoDeadline& deadline )
+{
+    return !deadline.socketTimeout || deadline.socketTimeout->Apply( socket, deadline.deadline );
+}
+
+// Called after an I/O call would have blocked. Returns true if it should be retried
+static inline bool waitToRetryIo( SOCKET socket, bool forWrite, const IoDeadline& deadline )
+{
+    int errorCode = lastError();
+    if ( deadline.socketTimeout )
+    {
+        // On a blocking socket that means its timeout ran out, so the next beginIo() rechecks the deadline
+#ifdef _WIN32
+        return isWouldBlock( errorCode ) || isTimedOut( errorCode );
+#else
+        return isWouldBlock( errorCode );
+#endif
+    }
+    return isWouldBlock( errorCode ) && waitForSocket( socket, forWrite, deadline.deadline );
+}
+
+// The I/O functions below count their system calls and bytes in metrics, if given
+static inline void countIo( Ipc::Private::Metrics* metrics,
+                            Ipc::Private::Counter callCounter,
+                            Ipc::Private::Counter byteCounter,
+                            int64_t result )
+{
+    if ( metrics )
+    {
+        metrics->Add( callCounter );
+        if ( result > 0 )
+        {
+            metrics->Add( byteCounter, (uint64_t)result );
+        }
+    }
+}
+
+// Messages sent over a SOCK_SEQPACKET socket are split into records of at most this many bytes, as the kernel caps a
+// record at roughly the socket's send buffer size (the records of one message are never merged with another's, so a
+// frame always starts a record)
+static const size_t c_maxRecordSize = 64 * 1024;
+
+// The socket() type for socketType
+static inline int socketTypeOf( Ipc::SocketType socketType )
+{
+    return socketType == Ipc::SocketType::SeqPacket ? SOCK_SEQPACKET : SOCK_STREAM;
+}
+
+// The size of the records to send over a socket of socketType, 0 for none (see sendAll())
+static inline size_t recordSizeOf( Ipc::SocketType socketType )
+{
+    return socketType == Ipc::SocketType::SeqPacket ? c_maxRecordSize : 0;
+}
+
+// (recordSize is c_maxRecordSize for SOCK_SEQPACKET sockets, 0 for stream sockets, likewise below)
+static inline bool sendAll( SOCKET socket,
+                            const void* data,
+                            size_t length,
+                            const IoDeadline& deadline = {},
+                            Ipc::Private::Metrics* metrics = nullptr,
+                            size_t recordSize = 0 )
+{
+    auto bytes = static_cast<const char*>( data );
+    while ( length > 0 )
+    {
+        if ( !beginIo( socket, deadline ) )
+        {
+            return false;
+        }
+
+        int chunk = (int)std::min<size_t>( std::min<size_t>( length, recordSize ? recordSize : SIZE_MAX ), INT32_MAX );
+        int sendResult = send( socket, bytes, chunk, c_sendFlags );
+        countIo( metrics, Ipc::Private::Counter::SendCalls, Ipc::Private::Counter::BytesOut, sendResult );
+        if ( sendResult == SOCKET_ERROR )
+        {
+            if ( waitToRetryIo( socket, true, deadline ) )
+            {
+                continue;
+            }
+            return false;
+        }
+        bytes += sendResult;
+        length -= sendResult;
+    }
+    return true;
+}
+
+struct IoBuffer
+{
+    const void* data;
+    size_t length;
+};
+
+static const size_t c_maxIoBuffers = 8;
+
+// Most file descriptors passed with one message
+static const size_t c_maxFds = 64;
+#ifdef _WIN32
+static const char* const c_fdsError = "file descriptors can not be passed on this platform";
+#else
+static const char* const c_fdsError = "too many file descriptors attached to message";
+#endif
+
+// Whether fds can be passed with one message (otherwise see c_fdsError)
+static inline bool fdsAllowed( const std::vector<int>& fds )
+{
+#ifdef _WIN32
+    return fds.empty();
+#else
+    return fds.size() <= c_maxFds;
+#endif
+}
+
+#ifndef _WIN32
+// Room for the SCM_RIGHTS control message carrying up to c_maxFds descriptors
+union FdControlBuffer
+{
+    cmsghdr header;
+    char bytes[CMSG_SPACE( sizeof( int ) * c_maxFds )];
+};
+#endif
+
+// Sends all buffers in as few calls as possible: a single gather write unless the socket accepts a short write, or
+// the buffers add up to more than one record
+// (Any fds go along with the first write, so the receiver gets them with the first bytes of the buffers)
+static inline bool sendAllV( SOCKET socket,
+                             const IoBuffer* buffers,
+                             size_t count,
+                             const IoDeadline& deadline = {},
+                             Ipc::Private::Metrics* metrics = nullptr,
+                             const std::vector<int>* fds = nullptr,
+                             size_t recordSize = 0 )
+{
+    if ( count > c_maxIoBuffers || ( fds && fds->size() > c_maxFds ) )
+    {
+        return false;
+    }
+
+#ifdef _WIN32
+    if ( fds && !fds->empty() )
+    {
+        WSASetLastError( WSAEOPNOTSUPP );
+        return false;
+    }
+#else
+    FdControlBuffer control;
+    size_t controlLength = 0;
+    if ( fds && !fds->empty() )
+    {
+        controlLength = CMSG_SPACE( sizeof( int ) * fds->size() );
+        memset( control.bytes, 0, controlLength );
+        control.header.cmsg_level = SOL_SOCKET;
+        control.header.cmsg_type = SCM_RIGHTS;
+        control.header.cmsg_len = CMSG_LEN( sizeof( int ) * fds->size() );
+        memcpy( CMSG_DATA( &control.header ), fds->data(), sizeof( int ) * fds->size() );
+    }
+#endif
+
+#ifdef _WIN32
+    WSABUF pending[c_maxIoBuffers];
+#else
+    iovec pending[c_maxIoBuffers];
+#endif
+
+    size_t pendingCount = 0;
+    for ( size_t i = 0; i < count; ++i )
+    {
+        if ( buffers[i].length == 0 )
+        {
+            continue;
+        }
+#ifdef _WIN32
+        pending[pendingCount].buf = static_cast<char*>( const_cast<void*>( buffers[i].data ) );
+        pending[pendingCount].len = (ULONG)buffers[i].length;
+#else
+        pending[pendingCount].iov_base = const_cast<void*>( buffers[i].data );
+        pending[pendingCount].iov_len = buffers[i].length;
+#endif
+        ++pendingCount;
+    }
+
+    size_t first = 0;
+    while ( first < pendingCount )
+    {
+        if ( !beginIo( socket, deadline ) )
+        {
+            return false;
+        }
+
+#ifdef _WIN32
+        DWORD sent = 0;
+        int sendResult =
+            WSASend( socket, pending + first, (DWORD)( pendingCount - first ), &sent, 0, nullptr, nullptr );
+        countIo( metrics, Ipc::Private::Counter::SendCalls, Ipc::Private::Counter::BytesOut,
+                 sendResult == SOCKET_ERROR ? -1 : (int64_t)sent );
+        if ( sendResult == SOCKET_ERROR )
+        {
+            if ( waitToRetryIo( socket, true, deadline ) )
+            {
+                continue;
+            }
+            return false;
+        }
+#else
+        // Each call sends at most one record's worth, trimming the last buffer for the call if need be
+        size_t sendCount = pendingCount - first;
+        size_t trimmed = 0;
+        if ( recordSize > 0 )
+        {
+            size_t recordLength = 0;
+            for ( sendCount = 0; first + sendCount < pendingCount && recordLength < recordSize; ++sendCount )
+            {
+                recordLength += pending[first + sendCount].iov_len;
+            }
+            trimmed = recordLength > recordSize ? recordLength - recordSize : 0;
+            pending[first + sendCount - 1].iov_len -= trimmed;
+        }
+
+        msghdr msg = {};
+        msg.msg_iov = pending + first;
+        msg.msg_iovlen = sendCount;
+        if ( controlLength > 0 )
+        {
+            msg.msg_control = control.bytes;
+            msg.msg_controllen = controlLength;
+        }
+        ssize_t sent = sendmsg( socket, &msg, c_sendFlags );
+        countIo( metrics, Ipc::Private::Counter::SendCalls, Ipc::Private::Counter::BytesOut, sent );
+        pending[first + sendCount - 1].iov_len += trimmed;
+        if ( sent < 0 )
+        {
+            if ( waitToRetryIo( socket, true, deadline ) )
+            {
+                continue;
+            }
+            return false;
+        }
+        controlLength = 0;
+#endif
+
+        // Skip past whatever was written, resuming part way through a buffer after a short write
+        size_t remaining = (size_t)sent;
+        while ( first < pendingCount && remaining > 0 )
+        {
+#ifdef _WIN32
+            size_t length = pending[first].len;
+#else
+            size_t length = pending[first].iov_len;
+#endif
+            if ( remaining < length )
+            {
+#ifdef _WIN32
+                pending[first].buf += remaining;
+                pending[first].len -= (ULONG)remaining;
+#else
+                pending[first].iov_base = static_cast<char*>( pending[first].iov_base ) + remaining;
+                pending[first].iov_len -= remaining;
+#endif
+                break;
+            }
+            remaining -= length;
+            ++first;
+        }
+    }
+    return true;
+}
+
+#ifndef _WIN32
+// Appends the file descriptors of any SCM_RIGHTS control messages received into msg to fds
+static inline void appendControlFds( msghdr& msg, std::vector<int>& fds )
+{
+    for ( auto header = CMSG_FIRSTHDR( &msg ); header; header = CMSG_NXTHDR( &msg, header ) )
+    {
+        if ( header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS )
+        {
+            size_t fdCount = ( header->cmsg_len - CMSG_LEN( 0 ) ) / sizeof( int );
+            for ( size_t i = 0; i < fdCount; ++i )
+            {
+                int fd = -1;
+                memcpy( &fd, CMSG_DATA( header ) + i * sizeof( int ), sizeof( int ) );
+                fds.push_back( fd );
+            }
+        }
+    }
+}
+#endif
+
+// One scatter read, filling the buffers in turn with whatever has arrived so far (buffers' data is written to), and
+// appending any file descriptors that came with those bytes to fds if given (otherwise the kernel closes them)
+// (Returns the number of bytes read, 0 if the peer hung up, or -1 on error. With MSG_TRUNC in flags, a
+// SOCK_SEQPACKET record longer than the buffers returns its full length, the excess being discarded)
+static inline int64_t recvV( SOCKET socket,
+                             const IoBuffer* buffers,
+                             size_t count,
+                             Ipc::Private::Metrics* metrics = nullptr,
+                             std::vector<int>* fds = nullptr,
+                             int flags = 0 )
+{
+    if ( count > c_maxIoBuffers )
+    {
+        return -1;
+    }
+
+#ifdef _WIN32
+    WSABUF pending[c_maxIoBuffers];
+    for ( size_t i = 0; i < count; ++i )
+    {
+        pending[i].buf = static_cast<char*>( const_cast<void*>( buffers[i].data ) );
+        pending[i].len = (ULONG)std::min<size_t>( buffers[i].length, INT32_MAX );
+    }
+
+    DWORD received = 0;
+    DWORD recvFlags = flags;
+    int recvResult = WSARecv( socket, pending, (DWORD)count, &received, &recvFlags, nullptr, nullptr );
+    countIo( metrics, Ipc::Private::Counter::RecvCalls, Ipc::Private::Counter::BytesIn,
+             recvResult == SOCKET_ERROR ? -1 : (int64_t)received );
+    if ( recvResult == SOCKET_ERROR )
+    {
+        return -1;
+    }
+    return received;
+#else
+    iovec pending[c_maxIoBuffers];
+    for ( size_t i = 0; i < count; ++i )
+    {
+        pending[i].iov_base = const_cast<void*>( buffers[i].data );
+        pending[i].iov_len = buffers[i].length;
+    }
+
+    FdControlBuffer control;
+    msghdr msg = {};
+    msg.msg_iov = pending;
+    msg.msg_iovlen = count;
+    if ( fds )
+    {
+        msg.msg_control = control.bytes;
+        msg.msg_controllen = sizeof( control.bytes );
+    }
+#ifdef MSG_CMSG_CLOEXEC
+    ssize_t received = recvmsg( socket, &msg, fds ? flags | MSG_CMSG_CLOEXEC : flags );
+#else
+    ssize_t received = recvmsg( socket, &msg, flags );
+#endif
+    countIo( metrics, Ipc::Private::Counter::RecvCalls, Ipc::Private::Counter::BytesIn, received );
+
+    // (Should the sender exceed c_maxFds, those that don't fit are lost and the frame then comes up short)
+    if ( fds && received > 0 )
+    {
+        appendControlFds( msg, *fds );
+    }
+    return received;
+#endif
+}
+
+// Small reads go through a staging buffer of this size, so that a small frame costs one recv() call
+static const size_t c_stagingBufferSize = 4096;
+
+// The staging buffer size for a socket of socketType. Each read from a SOCK_SEQPACKET socket takes a whole record,
+// so its staging buffer holds the largest record sent (see c_maxRecordSize), and a read directly into place always
+// scatters into the staging buffer too, so that nothing is cut off
+static inline size_t stagingBufferSizeOf( Ipc::SocketType socketType )
+{
+    return socketType == Ipc::SocketType::SeqPacket ? c_maxRecordSize : c_stagingBufferSize;
+}
+
+// The recvV() flags for a socket of socketType: asks for a SOCK_SEQPACKET record's full length, so that a record
+// longer than the buffers (which no peer of ours sends) is caught rather than silently cut short
+static inline int recvFlagsOf( Ipc::SocketType socketType )
+{
+    return socketType == Ipc::SocketType::SeqPacket ? MSG_TRUNC : 0;
+}
+
+// Wire format
+// -----------
+// Every request and response starts with a fixed size frame header, followed by headerLength bytes of user header
+// and bodyLength bytes of message, all sent together with one gather write. Receivers can therefore size their
+// buffers up front and read exactly the right number of bytes. Fields are in host byte order as both peers are on
+// the same machine.
+//
+// A response carries the requestId of the request it answers, so a client can pipeline many requests over one
+// connection and the server can answer them in any order.
+//
+//   offset  size  field
+//   0       4     magic ("IPCF")
+//   4       1     version
+//   5       1     flags
+//   6       2     fdCount (file descriptors passed with the frame's first bytes, see c_frameFlagFds)
+//   8       4     headerLength
+//   12      8     bodyLength
+//   20      8     requestId
+
+static const uint32_t c_frameMagic = 0x46435049;
+static const uint8_t c_frameVersion = 2;
+static const size_t c_frameHeaderSize = 28;
+
+// The body of a response carries an error description rather than a message
+static const uint8_t c_frameFlagError = 0x01;
+
+// The client waits for a 1 byte ack after sending the frame and header, and only then sends the message (see
+// ClientOptions::ackHandshake)
+static const uint8_t c_frameFlagAck = 0x02;
+
+// The header and message were written to the connection's shared memory ring rather than sent after the frame
+static const uint8_t c_frameFlagSharedMemory = 0x04;
+
+// The client offers a shared memory region for this connection's payloads (see IpcSharedMemory.h), passed as the
+// frame's one file descriptor (or on Windows, named by the message)
+static const uint8_t c_frameFlagSharedMemorySetup = 0x08;
+
+// The message packs many requests, or their responses, into one frame (see Batches below)
+static const uint8_t c_frameFlagBatch = 0x10;
+
+// fdCount file descriptors, attached to the message, came over the socket with SCM_RIGHTS alongside the frame
+static const uint8_t c_frameFlagFds = 0x20;
+
+// The message is one part of a streamed request or response, more frames with the same requestId following (see
+// Streams below)
+static const uint8_t c_frameFlagChunk = 0x40;
+
+// Sent by the server, with no message: its callback has taken one more part of the streamed request requestId
+static const uint8_t c_frameFlagCredit = 0x80;
+
+// Payloads smaller than this are cheaper to send inline than through shared memory
+static const size_t c_sharedMemoryMinSize = 4096;
+
+struct FrameHeader
+{
+    uint8_t flags = 0;
+    uint16_t fdCount = 0;
+    uint32_t headerLength = 0;
+    uint64_t bodyLength = 0;
+    uint64_t requestId = 0;
+};
+
+static inline void encodeFrameHeader( const FrameHeader& frame, unsigned char* bytes )
+{
+    memcpy( bytes, &c_frameMagic, 4 );
+    memcpy( bytes + 4, &c_frameVersion, 1 );
+    memcpy( bytes + 5, &frame.flags, 1 );
+    memcpy( bytes + 6, &frame.fdCount, 2 );
+    memcpy( bytes + 8, &frame.headerLength, 4 );
+    memcpy( bytes + 12, &frame.bodyLength, 8 );
+    memcpy( bytes + 20, &frame.requestId, 8 );
+}
+
+// Returns false if the bytes do not hold a frame header of a version we understand
+static inline bool decodeFrameHeader( const unsigned char* bytes, FrameHeader& frame )
+{
+    uint32_t magic = 0;
+    uint8_t version = 0;
+    memcpy( &magic, bytes, 4 );
+    memcpy( &version, bytes + 4, 1 );
+    if ( magic != c_frameMagic || version != c_frameVersion )
+    {
+        return false;
+    }
+
+    memcpy( &frame.flags, bytes + 5, 1 );
+    memcpy( &frame.fdCount, bytes + 6, 2 );
+    memcpy( &frame.headerLength, bytes + 8, 4 );
+    memcpy( &frame.bodyLength, bytes + 12, 8 );
+    memcpy( &frame.requestId, bytes + 20, 8 );
+    return true;
+}
+
+// Whether the frame's header and message together fit in maxMessageSize bytes (0 for no limit), and in memory at all
+// (Checked before anything is allocated for them, as the lengths are whatever the peer claims)
+static inline bool frameSizeAllowed( const FrameHeader& frame, size_t maxMessageSize )
+{
+    if ( frame.bodyLength > SIZE_MAX - frame.headerLength )
+    {
+        return false;
+    }
+    return maxMessageSize == 0 || frame.headerLength + frame.bodyLength <= maxMessageSize;
+}
+
+// Closes fds (received file descriptors nobody took ownership of) and empties it
+static inline void closeFds( std::vector<int>& fds )
+{
+#ifndef _WIN32
+    for ( int fd : fds )
+    {
+        close( fd );
+    }
+#endif
+    fds.clear();
+}
+
+// Moves the frame's fdCount descriptors from the front of those received so far onto the end of fds
+// (Returns false if fewer have arrived, which means the peer broke the protocol)
+static inline bool takeFrameFds( const FrameHeader& frame, std::vector<int>& receivedFds, std::vector<int>& fds )
+{
+    size_t fdCount = ( frame.flags & c_frameFlagFds ) ? frame.fdCount : 0;
+    if ( fdCount > receivedFds.size() )
+    {
+        return false;
+    }
+    fds.insert( fds.end(), receivedFds.begin(), receivedFds.begin() + fdCount );
+    receivedFds.erase( receivedFds.begin(), receivedFds.begin() + fdCount );
+    return true;
+}
+
+// Streams
+// -------
+// A streamed request or response goes out as a run of frames with the same requestId, each carrying one part of its
+// message in turn. All but the last have c_frameFlagChunk set, and only the first of a request's carries its header.
+// A client ends a streamed request with an empty last frame, as it only knows there are no more parts once it has
+// sent them all.
+//
+// Parts of a request wait on the server until its callback reads them, so the client never has more than
+// c_streamWindow parts (not counting the first and last) that the server hasn't yet credited back. Responses need no
+// such limit, as the client's reader takes each part as it arrives.
+
+static const size_t c_streamWindow = 4;
+
+// Batches
+// -------
+// A batch frame has no header of its own. Its message packs many requests one after another, and the response packs
+// their responses in the same order. Each item is an item header followed by headerLength bytes of header (requests
+// only) and bodyLength bytes of message:
+//
+//   offset  size  field
+//   0       4     headerLength (requests) or flags (responses, c_frameFlagError)
+//   4       8     bodyLength
+
+static const size_t c_batchItemHeaderSize = 12;
+
+static inline void encodeBatchItem( uint32_t headerLengthOrFlags, uint64_t bodyLength, unsigned char* bytes )
+{
+    memcpy( bytes, &headerLengthOrFlags, 4 );
+    memcpy( bytes + 4, &bodyLength, 8 );
+}
+
+// Decodes the item header at the start of bytes, returning false if the item would run past size
+static inline bool decodeBatchItem(
+    const unsigned char* bytes, size_t size, bool isRequest, uint32_t& headerLengthOrFlags, uint64_t& bodyLength )
+{
+    if ( size < c_batchItemHeaderSize )
+    {
+        return false;
+    }
+    memcpy( &headerLengthOrFlags, bytes, 4 );
+    memcpy( &bodyLength, bytes + 4, 8 );
+
+    size -= c_batchItemHeaderSize;
+    size_t headerLength = isRequest ? headerLengthOrFlags : 0;
+    return headerLength <= size && bodyLength <= size - headerLength;
+}
@@ -0,0 +1,151 @@
+/******************************************************************************
+IPC - Simple cross-platform C++ IPC library
+Copyright (c) 2024, Marcus Tomlinson
+
+BSD 2-Clause License
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+******************************************************************************/
+
+#include <IpcCoroutine.h>
+
+#ifdef __cpp_impl_coroutine
+
+#include <IpcPoller.h>
+
+#include <mutex>
+
+using namespace Ipc;
+
+namespace Ipc::Private
+{
+
+class ExecutorImpl
+{
+public:
+    Poller poller;
+
+    std::mutex mutex;
+    std::vector<std::coroutine_handle<>> posted;
+    bool stopRequested = false;
+};
+
+}  // namespace Ipc::Private
+
+static thread_local Executor* currentExecutor = nullptr;
+
+Executor::Executor()
+    : p( std::make_unique<Private::ExecutorImpl>() )
+{
+}
+
+Executor::~Executor() = default;
+
+void Executor::Post( std::coroutine_handle<> handle )
+{
+    bool wasEmpty = false;
+    {
+        std::lock_guard<std::mutex> lock( p->mutex );
+        wasEmpty = p->posted.empty();
+        p->posted.push_back( handle );
+    }
+
+    // Run() only sleeps once it has found nothing posted, so a wakeup is only needed for the first handle
+    if ( wasEmpty )
+    {
+        p->poller.Wake();
+    }
+}
+
+void Executor::Spawn( Task<void>&& task )
+{
+    auto handle = std::exchange( task.handle, {} );
+    handle.promise().spawned = true;
+    Post( handle );
+}
+
+Message Executor::Run()
+{
+    if ( !p->poller.InitError().empty() )
+    {
+        return Message( p->poller.InitError(), true );
+    }
+
+    auto previousExecutor = currentExecutor;
+    currentExecutor = this;
+
+    std::vector<std::coroutine_handle<>> ready;
+    std::vector<void*> events;
+    std::string error;
+    while ( true )
+    {
+        {
+            std::lock_guard<std::mutex> lock( p->mutex );
+            ready.swap( p->posted );
+            if ( ready.empty() && p->stopRequested )
+            {
+                p->stopRequested = false;
+                break;
+            }
+        }
+
+        if ( ready.empty() )
+        {
+            if ( !p->poller.Wait( events ) )
+            {
+                error = "poll failed (error: " + std::to_string( lastError() ) + ")";
+                break;
+            }
+            continue;
+        }
+
+        for ( auto handle : ready )
+        {
+            handle.resume();
+        }
+        ready.clear();
+    }
+
+    currentExecutor = previousExecutor;
+
+    if ( !error.empty() )
+    {
+        return Message( error, true );
+    }
+    return Message( "" );
+}
+
+void Executor::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock( p->mutex );
+        p->stopRequested = true;
+    }
+    p->poller.Wake();
+}
+
+Executor* Executor::Current()
+{
+    return currentExecutor;
+}
+
+#endif  // __cpp_impl_coroutine
@@ -0,0 +1,356 @@
+/******************************************************************************
+IPC - Simple cross-platform C++ IPC library
+Copyright (c) 2024, Marcus Tomlinson
+
+BSD 2-Clause License
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+******************************************************************************/
+
+#pragma once
+
+// C++20 coroutine interface, only available when building with -Dcoroutines=true
+#ifdef __cpp_impl_coroutine
+
+#include <IpcClient.h>
+#include <IpcServer.h>
+
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <utility>
+
+namespace Ipc
+{
+
+namespace Private
+{
+class ExecutorImpl;
+
+struct TaskPromiseBase
+{
+    // Resumed once the task completes, unless the task was spawned (in which case it destroys itself)
+    std::coroutine_handle<> continuation;
+    bool spawned = false;
+    std::exception_ptr exception;
+
+    struct FinalAwaiter
+    {
+        bool await_ready() noexcept
+        {
+            return false;
+        }
+
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend( std::coroutine_handle<Promise> handle ) noexcept
+        {
+            auto& promise = handle.promise();
+            if ( promise.continuation )
+            {
+                return promise.continuation;
+            }
+            if ( promise.spawned )
+            {
+                // Nobody to hand an exception to, as with an exception escaping a thread
+                if ( promise.exception )
+                {
+                    std::terminate();
+                }
+                handle.destroy();
+            }
+            return std::noop_coroutine();
+        }
+
+        void await_resume() noexcept
+        {
+        }
+    };
+
+    std::suspend_always initial_suspend() noexcept
+    {
+        return {};
+    }
+
+    FinalAwaiter final_suspend() noexcept
+    {
+        return {};
+    }
+
+    void unhandled_exception() noexcept
+    {
+        exception = std::current_exception();
+    }
+};
+}  // namespace Private
+
+// A lazily started coroutine producing a T. It starts once co_await-ed from another coroutine, which it then resumes
+// with its result, or once handed to Executor::Spawn()
+template <typename T>
+class Task final
+{
+public:
+    struct promise_type : Private::TaskPromiseBase
+    {
+        std::optional<T> value;
+
+        Task get_return_object()
+        {
+            return Task( std::coroutine_handle<promise_type>::from_promise( *this ) );
+        }
+
+        template <typename U>
+        void return_value( U&& result )
+        {
+            value.emplace( std::forward<U>( result ) );
+        }
+    };
+
+    Task( Task&& other ) noexcept
+        : handle( std::exchange( other.handle, {} ) )
+    {
+    }
+
+    Task& operator=( Task&& other ) noexcept
+    {
+        std::swap( handle, other.handle );
+        return *this;
+    }
+
+    ~Task()
+    {
+        if ( handle )
+        {
+            handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend( std::coroutine_handle<> awaiter ) noexcept
+    {
+        handle.promise().continuation = awaiter;
+        return handle;
+    }
+
+    T await_resume()
+    {
+        if ( handle.promise().exception )
+        {
+            std::rethrow_exception( handle.promise().exception );
+        }
+        return std::move( *handle.promise().value );
+    }
+
+private:
+    explicit Task( std::coroutine_handle<promise_type> handle )
+        : handle( handle )
+    {
+    }
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+template <>
+class Task<void> final
+{
+public:
+    struct promise_type : Private::TaskPromiseBase
+    {
+        Task get_return_object()
+        {
+            return Task( std::coroutine_handle<promise_type>::from_promise( *this ) );
+        }
+
+        void return_void()
+        {
+        }
+    };
+
+    Task( Task&& other ) noexcept
+        : handle( std::exchange( other.handle, {} ) )
+    {
+    }
+
+    Task& operator=( Task&& other ) noexcept
+    {
+        std::swap( handle, other.handle );
+        return *this;
+    }
+
+    ~Task()
+    {
+        if ( handle )
+        {
+            handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend( std::coroutine_handle<> awaiter ) noexcept
+    {
+        handle.promise().continuation = awaiter;
+        return handle;
+    }
+
+    void await_resume()
+    {
+        if ( handle.promise().exception )
+        {
+            std::rethrow_exception( handle.promise().exception );
+        }
+    }
+
+private:
+    friend class Executor;
+
+    explicit Task( std::coroutine_handle<promise_type> handle )
+        : handle( handle )
+    {
+    }
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+// Resumes coroutines on whichever thread calls Run(), sleeping in an epoll (or select) reactor whenever there is
+// nothing to resume. Awaitables completed on other threads, such as SendCo() on the client's I/O thread, hand their
+// coroutine back to the executor it was running on
+class Executor final
+{
+public:
+    Executor();
+    ~Executor();
+
+    Executor( const Executor& ) = delete;
+    Executor& operator=( const Executor& ) = delete;
+
+    // Queues handle to be resumed by Run() (safe to call from any thread)
+    void Post( std::coroutine_handle<> handle );
+
+    // Starts task on this executor, which owns it from then on
+    void Spawn( Task<void>&& task );
+
+    // Run() blocks, resuming posted coroutines on the calling thread, until Stop() is called and nothing is left to
+    // resume (coroutines still waiting on something are resumed by the next Run())
+    // (Use IsError() on the return Message to determine if the call was successful)
+    Message Run();
+
+    // Stop() may be called from any thread, including from a coroutine running on this executor
+    void Stop();
+
+    // The executor running on the calling thread, if any
+    static Executor* Current();
+
+private:
+    std::unique_ptr<Private::ExecutorImpl> p;
+};
+
+namespace Private
+{
+
+class SendAwaitable final
+{
+public:
+    SendAwaitable( Client& client, const Message& header, const Message& message )
+        : client( client )
+        , header( header )
+        , message( message )
+    {
+    }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    void await_suspend( std::coroutine_handle<> awaiter )
+    {
+        auto executor = Executor::Current();
+        client.SendAsync( header, message,
+                          [this, awaiter, executor]( Message response )
+                          {
+                              this->response.emplace( std::move( response ) );
+                              if ( executor )
+                              {
+                                  executor->Post( awaiter );
+                              }
+                              else
+                              {
+                                  awaiter.resume();
+                              }
+                          } );
+    }
+
+    Message await_resume()
+    {
+        return std::move( *response );
+    }
+
+private:
+    Client& client;
+    const Message& header;
+    const Message& message;
+    std::optional<Message> response;
+};
+
+using CoHandler = std::function<Task<Message>( const Message& header, const Message& message )>;
+
+// Runs one request through handler, keeping the request's views alive in its frame until the response is sent
+inline Task<void> Serve( std::shared_ptr<CoHandler> handler,
+                         Message header,
+                         Message message,
+                         std::function<void( Message response )> respond )
+{
+    respond( co_await ( *handler )( header, message ) );
+}
+
+}  // namespace Private
+
+inline Private::SendAwaitable Client::SendCo( const Message& header, const Message& message )
+{
+    return Private::SendAwaitable( *this, header, message );
+}
+
+inline Message Server::RunCo(
+    const std::function<Task<Message>( const Message& header, const Message& message )>& handler, Executor& executor )
+{
+    // Shared by every request's coroutine, any of which may outlive this call
+    auto sharedHandler = std::make_shared<Private::CoHandler>( handler );
+
+    return RunAsync(
+        [&executor, sharedHandler]( Message header, Message message, std::function<void( Message response )> respond )
+        {
+            executor.Spawn(
+                Private::Serve( sharedHandler, std::move( header ), std::move( message ), std::move( respond ) ) );
+        } );
+}
+
+}  // namespace Ipc
+
+#endif  // __cpp_impl_coroutine
@@ -0,0 +1,224 @@
+/******************************************************************************
+IPC - Simple cross-platform C++ IPC library
+Copyright (c) 2024, Marcus Tomlinson
+
+BSD 2-Clause License
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+******************************************************************************/
+
+#include <IpcMemfd.h>
+
+#include <IpcCommon.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace Ipc;
+
+#ifdef __linux__
+static const int c_seals = F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE;
+
+static std::string errorDescription( const char* call )
+{
+    return std::string( call ) + " failed (error: " + std::to_string( errno ) + ")";
+}
+#endif
+
+MemfdPayload::~MemfdPayload()
+{
+    Unmap();
+#ifdef __linux__
+    if ( fd != -1 )
+    {
+        close( fd );
+    }
+#endif
+}
+
+std::string MemfdPayload::Create( size_t payloadSize )
+{
+#ifdef __linux__
+    if ( data || fd != -1 )
+    {
+        return "payload already created";
+    }
+    if ( payloadSize == 0 )
+    {
+        return "payload can not be empty";
+    }
+
+    fd = memfd_create( "ipc-payload", MFD_CLOEXEC | MFD_ALLOW_SEALING );
+    if ( fd == -1 )
+    {
+        return errorDescription( "memfd_create()" );
+    }
+    if ( ftruncate( fd, (off_t)payloadSize ) == -1 )
+    {
+        return errorDescription( "ftruncate()" );
+    }
+
+    void* view = mmap( nullptr, payloadSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    if ( view == MAP_FAILED )
+    {
+        return errorDescription( "mmap()" );
+    }
+    data = static_cast<unsigned char*>( view );
+    size = payloadSize;
+    return "";
+#else
+    (void)payloadSize;
+    return "memfd payloads are not supported on this platform";
+#endif
+}
+
+std::string MemfdPayload::AttachTo( Message& message )
+{
+#ifdef __linux__
+    if ( fd == -1 )
+    {
+        return "payload not created";
+    }
+
+    auto error = Seal();
+    if ( !error.empty() )
+    {
+        return error;
+    }
+
+    int messageFd = fcntl( fd, F_DUPFD_CLOEXEC, 0 );
+    if ( messageFd == -1 )
+    {
+        return errorDescription( "fcntl(F_DUPFD_CLOEXEC)" );
+    }
+    message.AttachFd( messageFd );
+    return "";
+#else
+    (void)message;
+    return "memfd payloads are not supported on this platform";
+#endif
+}
+
+std::string MemfdPayload::Map( int payloadFd )
+{
+#ifdef __linux__
+    if ( data || fd != -1 )
+    {
+        return "payload already created";
+    }
+
+    // Unless sealed, the sender could rewrite the payload as we read it, or truncate it and fault us on access
+    int seals = fcntl( payloadFd, F_GET_SEALS );
+    if ( seals == -1 )
+    {
+        return errorDescription( "fcntl(F_GET_SEALS)" );
+    }
+    if ( ( seals & ( F_SEAL_WRITE | F_SEAL_SHRINK ) ) != ( F_SEAL_WRITE | F_SEAL_SHRINK ) )
+    {
+        return "payload not sealed";
+    }
+
+    struct stat status;
+    if ( fstat( payloadFd, &status ) == -1 )
+    {
+        return errorDescription( "fstat()" );
+    }
+    if ( status.st_size == 0 )
+    {
+        return "payload can not be empty";
+    }
+
+    void* view = mmap( nullptr, (size_t)status.st_size, PROT_READ, MAP_SHARED, payloadFd, 0 );
+    if ( view == MAP_FAILED )
+    {
+        return errorDescription( "mmap()" );
+    }
+    data = static_cast<unsigned char*>( view );
+    size = (size_t)status.st_size;
+    sealed = true;
+    return "";
+#else
+    (void)payloadFd;
+    return "memfd payloads are not supported on this platform";
+#endif
+}
+
+unsigned char* MemfdPayload::Data() const
+{
+    return data;
+}
+
+size_t MemfdPayload::Size() const
+{
+    return size;
+}
+
+Message MemfdPayload::AsMessage() const
+{
+    return Message( data, size );
+}
+
+// A write seal can't be added while a writable mapping exists, so the payload is remapped read-only around it
+std::string MemfdPayload::Seal()
+{
+#ifdef __linux__
+    if ( sealed )
+    {
+        return "";
+    }
+
+    Unmap();
+    if ( fcntl( fd, F_ADD_SEALS, c_seals ) == -1 )
+    {
+        return errorDescription( "fcntl(F_ADD_SEALS)" );
+    }
+    sealed = true;
+
+    struct stat status;
+    if ( fstat( fd, &status ) == -1 )
+    {
+        return errorDescription( "fstat()" );
+    }
+    void* view = mmap( nullptr, (size_t)status.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+    if ( view == MAP_FAILED )
+    {
+        return errorDescription( "mmap()" );
+    }
+    data = static_cast<unsigned char*>( view );
+    size = (size_t)status.st_size;
+#endif
+    return "";
+}
+
+void MemfdPayload::Unmap()
+{
+#ifdef __linux__
+    if ( data )
+    {
+        munmap( data, size );
+    }
+#endif
+    data = nullptr;
+    size = 0;
+}
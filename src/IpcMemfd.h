@@ -0,0 +1,90 @@
+/******************************************************************************
+IPC - Simple cross-platform C++ IPC library
+Copyright (c) 2024, Marcus Tomlinson
+
+BSD 2-Clause License
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+******************************************************************************/
+
+#pragma once
+
+#include <IpcMessage.h>
+
+#include <cstddef>
+#include <string>
+
+namespace Ipc
+{
+
+// A payload held in a sealed memfd (Linux only), passed as a file descriptor attached to a Message rather than
+// through the socket. The sender writes the payload in place and seals it, after which nobody can change or resize
+// it, so the receiver can safely map it and read it where it lies: nothing is copied either side
+//
+//   Sender:                                      Receiver:
+//     MemfdPayload payload;                        MemfdPayload payload;
+//     payload.Create( size );                      payload.Map( message.Fds()[0] );
+//     render( payload.Data(), payload.Size() );    use( payload.Data(), payload.Size() );
+//     Message message( std::string( "frame" ) );
+//     payload.AttachTo( message );
+//     client.Send( header, message );
+class MemfdPayload final
+{
+public:
+    MemfdPayload() = default;
+    ~MemfdPayload();
+
+    MemfdPayload( const MemfdPayload& ) = delete;
+    MemfdPayload& operator=( const MemfdPayload& ) = delete;
+
+    // Creates a payload of size bytes, mapped writable until sealed
+    // (Returns an empty string on success, otherwise an error description)
+    std::string Create( size_t size );
+
+    // Seals the payload against any further change, leaving it mapped read-only, and attaches a descriptor for it to
+    // message (which owns that descriptor, this payload keeps its own)
+    // (Returns an empty string on success, otherwise an error description)
+    std::string AttachTo( Message& message );
+
+    // Maps a payload received as fd read-only, provided it is sealed against writes and shrinking. The mapping
+    // outlives fd, which stays with its owner
+    // (Returns an empty string on success, otherwise an error description)
+    std::string Map( int fd );
+
+    // The payload's bytes, writable only between Create() and AttachTo()
+    unsigned char* Data() const;
+    size_t Size() const;
+
+    // A view of the payload's bytes, e.g. to hand on to code that takes a Message
+    Message AsMessage() const;
+
+private:
+    std::string Seal();
+    void Unmap();
+
+    int fd = -1;
+    unsigned char* data = nullptr;
+    size_t size = 0;
+    bool sealed = false;
+};
+
+}  // namespace Ipc
@@ -28,112 +28,226 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <IpcMessage.h>
 
+#include <IpcBufferPool.h>
+
+#include <cstring>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
 using namespace Ipc;
 
-namespace Ipc::Private
+Message::Message( unsigned char* message, size_t length )
+    : size( length )
+    , asRaw( length > 0 ? message : nullptr )
+{
+}
+
+Message::Message( const std::vector<unsigned char>& message )
 {
+    CopyFrom( message.data(), message.size() );
+}
 
-class MessageImpl
+Message::Message( const std::string& message, bool isError )
+    : isError( isError )
 {
-public:
-    MessageImpl( unsigned char* message, size_t length )
-        : size( length )
-        , asRaw( message )
+    if ( message.size() <= c_inlineSize )
     {
+        CopyFrom( reinterpret_cast<const unsigned char*>( message.data() ), message.size() );
     }
-
-    explicit MessageImpl( const std::vector<unsigned char>& message )
+    else
     {
-        size = message.size();
-        if ( size > 0 )
-        {
-            asByteVect = message;
-            asRaw = static_cast<unsigned char*>( &asByteVect[0] );
-        }
+        asString = message;
+        storage = Storage::String;
+        size = asString.size();
+        asRaw = reinterpret_cast<unsigned char*>( &asString[0] );
     }
+}
 
-    MessageImpl( const std::string& message, bool isError )
-        : isError( isError )
+Message::Message( std::vector<unsigned char>&& message )
+{
+    size = message.size();
+    if ( size > 0 )
     {
-        size = message.size();
-        if ( size > 0 )
-        {
-            asString = message;
-            asRaw = reinterpret_cast<unsigned char*>( &asString[0] );
-        }
+        asByteVect = std::move( message );
+        storage = Storage::ByteVect;
+        asRaw = asByteVect.data();
     }
+}
 
-    const std::string& AsString() const
+Message::Message( std::string&& message, bool isError )
+    : isError( isError )
+{
+    size = message.size();
+    if ( size > 0 )
     {
-        if ( size > 0 && asString.empty() )
-        {
-            const_cast<MessageImpl*>( this )->asString = std::string( reinterpret_cast<const char*>( asRaw ), size );
-        }
-
-        return asString;
+        asString = std::move( message );
+        storage = Storage::String;
+        asRaw = reinterpret_cast<unsigned char*>( &asString[0] );
     }
+}
 
-    const std::vector<unsigned char>& AsByteVect() const
-    {
-        if ( size > 0 && asByteVect.empty() )
-        {
-            const_cast<MessageImpl*>( this )->asByteVect = std::vector<unsigned char>( asRaw, asRaw + size );
-        }
+Message::~Message()
+{
+    ReturnBuffer();
+    CloseFds();
+}
 
-        return asByteVect;
+Message::Message( Message&& other ) noexcept
+{
+    MoveFrom( other );
+}
+
+Message& Message::operator=( Message&& other ) noexcept
+{
+    if ( this != &other )
+    {
+        ReturnBuffer();
+        CloseFds();
+        MoveFrom( other );
     }
+    return *this;
+}
 
-    bool isError = false;
+bool Message::IsError() const
+{
+    return isError;
+}
 
-    size_t size = 0;
-    unsigned char* asRaw = nullptr;
+size_t Message::Size() const
+{
+    return size;
+}
+
+const unsigned char* Message::AsRaw() const
+{
+    return asRaw;
+}
 
-    std::vector<unsigned char> asByteVect;
-    std::string asString;
-};
+const std::string& Message::AsString() const
+{
+    if ( size > 0 && asString.empty() )
+    {
+        asString.assign( reinterpret_cast<const char*>( asRaw ), size );
+    }
 
-}  // namespace Ipc::Private
+    return asString;
+}
 
-Message::Message( unsigned char* message, size_t length )
-    : p( std::make_unique<Private::MessageImpl>( message, length ) )
+const std::vector<unsigned char>& Message::AsByteVect() const
 {
+    if ( size > 0 && asByteVect.empty() )
+    {
+        asByteVect.assign( asRaw, asRaw + size );
+    }
+
+    // A buffer from a pool may be larger than the message (see BufferPool::Take())
+    if ( asByteVect.size() > size )
+    {
+        asByteVect.resize( size );
+    }
+
+    return asByteVect;
 }
 
-Message::Message( const std::vector<unsigned char>& message )
-    : p( std::make_unique<Private::MessageImpl>( message ) )
+std::string_view Message::AsStringView() const
 {
+    return std::string_view( reinterpret_cast<const char*>( asRaw ), size );
 }
 
-Message::Message( const std::string& message, bool isError )
-    : p( std::make_unique<Private::MessageImpl>( message, isError ) )
+void Message::AttachFd( int fd )
 {
+    fds.push_back( fd );
 }
 
-Message::~Message()
+const std::vector<int>& Message::Fds() const
 {
+    return fds;
 }
 
-bool Message::IsError() const
+std::vector<int> Message::TakeFds()
 {
-    return p->isError;
+    std::vector<int> taken;
+    taken.swap( fds );
+    return taken;
 }
 
-size_t Message::Size() const
+void Message::CopyFrom( const unsigned char* bytes, size_t length )
 {
-    return p->size;
+    size = length;
+    if ( size == 0 )
+    {
+        return;
+    }
+
+    if ( size <= c_inlineSize )
+    {
+        memcpy( inlineBytes, bytes, size );
+        storage = Storage::Inline;
+        asRaw = inlineBytes;
+    }
+    else
+    {
+        asByteVect.assign( bytes, bytes + size );
+        storage = Storage::ByteVect;
+        asRaw = asByteVect.data();
+    }
 }
 
-const unsigned char* Message::AsRaw() const
+void Message::MoveFrom( Message& other ) noexcept
 {
-    return p->asRaw;
+    isError = other.isError;
+    storage = other.storage;
+    size = other.size;
+    asByteVect = std::move( other.asByteVect );
+    asString = std::move( other.asString );
+    pool = std::move( other.pool );
+    fds = std::move( other.fds );
+
+    // asRaw may point into other's own storage, so has to be re-pointed at ours
+    switch ( storage )
+    {
+        case Storage::View:
+            asRaw = other.asRaw;
+            break;
+        case Storage::Inline:
+            memcpy( inlineBytes, other.inlineBytes, size );
+            asRaw = inlineBytes;
+            break;
+        case Storage::ByteVect:
+            asRaw = asByteVect.data();
+            break;
+        case Storage::String:
+            asRaw = reinterpret_cast<unsigned char*>( &asString[0] );
+            break;
+    }
+
+    other.isError = false;
+    other.storage = Storage::View;
+    other.size = 0;
+    other.asRaw = nullptr;
+    other.asByteVect.clear();
+    other.asString.clear();
+    other.fds.clear();
 }
 
-const std::string& Message::AsString() const
+void Message::CloseFds() noexcept
 {
-    return p->AsString();
+#ifndef _WIN32
+    for ( int fd : fds )
+    {
+        close( fd );
+    }
+#endif
+    fds.clear();
 }
 
-const std::vector<unsigned char>& Message::AsByteVect() const
+void Message::ReturnBuffer() noexcept
 {
-    return p->AsByteVect();
+    if ( pool )
+    {
+        pool->Return( std::move( asByteVect ) );
+        pool.reset();
+    }
 }
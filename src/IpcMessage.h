@@ -30,6 +30,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
 namespace Ipc
@@ -37,12 +38,14 @@ namespace Ipc
 
 namespace Private
 {
-class MessageImpl;
+class BufferPool;
+class MessageBuilder;
 }
 
 class Message final
 {
 public:
+    // A view of someone else's bytes: no copy is made, so they must outlive the Message
     Message( unsigned char* message, size_t length );
 
     // cppcheck-suppress noExplicitConstructor
@@ -51,11 +54,22 @@ public:
     // cppcheck-suppress noExplicitConstructor
     Message( const std::string& message, bool isError = false );
 
+    // Takes ownership of message's buffer, without copying it
+    // cppcheck-suppress noExplicitConstructor
+    Message( std::vector<unsigned char>&& message );
+
+    // cppcheck-suppress noExplicitConstructor
+    Message( std::string&& message, bool isError = false );
+
     ~Message();
 
     Message( const Message& ) = delete;
     Message& operator=( const Message& ) = delete;
 
+    // A moved-from Message is left empty
+    Message( Message&& other ) noexcept;
+    Message& operator=( Message&& other ) noexcept;
+
     bool IsError() const;
 
     size_t Size() const;
@@ -64,8 +78,53 @@ public:
     const std::string& AsString() const;
     const std::vector<unsigned char>& AsByteVect() const;
 
+    // Unlike AsString() and AsByteVect(), these never copy the bytes
+    std::string_view AsStringView() const;
+
+    // File descriptors passed along with the message (with SCM_RIGHTS, so not on Windows), e.g. a MemfdPayload's.
+    // The Message owns them, closing them when destroyed unless taken back with TakeFds(). Sending a message leaves
+    // its descriptors open: the receiver gets descriptors of its own for the same files
+    void AttachFd( int fd );
+    const std::vector<int>& Fds() const;
+    std::vector<int> TakeFds();
+
 private:
-    std::unique_ptr<Private::MessageImpl> p;
+    friend class Private::MessageBuilder;
+
+    // Payloads up to this size are copied inline rather than onto the heap
+    static const size_t c_inlineSize = 64;
+
+    enum class Storage : unsigned char
+    {
+        View,
+        Inline,
+        ByteVect,
+        String
+    };
+
+    Message() = default;
+
+    void CopyFrom( const unsigned char* bytes, size_t length );
+    void MoveFrom( Message& other ) noexcept;
+    void ReturnBuffer() noexcept;
+    void CloseFds() noexcept;
+
+    bool isError = false;
+    Storage storage = Storage::View;
+
+    size_t size = 0;
+    unsigned char* asRaw = nullptr;
+
+    // At most one of these owns the payload, the other is only filled in by AsString() / AsByteVect()
+    mutable std::vector<unsigned char> asByteVect;
+    mutable std::string asString;
+
+    // Set if asByteVect was taken from a pool, to which it goes back once we're done with it
+    std::shared_ptr<Private::BufferPool> pool;
+
+    std::vector<int> fds;
+
+    unsigned char inlineBytes[c_inlineSize];
 };
 
 }  // namespace Ipc
@@ -0,0 +1,139 @@
+/******************************************************************************
+IPC - Simple cross-platform C++ IPC library
+Copyright (c) 2024, Marcus Tomlinson
+
+BSD 2-Clause License
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+******************************************************************************/
+
+#pragma once
+
+#include <IpcBufferPool.h>
+#include <IpcMessage.h>
+
+#include <cstring>
+#include <vector>
+
+namespace Ipc::Private
+{
+
+// Gives the library's internals write access to a Message's storage, so received bytes can land straight in it
+class MessageBuilder final
+{
+public:
+    // A Message owning size bytes of storage: inline if small enough, otherwise taken from pool (if given) and
+    // returned to it when the Message is destroyed
+    static Message Allocate( size_t size, bool isError = false, const std::shared_ptr<BufferPool>& pool = nullptr )
+    {
+        Message message;
+        message.isError = isError;
+        message.size = size;
+        if ( size == 0 )
+        {
+            return message;
+        }
+
+        if ( size <= Message::c_inlineSize )
+        {
+            message.storage = Message::Storage::Inline;
+            message.asRaw = message.inlineBytes;
+        }
+        else
+        {
+            if ( pool )
+            {
+                message.asByteVect = pool->Take( size );
+                message.pool = pool;
+            }
+            else
+            {
+                message.asByteVect.resize( size );
+            }
+            message.storage = Message::Storage::ByteVect;
+            message.asRaw = message.asByteVect.data();
+        }
+        return message;
+    }
+
+    // message itself if it owns its bytes, otherwise a copy of the bytes it views (for holding on to a Message whose
+    // bytes may not outlive it)
+    static Message Own( Message&& message )
+    {
+        if ( message.storage != Message::Storage::View )
+        {
+            return std::move( message );
+        }
+
+        auto owned = Allocate( message.size, message.isError );
+        if ( message.size > 0 )
+        {
+            memcpy( owned.asRaw, message.asRaw, message.size );
+        }
+        owned.fds = message.TakeFds();
+        return owned;
+    }
+
+    // The parts of a streamed message joined into one, along with last (which is returned as is if it's an error), for
+    // a receiver that wants it whole. Any file descriptors that came with the parts go along too
+    static Message Join( std::vector<Message>& parts,
+                         Message&& last,
+                         const std::shared_ptr<BufferPool>& pool = nullptr )
+    {
+        if ( parts.empty() || last.IsError() )
+        {
+            parts.clear();
+            return std::move( last );
+        }
+
+        size_t size = last.size;
+        for ( auto& part : parts )
+        {
+            size += part.size;
+        }
+
+        auto joined = Allocate( size, false, pool );
+        size_t offset = 0;
+        parts.push_back( std::move( last ) );
+        for ( auto& part : parts )
+        {
+            if ( part.size > 0 )
+            {
+                memcpy( joined.asRaw + offset, part.asRaw, part.size );
+                offset += part.size;
+            }
+            for ( int fd : part.TakeFds() )
+            {
+                joined.fds.push_back( fd );
+            }
+        }
+        parts.clear();
+        return joined;
+    }
+
+    static unsigned char* Data( Message& message )
+    {
+        return message.asRaw;
+    }
+};
+
+}  // namespace Ipc::Private
@@ -0,0 +1,136 @@
+/******************************************************************************
+IPC - Simple cross-platform C++ IPC library
+Copyright (c) 2024, Marcus Tomlinson
+
+BSD 2-Clause License
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+******************************************************************************/
+
+#include <IpcMetrics.h>
+
+#include <algorithm>
+
+using namespace Ipc;
+using namespace Private;
+
+double LatencyHistogram::MeanMicroseconds() const
+{
+    return count == 0 ? 0 : totalNanoseconds / 1000.0 / count;
+}
+
+double LatencyHistogram::PercentileMicroseconds( double fraction ) const
+{
+    if ( count == 0 )
+    {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)( fraction * count );
+    uint64_t seen = 0;
+    for ( size_t i = 0; i < c_bucketCount - 1; ++i )
+    {
+        seen += buckets[i];
+        if ( seen > rank )
+        {
+            return double( uint64_t( 1 ) << i );
+        }
+    }
+    return double( uint64_t( 1 ) << ( c_bucketCount - 2 ) );
+}
+
+void AtomicHistogram::Record( std::chrono::steady_clock::duration duration )
+{
+    auto nanoseconds = (uint64_t)std::max<int64_t>(
+        0, std::chrono::duration_cast<std::chrono::nanoseconds>( duration ).count() );
+
+    // Bucket i takes durations with an i bit microsecond count
+    size_t bucket = 0;
+    for ( uint64_t microseconds = nanoseconds / 1000; microseconds > 0 && bucket < LatencyHistogram::c_bucketCount - 1;
+          microseconds >>= 1 )
+    {
+        ++bucket;
+    }
+
+    buckets[bucket].fetch_add( 1, std::memory_order_relaxed );
+    count.fetch_add( 1, std::memory_order_relaxed );
+    totalNanoseconds.fetch_add( nanoseconds, std::memory_order_relaxed );
+}
+
+void AtomicHistogram::AddTo( LatencyHistogram& snapshot ) const
+{
+    for ( size_t i = 0; i < LatencyHistogram::c_bucketCount; ++i )
+    {
+        snapshot.buckets[i] += buckets[i].load( std::memory_order_relaxed );
+    }
+    snapshot.count += count.load( std::memory_order_relaxed );
+    snapshot.totalNanoseconds += totalNanoseconds.load( std::memory_order_relaxed );
+}
+
+uint64_t Metrics::Count( Counter counter ) const
+{
+    uint64_t total = 0;
+    for ( auto& shard : shards )
+    {
+        total += shard.counters[(size_t)counter].load( std::memory_order_relaxed );
+    }
+    return total;
+}
+
+LatencyHistogram Metrics::Histogram( Phase phase ) const
+{
+    LatencyHistogram snapshot;
+    for ( auto& shard : shards )
+    {
+        shard.histograms[(size_t)phase].AddTo( snapshot );
+    }
+    return snapshot;
+}
+
+IoStats Metrics::Io() const
+{
+    IoStats io;
+    io.bytesIn = Count( Counter::BytesIn );
+    io.bytesOut = Count( Counter::BytesOut );
+    io.sendCalls = Count( Counter::SendCalls );
+    io.recvCalls = Count( Counter::RecvCalls );
+    io.waitCalls = Count( Counter::WaitCalls );
+    return io;
+}
+
+ErrorStats Metrics::Errors() const
+{
+    ErrorStats errors;
+    errors.connect = Count( Counter::ConnectErrors );
+    errors.send = Count( Counter::SendErrors );
+    errors.receive = Count( Counter::ReceiveErrors );
+    errors.protocol = Count( Counter::ProtocolErrors );
+    return errors;
+}
+
+Metrics::Shard& Metrics::ThreadShard()
+{
+    // Threads are spread over the shards in the order they first record anything
+    static std::atomic<size_t> nextThread = 0;
+    thread_local size_t threadIndex = nextThread++;
+    return shards[threadIndex % c_shardCount];
+}
@@ -0,0 +1,181 @@
+/******************************************************************************
+IPC - Simple cross-platform C++ IPC library
+Copyright (c) 2024, Marcus Tomlinson
+
+BSD 2-Clause License
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+******************************************************************************/
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace Ipc
+{
+
+// Durations counted in power of two buckets: bucket 0 holds those under 1 microsecond, bucket i those of at least
+// 2^(i-1) and under 2^i microseconds, and the last bucket everything longer
+struct LatencyHistogram
+{
+    static constexpr size_t c_bucketCount = 24;
+
+    std::array<uint64_t, c_bucketCount> buckets = {};
+    uint64_t count = 0;
+    uint64_t totalNanoseconds = 0;
+
+    double MeanMicroseconds() const;
+
+    // Upper bound of the bucket holding the given fraction of durations, e.g. 0.99 for the p99 (or the lower bound of
+    // the last bucket, which has no upper bound)
+    double PercentileMicroseconds( double fraction ) const;
+};
+
+struct IoStats
+{
+    // Bytes sent and received, through the socket or shared memory, frame headers included
+    uint64_t bytesIn = 0;
+    uint64_t bytesOut = 0;
+
+    // send() and recv() system calls made, including those that would have blocked
+    uint64_t sendCalls = 0;
+    uint64_t recvCalls = 0;
+
+    // System calls the server's receiving thread made waiting for its sockets: epoll_wait() or poll(), or with
+    // io_uring, io_uring_enter() (which also submits its receives, so those make no recv() calls)
+    uint64_t waitCalls = 0;
+};
+
+struct ErrorStats
+{
+    // connect() (client) or accept() (server) failures, and failed sends and receives
+    uint64_t connect = 0;
+    uint64_t send = 0;
+    uint64_t receive = 0;
+
+    // The peer sent something we couldn't make sense of: an invalid frame or batch, an unexpected request ID, or a
+    // shared memory ring out of step with the socket
+    uint64_t protocol = 0;
+};
+
+namespace Private
+{
+
+// A LatencyHistogram any thread can record into with relaxed atomic adds
+struct AtomicHistogram
+{
+    std::atomic<uint64_t> buckets[LatencyHistogram::c_bucketCount] = {};
+    std::atomic<uint64_t> count = 0;
+    std::atomic<uint64_t> totalNanoseconds = 0;
+
+    void Record( std::chrono::steady_clock::duration duration );
+
+    // Adds what has been recorded so far to snapshot
+    void AddTo( LatencyHistogram& snapshot ) const;
+};
+
+enum class Counter
+{
+    BytesIn,
+    BytesOut,
+    SendCalls,
+    RecvCalls,
+    WaitCalls,
+    Requests,
+    ConnectionsOpened,
+    ConnectionsClosed,
+    ConnectErrors,
+    SendErrors,
+    ReceiveErrors,
+    ProtocolErrors,
+    Count
+};
+
+// The client and server each time their own subset of these
+enum class Phase
+{
+    Connect,
+    AckWait,
+    Send,
+    Response,
+    RoundTrip,
+    Receive,
+    QueueWait,
+    Callback,
+    Count
+};
+
+// Hot path counters and latency histograms. Each thread accumulates into one of a fixed set of shards with relaxed
+// atomic adds, so recording takes no lock and rarely contends, and Stats() sums the shards into a snapshot
+class Metrics final
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    Metrics() = default;
+
+    Metrics( const Metrics& ) = delete;
+    Metrics& operator=( const Metrics& ) = delete;
+
+    void Add( Counter counter, uint64_t amount = 1 )
+    {
+        ThreadShard().counters[(size_t)counter].fetch_add( amount, std::memory_order_relaxed );
+    }
+
+    // Records the time since start
+    void Record( Phase phase, Clock::time_point start )
+    {
+        Record( phase, Clock::now() - start );
+    }
+
+    void Record( Phase phase, Clock::duration duration )
+    {
+        ThreadShard().histograms[(size_t)phase].Record( duration );
+    }
+
+    uint64_t Count( Counter counter ) const;
+    LatencyHistogram Histogram( Phase phase ) const;
+    IoStats Io() const;
+    ErrorStats Errors() const;
+
+private:
+    static constexpr size_t c_shardCount = 16;
+
+    // Kept a cache line apart, so threads recording into neighbouring shards don't contend either
+    struct alignas( 64 ) Shard
+    {
+        std::atomic<uint64_t> counters[(size_t)Counter::Count] = {};
+        AtomicHistogram histograms[(size_t)Phase::Count];
+    };
+
+    Shard& ThreadShard();
+
+    Shard shards[c_shardCount];
+};
+
+}  // namespace Private
+
+}  // namespace Ipc
@@ -0,0 +1,275 @@
+/******************************************************************************
+IPC - Simple cross-platform C++ IPC library
+Copyright (c) 2024, Marcus Tomlinson
+
+BSD 2-Clause License
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+******************************************************************************/
+
+#include <IpcPoller.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+using namespace Ipc::Private;
+
+#ifdef __linux__
+
+static const int c_maxEvents = 256;
+
+Poller::Poller()
+{
+    epollFd = epoll_create1( EPOLL_CLOEXEC );
+    if ( epollFd == -1 )
+    {
+        initError = "epoll_create1() failed (error: " + std::to_string( lastError() ) + ")";
+        return;
+    }
+
+    wakeFd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    if ( wakeFd == -1 || !Add( wakeFd, &wakeFd ) )
+    {
+        initError = "eventfd() failed (error: " + std::to_string( lastError() ) + ")";
+    }
+}
+
+Poller::~Poller()
+{
+    if ( wakeFd != -1 )
+    {
+        close( wakeFd );
+    }
+    if ( epollFd != -1 )
+    {
+        close( epollFd );
+    }
+}
+
+bool Poller::Add( SOCKET socket, void* context )
+{
+    epoll_event event = {};
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = context;
+    return epoll_ctl( epollFd, EPOLL_CTL_ADD, socket, &event ) == 0;
+}
+
+void Poller::Remove( SOCKET socket )
+{
+    epoll_ctl( epollFd, EPOLL_CTL_DEL, socket, nullptr );
+}
+
+bool Poller::Wait( std::vector<void*>& ready, int timeoutMs )
+{
+    ready.clear();
+
+    epoll_event events[c_maxEvents];
+    int eventCount = 0;
+    do
+    {
+        eventCount = epoll_wait( epollFd, events, c_maxEvents, timeoutMs );
+    } while ( eventCount == -1 && errno == EINTR );
+
+    if ( eventCount == -1 )
+    {
+        return false;
+    }
+
+    for ( int i = 0; i < eventCount; ++i )
+    {
+        if ( events[i].data.ptr == &wakeFd )
+        {
+            DrainWakes();
+            continue;
+        }
+        ready.push_back( events[i].data.ptr );
+    }
+    return true;
+}
+
+void Poller::Wake()
+{
+    uint64_t one = 1;
+    while ( write( wakeFd, &one, sizeof( one ) ) == -1 && errno == EINTR )
+    {
+    }
+}
+
+void Poller::DrainWakes()
+{
+    uint64_t count = 0;
+    while ( read( wakeFd, &count, sizeof( count ) ) > 0 )
+    {
+    }
+}
+
+#else
+
+#ifdef _WIN32
+static const short c_pollEvents = POLLRDNORM;
+#else
+static const short c_pollEvents = POLLIN;
+#endif
+
+Poller::Poller()
+{
+#ifdef _WIN32
+    WSADATA wsd;
+    if ( WSAStartup( WINSOCK_VERSION, &wsd ) != 0 )
+    {
+        initError = "WSAStartup() failed";
+        return;
+    }
+
+    // A UDP socket connected to itself, as WSAPoll() only takes sockets
+    wakeReadSocket = socket( AF_INET, SOCK_DGRAM, IPPROTO_UDP );
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    int addrLength = sizeof( addr );
+    if ( wakeReadSocket == INVALID_SOCKET ||
+         bind( wakeReadSocket, reinterpret_cast<const sockaddr*>( &addr ), sizeof( addr ) ) == SOCKET_ERROR ||
+         getsockname( wakeReadSocket, reinterpret_cast<sockaddr*>( &addr ), &addrLength ) == SOCKET_ERROR ||
+         connect( wakeReadSocket, reinterpret_cast<const sockaddr*>( &addr ), addrLength ) == SOCKET_ERROR )
+    {
+        initError = "wake socket setup failed (error: " + std::to_string( lastError() ) + ")";
+        return;
+    }
+    wakeWriteSocket = wakeReadSocket;
+#else
+    int fds[2];
+    if ( pipe( fds ) == -1 )
+    {
+        initError = "pipe() failed (error: " + std::to_string( lastError() ) + ")";
+        return;
+    }
+    wakeReadSocket = fds[0];
+    wakeWriteSocket = fds[1];
+    setNonBlocking( wakeWriteSocket );
+#endif
+    setNonBlocking( wakeReadSocket );
+    Add( wakeReadSocket, nullptr );
+}
+
+Poller::~Poller()
+{
+    if ( wakeReadSocket != INVALID_SOCKET )
+    {
+        closesocket( wakeReadSocket );
+    }
+#ifdef _WIN32
+    WSACleanup();
+#else
+    if ( wakeWriteSocket != INVALID_SOCKET )
+    {
+        close( wakeWriteSocket );
+    }
+#endif
+}
+
+bool Poller::Add( SOCKET socket, void* context )
+{
+    pollFds.push_back( {} );
+    pollFds.back().fd = socket;
+    pollFds.back().events = c_pollEvents;
+    contexts.push_back( context );
+    return true;
+}
+
+void Poller::Remove( SOCKET socket )
+{
+    for ( size_t i = 1; i < pollFds.size(); ++i )
+    {
+        if ( pollFds[i].fd == socket )
+        {
+            pollFds.erase( pollFds.begin() + i );
+            contexts.erase( contexts.begin() + i );
+            return;
+        }
+    }
+}
+
+bool Poller::Wait( std::vector<void*>& ready, int timeoutMs )
+{
+    ready.clear();
+
+#ifdef _WIN32
+    int result = WSAPoll( pollFds.data(), (ULONG)pollFds.size(), timeoutMs );
+#else
+    int result = poll( pollFds.data(), (nfds_t)pollFds.size(), timeoutMs );
+    if ( result < 0 && errno == EINTR )
+    {
+        return true;
+    }
+#endif
+    if ( result < 0 )
+    {
+        return false;
+    }
+
+    // Hang-ups and errors count as readable too, so that the caller finds out through its next read
+    if ( pollFds[0].revents != 0 )
+    {
+        DrainWakes();
+    }
+    for ( size_t i = 1; i < pollFds.size(); ++i )
+    {
+        if ( pollFds[i].revents != 0 )
+        {
+            ready.push_back( contexts[i] );
+        }
+    }
+    return true;
+}
+
+void Poller::Wake()
+{
+    char one = 1;
+#ifdef _WIN32
+    send( wakeWriteSocket, &one, 1, 0 );
+#else
+    while ( write( wakeWriteSocket, &one, 1 ) == -1 && errno == EINTR )
+    {
+    }
+#endif
+}
+
+void Poller::DrainWakes()
+{
+    char bytes[64];
+#ifdef _WIN32
+    while ( recv( wakeReadSocket, bytes, sizeof( bytes ), 0 ) > 0 )
+#else
+    while ( read( wakeReadSocket, bytes, sizeof( bytes ) ) > 0 )
+#endif
+    {
+    }
+}
+
+#endif
+
+const std::string& Poller::InitError() const
+{
+    return initError;
+}
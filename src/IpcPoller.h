@@ -0,0 +1,88 @@
+/******************************************************************************
+IPC - Simple cross-platform C++ IPC library
+Copyright (c) 2024, Marcus Tomlinson
+
+BSD 2-Clause License
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+******************************************************************************/
+
+#pragma once
+
+#include <IpcCommon.h>
+
+#include <vector>
+
+namespace Ipc::Private
+{
+
+// Waits for any of a set of sockets to become readable. Uses edge-triggered epoll on Linux, so after each wakeup
+// callers must read from a ready socket until it would block. Elsewhere falls back to poll() (WSAPoll() on Windows),
+// which takes any number of sockets but goes through all of them on every wait. Any thread can interrupt a Wait()
+// with Wake(), through an eventfd on Linux, a self-pipe on other POSIX systems, or a loopback UDP socket on Windows
+class Poller final
+{
+public:
+    Poller();
+    ~Poller();
+
+    Poller( const Poller& ) = delete;
+    Poller& operator=( const Poller& ) = delete;
+
+    // Returns an empty string on success, otherwise an error description
+    const std::string& InitError() const;
+
+    // context is handed back by Wait() whenever socket becomes readable (or its peer hangs up)
+    bool Add( SOCKET socket, void* context );
+    void Remove( SOCKET socket );
+
+    // Blocks until at least one socket is readable (or timeoutMs elapses, -1 to wait forever), replacing the
+    // contents of ready with their contexts. Returns false on error
+    bool Wait( std::vector<void*>& ready, int timeoutMs = -1 );
+
+    // Makes the current or next Wait() return, if need be with nothing ready
+    void Wake();
+
+private:
+    std::string initError;
+
+#ifdef __linux__
+    int epollFd = -1;
+    int wakeFd = -1;
+#else
+    // The wake socket first, then the sockets added, with their contexts alongside
+#ifdef _WIN32
+    std::vector<WSAPOLLFD> pollFds;
+#else
+    std::vector<pollfd> pollFds;
+#endif
+    std::vector<void*> contexts;
+
+    // The same socket on Windows, the two ends of a pipe elsewhere
+    SOCKET wakeReadSocket = INVALID_SOCKET;
+    SOCKET wakeWriteSocket = INVALID_SOCKET;
+#endif
+
+    void DrainWakes();
+};
+
+}  // namespace Ipc::Private
@@ -0,0 +1,121 @@
+/******************************************************************************
+IPC - Simple cross-platform C++ IPC library
+Copyright (c) 2024, Marcus Tomlinson
+
+BSD 2-Clause License
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+******************************************************************************/
+
+#include <IpcRoutes.h>
+
+#include <IpcServer.h>
+
+#include <cstring>
+
+using namespace Ipc;
+using namespace Private;
+
+std::string Routes::Add( const Message& key, const Handler& handler )
+{
+    if ( !handler )
+    {
+        return "no handler given";
+    }
+    if ( key.Size() == 0 )
+    {
+        // No request ever has an empty header, so the route could never be taken
+        return "header can not be empty";
+    }
+    if ( Find( key.AsRaw(), key.Size() ) )
+    {
+        return "header already registered: " + key.AsString();
+    }
+
+    auto route = std::make_unique<Route>();
+    route->key.assign( key.AsRaw(), key.AsRaw() + key.Size() );
+    route->hash = Hash( key.AsRaw(), key.Size() );
+    route->handler = handler;
+    routes.push_back( std::move( route ) );
+
+    // Lay the table out afresh at no more than half full
+    size_t slotCount = 4;
+    while ( slotCount < routes.size() * 2 )
+    {
+        slotCount *= 2;
+    }
+    slots.assign( slotCount, 0 );
+    for ( size_t i = 0; i < routes.size(); ++i )
+    {
+        size_t slot = routes[i]->hash & ( slotCount - 1 );
+        while ( slots[slot] != 0 )
+        {
+            slot = ( slot + 1 ) & ( slotCount - 1 );
+        }
+        slots[slot] = (uint32_t)( i + 1 );
+    }
+    return "";
+}
+
+Routes::Route* Routes::Find( const unsigned char* header, size_t size ) const
+{
+    if ( slots.empty() )
+    {
+        return nullptr;
+    }
+
+    uint64_t hash = Hash( header, size );
+    for ( size_t slot = hash & ( slots.size() - 1 ); slots[slot] != 0; slot = ( slot + 1 ) & ( slots.size() - 1 ) )
+    {
+        auto& route = *routes[slots[slot] - 1];
+        if ( route.hash == hash && route.key.size() == size &&
+             ( size == 0 || memcmp( route.key.data(), header, size ) == 0 ) )
+        {
+            return &route;
+        }
+    }
+    return nullptr;
+}
+
+std::vector<RouteStats> Routes::Stats() const
+{
+    std::vector<RouteStats> stats( routes.size() );
+    for ( size_t i = 0; i < routes.size(); ++i )
+    {
+        auto& route = *routes[i];
+        stats[i].header.assign( route.key.begin(), route.key.end() );
+        stats[i].requests = route.requests.load( std::memory_order_relaxed );
+        stats[i].errors = route.errors.load( std::memory_order_relaxed );
+        route.latency.AddTo( stats[i].latency );
+    }
+    return stats;
+}
+
+uint64_t Routes::Hash( const unsigned char* data, size_t size )
+{
+    uint64_t hash = 14695981039346656037ull;
+    for ( size_t i = 0; i < size; ++i )
+    {
+        hash = ( hash ^ data[i] ) * 1099511628211ull;
+    }
+    return hash;
+}
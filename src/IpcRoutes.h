@@ -0,0 +1,102 @@
+/******************************************************************************
+IPC - Simple cross-platform C++ IPC library
+Copyright (c) 2024, Marcus Tomlinson
+
+BSD 2-Clause License
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+******************************************************************************/
+
+#pragma once
+
+#include <IpcMessage.h>
+#include <IpcMetrics.h>
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Ipc
+{
+struct RouteStats;
+}
+
+namespace Ipc::Private
+{
+
+// Request handlers by header (see Server::Register()), looked up by a request's raw header bytes without allocating.
+// The routes' hashes are laid out in an open addressing table, rebuilt as each route is added to stay at most half
+// full, so a lookup costs one hash of the header and (nearly always) a single probe and compare
+class Routes final
+{
+public:
+    using Handler = std::function<Message( const Message& header, const Message& message )>;
+
+    struct Route
+    {
+        std::vector<unsigned char> key;
+        uint64_t hash = 0;
+        Handler handler;
+
+        // Requests handled, those answered with an error, and the time spent in handler
+        std::atomic<uint64_t> requests = 0;
+        std::atomic<uint64_t> errors = 0;
+        AtomicHistogram latency;
+
+        void Record( Metrics::Clock::time_point start, bool failed )
+        {
+            latency.Record( Metrics::Clock::now() - start );
+            requests.fetch_add( 1, std::memory_order_relaxed );
+            if ( failed )
+            {
+                errors.fetch_add( 1, std::memory_order_relaxed );
+            }
+        }
+    };
+
+    Routes() = default;
+
+    Routes( const Routes& ) = delete;
+    Routes& operator=( const Routes& ) = delete;
+
+    // Returns an empty string on success, otherwise an error description
+    std::string Add( const Message& key, const Handler& handler );
+
+    // The route for the given header, or nullptr if it has none
+    Route* Find( const unsigned char* header, size_t size ) const;
+
+    // A snapshot of each route's counters, in the order they were added
+    std::vector<RouteStats> Stats() const;
+
+private:
+    // FNV-1a, which is quick for keys as short as headers tend to be
+    static uint64_t Hash( const unsigned char* data, size_t size );
+
+    // Indexes into routes plus one (0 marking an empty slot), a power of two of them
+    std::vector<uint32_t> slots;
+    std::vector<std::unique_ptr<Route>> routes;
+};
+
+}  // namespace Ipc::Private
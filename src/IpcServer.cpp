@@ -30,17 +30,175 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <IpcCommon.h>
 #include <IpcMessage.h>
+#include <IpcMessageBuilder.h>
+#include <IpcPoller.h>
+#include <IpcRoutes.h>
+#include <IpcSharedMemory.h>
+#include <IpcUring.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
 using namespace Ipc;
 
 namespace Ipc::Private
 {
 
+using StreamCallback = std::function<Message( const Message& header, const Message& message, Stream& stream )>;
+using AsyncCallback =
+    std::function<void( Message header, Message message, std::function<void( Message response )> respond )>;
+
+class Connection;
+struct RequestStream;
+
+// A batch request, whose items are dispatched as requests of their own (so Run() may handle them in parallel). Their
+// responses are held here until the last one is in, then go back together
+struct Batch
+{
+    // From the buffer pool, so possibly larger than payloadSize
+    std::vector<unsigned char> payload;
+    size_t payloadSize = 0;
+    std::vector<Message> responses;
+    std::atomic<size_t> remaining = 0;
+};
+
+struct Request
+{
+    std::shared_ptr<Connection> connection;
+
+    // The header and message, back to back in one receive buffer (from the buffer pool, so possibly larger than
+    // payloadSize)
+    std::vector<unsigned char> payload;
+    size_t payloadSize = 0;
+    size_t headerSize = 0;
+
+    // File descriptors passed with the message, handed to it on dispatch (and closed by Recycle() otherwise)
+    std::vector<int> fds;
+
+    // Echoed in the response frame, so the client can match it to this request
+    uint64_t requestId = 0;
+
+    // Set for an item of a batch, whose header and message lie at batchOffset in the batch's payload instead
+    std::shared_ptr<Batch> batch;
+    size_t batchItem = 0;
+    size_t batchOffset = 0;
+    size_t batchSize = 0;
+
+    // When Run() queued it for a worker
+    Metrics::Clock::time_point queuedAt;
+
+    // Set for a streamed request, whose later parts arrive on stream
+    std::shared_ptr<RequestStream> stream;
+
+    // Parts of the response written ahead of the rest for an item of a batch, joined with it once the callback returns
+    std::vector<Message> parts;
+
+    unsigned char* Data()
+    {
+        return batch ? batch->payload.data() + batchOffset : payload.data();
+    }
+
+    size_t Size() const
+    {
+        return batch ? batchSize : payloadSize;
+    }
+};
+
+// The parts of a streamed request after its first, queued by the thread receiving requests for the callback reading
+// them (see Stream::Read())
+struct RequestStream
+{
+    struct Part
+    {
+        Request request;
+        bool last = false;
+    };
+
+    std::mutex mutex;
+    std::condition_variable arrived;
+    std::deque<Part> parts;
+
+    // Set if the client hung up before sending the last part
+    bool closed = false;
+
+    // Set once the callback has returned, after which any further parts are dropped
+    bool abandoned = false;
+
+    // Only touched by the callback: whether it has read the last part, and the part it read last (kept until the next
+    // Read(), as it was handed a view of it)
+    bool finished = false;
+    Request current;
+};
+
+// An accepted connection, shared by the thread receiving requests and any worker responding on it. The socket is
+// closed once neither needs it any more
+class Connection final
+{
+public:
+    explicit Connection( SOCKET socket )
+        : socket( socket )
+    {
+    }
+
+    ~Connection()
+    {
+        closeFds( receivedFds );
+        closeFds( partialRequest.fds );
+        closesocket( socket );
+    }
+
+    Connection( const Connection& ) = delete;
+    Connection& operator=( const Connection& ) = delete;
+
+    const SOCKET socket;
+    std::mutex sendMutex;
+
+    // Set up at the client's request, before any request that uses it is received
+    std::unique_ptr<SharedMemory> sharedMemory;
+
+    // Receive state machine, only touched by the thread waiting for requests. A request may arrive over any number
+    // of reads, each stage tracks how much of its frame header, header, or message has been received so far
+    enum class ReadStage
+    {
+        Frame,
+        Header,
+        Message
+    };
+
+    ReadStage readStage = ReadStage::Frame;
+    size_t stageReceived = 0;
+    unsigned char frameBytes[c_frameHeaderSize] = {};
+    FrameHeader frame;
+    Request partialRequest;
+    Metrics::Clock::time_point frameReceivedAt;
+
+    // Bytes read ahead of the current stage (headers and messages larger than this are read directly into place)
+    std::vector<unsigned char> stagingBuffer;
+
+    // File descriptors received ahead of the frame that claims them
+    std::vector<int> receivedFds;
+
+    // Streamed requests whose last part is yet to arrive, by request ID (only touched by the thread waiting for
+    // requests)
+    std::unordered_map<uint64_t, std::shared_ptr<RequestStream>> streams;
+
+    // With io_uring, set once the connection is dropped and its socket shut down for reading, until its receive
+    // completes for the last time
+    bool closing = false;
+};
+
 class ServerImpl final
 {
 public:
-    explicit ServerImpl( const std::filesystem::path& path )
+    ServerImpl( const std::filesystem::path& path, const ServerOptions& options )
         : socketPath( path.string() )
+        , options( options )
+        , bufferPool( options.bufferPool )
     {
         std::error_code err;
         std::filesystem::create_directories( path.parent_path(), err );
@@ -60,8 +218,8 @@ public:
             return;
         }
 
-        // Create a AF_UNIX stream server socket
-        serverSocket = socket( AF_UNIX, SOCK_STREAM, 0 );
+        // Create a AF_UNIX server socket of the type asked for
+        serverSocket = socket( AF_UNIX, socketTypeOf( options.socketType ), 0 );
         if ( serverSocket == INVALID_SOCKET )
         {
             initError = "socket() failed (error: " + std::to_string( lastError() ) + ")";
@@ -72,20 +230,6 @@ public:
         socketAddr.sun_family = AF_UNIX;
         strncpy( socketAddr.sun_path, socketPath.c_str(), socketPath.length() );
 
-#ifdef _WIN32
-        int timeout = 2000;
-        setsockopt( serverSocket, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<const char*>( &timeout ),
-                    sizeof( timeout ) );
-        setsockopt( serverSocket, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>( &timeout ),
-                    sizeof( timeout ) );
-#else
-        struct timeval timeout;
-        timeout.tv_sec = 2;
-        timeout.tv_usec = 0;
-        setsockopt( serverSocket, SOL_SOCKET, SO_SNDTIMEO, static_cast<const void*>( &timeout ), sizeof( timeout ) );
-        setsockopt( serverSocket, SOL_SOCKET, SO_RCVTIMEO, static_cast<const void*>( &timeout ), sizeof( timeout ) );
-#endif
-
         // Bind the socket to the path
         remove( socketPath.c_str() );
         if ( bind( serverSocket, reinterpret_cast<const sockaddr*>( &socketAddr ), sizeof( socketAddr ) ) ==
@@ -105,10 +249,43 @@ public:
             serverSocket = INVALID_SOCKET;
             return;
         }
+
+        // Receive through io_uring if asked to and the kernel allows it, otherwise through the poller
+        if ( options.ioUring && options.socketType == SocketType::Stream )
+        {
+            uring = std::make_unique<Uring>();
+            if ( !uring->InitError().empty() || !setNonBlocking( serverSocket ) ||
+                 !uring->Accept( serverSocket, nullptr ) )
+            {
+                uring.reset();
+            }
+        }
+        if ( uring )
+        {
+            return;
+        }
+
+        // Wait for connections and requests together, without blocking on any one client
+        if ( !poller.InitError().empty() )
+        {
+            initError = poller.InitError();
+            closesocket( serverSocket );
+            serverSocket = INVALID_SOCKET;
+            return;
+        }
+        if ( !setNonBlocking( serverSocket ) || !poller.Add( serverSocket, nullptr ) )
+        {
+            initError = "poller setup failed (error: " + std::to_string( lastError() ) + ")";
+            closesocket( serverSocket );
+            serverSocket = INVALID_SOCKET;
+            return;
+        }
     }
 
     ~ServerImpl()
     {
+        connections.clear();
+
         if ( serverSocket != INVALID_SOCKET )
         {
             closesocket( serverSocket );
@@ -120,178 +297,1248 @@ public:
 #endif
     }
 
-    Message Listen( const std::function<Message( const Message& header, const Message& message )>& callback )
+    Message Register( const Message& headerKey, const Routes::Handler& handler )
+    {
+        auto error = routes.Add( headerKey, handler );
+        return error.empty() ? Message( "" ) : Message( error, true );
+    }
+
+    Message Listen( const StreamCallback& callback )
     {
         if ( serverSocket == INVALID_SOCKET )
         {
             return Message( initError, true );
         }
 
-        // Accept a connection
-        fd_set fd;
-        FD_ZERO( &fd );
-        FD_SET( serverSocket, &fd );
-
-        if ( select( (int)serverSocket + 1, &fd, nullptr, nullptr, nullptr ) <= 0 )
+        Request request;
+        bool fatal = false;
+        auto error = WaitForRequest( request, fatal );
+        if ( !error.empty() )
+        {
+            return Message( error, true );
+        }
+        if ( !request.connection )
         {
-            return Message( "select() failed (error: " + std::to_string( lastError() ) + ")", true );
+            return Message( "" );
         }
 
-        SOCKET clientSocket = accept( serverSocket, NULL, NULL );
-        if ( clientSocket == INVALID_SOCKET )
+        // Send some data
+        error = Dispatch( callback, request );
+        if ( !error.empty() )
         {
-            return Message( "accept() failed (error: " + std::to_string( lastError() ) + ")", true );
+            return Message( error, true );
         }
 
-#ifdef _WIN32
-        int timeoutMs = 2000;
+        return Message( "" );
+    }
 
-        setsockopt( clientSocket, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<const char*>( &timeoutMs ),
-                    sizeof( timeoutMs ) );
-        setsockopt( clientSocket, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>( &timeoutMs ),
-                    sizeof( timeoutMs ) );
-#else
-        struct timeval timeout;
-        timeout.tv_sec = 2;
-        timeout.tv_usec = 0;
+    Message Run( const StreamCallback& callback, const RunOptions& options, bool streaming )
+    {
+        if ( serverSocket == INVALID_SOCKET )
+        {
+            return Message( initError, true );
+        }
+        this->streaming = streaming;
 
-        setsockopt( clientSocket, SOL_SOCKET, SO_SNDTIMEO, static_cast<const void*>( &timeout ), sizeof( timeout ) );
-        setsockopt( clientSocket, SOL_SOCKET, SO_RCVTIMEO, static_cast<const void*>( &timeout ), sizeof( timeout ) );
-#endif
+        size_t workerCount = options.workerCount;
+        if ( workerCount == 0 )
+        {
+            workerCount = std::max<size_t>( 1, std::thread::hardware_concurrency() );
+        }
+        queue.resize( std::max<size_t>( 1, options.queueCapacity ) );
+        queueHead = 0;
+
+        std::vector<std::thread> workers;
+        for ( size_t i = 0; i < workerCount; ++i )
+        {
+            workers.emplace_back(
+                [this, &callback]
+                {
+                    Request request;
+                    while ( PopRequest( request ) )
+                    {
+                        Dispatch( callback, request );
+                        ++requestsCompleted;
+                    }
+                } );
+        }
 
-        // Receive header data
-        auto recvHeaderBytes = Receive( clientSocket );
-        if ( recvHeaderBytes.empty() )
+        // Receive requests on this thread, handing each one to the worker pool
+        std::string error;
+        while ( true )
         {
-            if ( lastError() == 0 || lastError() == EINVAL )
+            Request request;
+            bool fatal = false;
+            auto requestError = WaitForRequest( request, fatal );
+            if ( fatal )
             {
-                closesocket( clientSocket );
-                return Message( "" );
+                error = requestError;
+                break;
+            }
+            if ( requestError.empty() && !request.connection )
+            {
+                break;
+            }
+            if ( requestError.empty() )
+            {
+                PushRequest( std::move( request ) );
             }
+        }
 
-            closesocket( clientSocket );
-            return Message( "header recv() failed (error: " + std::to_string( lastError() ) + ")", true );
+        // No more parts of streamed requests will be received, so callbacks reading them mustn't wait for any
+        for ( auto& connection : connections )
+        {
+            EndStreams( *connection.second );
         }
+        this->streaming = false;
 
-        // Send ack
-        if ( !Send( clientSocket, std::vector<unsigned char>{ 1 } ) )
+        // Let the workers drain whatever is still queued, for up to drainTimeout, then stop them. Requests received
+        // but not yet queued (the rest of a batch, say) are queued first, as room frees up
+        auto drainDeadline = std::chrono::steady_clock::now() + options.drainTimeout;
+        std::vector<Request> abandoned;
         {
-            closesocket( clientSocket );
-            return Message( "ack send() failed (error: " + std::to_string( lastError() ) + ")", true );
+            std::unique_lock<std::mutex> lock( queueMutex );
+            Request request;
+            while ( TakeReadyRequest( request ) )
+            {
+                if ( queueNotFull.wait_until( lock, drainDeadline, [this] { return queueSize < queue.size(); } ) )
+                {
+                    Enqueue( std::move( request ) );
+                    queueNotEmpty.notify_one();
+                }
+                else
+                {
+                    abandoned.push_back( std::move( request ) );
+                }
+            }
+
+            queueClosed = true;
+            queueNotEmpty.notify_all();
+            if ( !queueNotFull.wait_until( lock, drainDeadline, [this] { return queueSize == 0; } ) )
+            {
+                for ( ; queueSize > 0; --queueSize )
+                {
+                    abandoned.push_back( std::move( queue[queueHead] ) );
+                    queueHead = ( queueHead + 1 ) % queue.size();
+                }
+            }
         }
 
-        // Receive message data
-        auto recvMessageBytes = Receive( clientSocket );
-        if ( recvMessageBytes.empty() )
+        // Requests no worker got to in time are answered with an error, rather than left waiting
+        for ( auto& request : abandoned )
         {
-            closesocket( clientSocket );
-            return Message( "message recv() failed (error: " + std::to_string( lastError() ) + ")", true );
+            Respond( request, Message( "server stopped before handling request", true ) );
+            Recycle( request );
         }
 
-        // Send some data
-        auto sendMessage = callback( recvHeaderBytes, recvMessageBytes );
-        if ( !Send( clientSocket, sendMessage ) )
+        for ( auto& worker : workers )
         {
-            closesocket( clientSocket );
-            return Message( "response send() failed (error: " + std::to_string( lastError() ) + ")", true );
+            worker.join();
         }
 
-        closesocket( clientSocket );
+        queueClosed = false;
+
+        if ( !error.empty() )
+        {
+            return Message( error, true );
+        }
         return Message( "" );
     }
 
-    Message StopListening() const
+    Message RunAsync( const AsyncCallback& callback )
     {
-        SOCKET clientSocket = socket( AF_UNIX, SOCK_STREAM, PF_UNSPEC );
-        if ( clientSocket == INVALID_SOCKET )
+        if ( serverSocket == INVALID_SOCKET )
         {
-            return Message( "socket() failed (error: " + std::to_string( lastError() ) + ")", true );
+            return Message( initError, true );
         }
 
-        if ( connect( clientSocket, reinterpret_cast<const sockaddr*>( &socketAddr ), sizeof( socketAddr ) ) ==
-             SOCKET_ERROR )
+        while ( true )
+        {
+            Request request;
+            bool fatal = false;
+            auto error = WaitForRequest( request, fatal );
+            if ( fatal )
+            {
+                return Message( error, true );
+            }
+            if ( error.empty() && !request.connection )
+            {
+                // Requests received but not yet dispatched (the rest of a batch, say) still get their responses
+                while ( TakeReadyRequest( request ) )
+                {
+                    DispatchAsync( callback, std::move( request ) );
+                }
+                return Message( "" );
+            }
+            if ( error.empty() )
+            {
+                DispatchAsync( callback, std::move( request ) );
+            }
+        }
+    }
+
+    Message StopListening()
+    {
+        if ( serverSocket == INVALID_SOCKET )
         {
-            closesocket( clientSocket );
-            return Message( "connect() failed (error: " + std::to_string( lastError() ) + ")", true );
+            return Message( initError, true );
         }
 
-        closesocket( clientSocket );
+        // Interrupts the poller directly, so this neither needs the socket path nor waits on any client
+        stopRequested = true;
+        if ( uring )
+        {
+            uring->Wake();
+        }
+        else
+        {
+            poller.Wake();
+        }
         return Message( "" );
     }
 
-    static bool Send( SOCKET clientSocket, const Message& message )
+    ServerStats Stats()
+    {
+        ServerStats stats;
+        stats.requestsQueued = requestsQueued;
+        stats.requestsCompleted = requestsCompleted;
+
+        std::lock_guard<std::mutex> lock( queueMutex );
+        stats.queueDepth = queueSize;
+        stats.maxQueueDepth = maxQueueDepth;
+        stats.queueFullWaits = queueFullWaits;
+
+        stats.ioUring = uring != nullptr;
+        stats.requestsReceived = metrics.Count( Counter::Requests );
+        stats.connectionsAccepted = metrics.Count( Counter::ConnectionsOpened );
+        stats.activeConnections = stats.connectionsAccepted - metrics.Count( Counter::ConnectionsClosed );
+        stats.io = metrics.Io();
+        stats.errors = metrics.Errors();
+        stats.receiveLatency = metrics.Histogram( Phase::Receive );
+        stats.queueLatency = metrics.Histogram( Phase::QueueWait );
+        stats.callbackLatency = metrics.Histogram( Phase::Callback );
+        stats.sendLatency = metrics.Histogram( Phase::Send );
+
+        stats.bufferPool = bufferPool.Stats();
+        stats.routes = routes.Stats();
+        return stats;
+    }
+
+    // Waits for the next complete request from any client, accepting new connections along the way
+    // (Returns an empty string on success, otherwise an error description. fatal is set if the error was not
+    // specific to one connection. request.connection is left null if StopListening() was called, in which case any
+    // requests already received are left for TakeReadyRequest())
+    std::string WaitForRequest( Request& request, bool& fatal )
+    {
+        std::string error;
+        while ( !stopRequested && nextReadyRequest == readyRequests.size() && error.empty() )
+        {
+            if ( uring )
+            {
+                error = ReceiveCompletions( fatal );
+                if ( fatal )
+                {
+                    return error;
+                }
+                continue;
+            }
+
+            metrics.Add( Counter::WaitCalls );
+            if ( !poller.Wait( readyContexts ) )
+            {
+                fatal = true;
+                return "poll failed (error: " + std::to_string( lastError() ) + ")";
+            }
+
+            // Every ready socket has to be drained before waiting again, even once we have a request or an error
+            for ( auto context : readyContexts )
+            {
+                if ( context == nullptr )
+                {
+                    auto acceptError = AcceptConnections( fatal );
+                    if ( fatal )
+                    {
+                        return acceptError;
+                    }
+                    continue;
+                }
+
+                auto it = connections.find( static_cast<Connection*>( context ) );
+                if ( it == connections.end() )
+                {
+                    continue;
+                }
+
+                bool connectionClosed = false;
+                auto connectionError = ReadAvailable( it->second, connectionClosed );
+                if ( connectionClosed || !connectionError.empty() )
+                {
+                    poller.Remove( it->second->socket );
+                    EndStreams( *it->second );
+                    connections.erase( it );
+                    metrics.Add( Counter::ConnectionsClosed );
+                }
+                if ( error.empty() )
+                {
+                    error = connectionError;
+                }
+            }
+        }
+
+        if ( !error.empty() )
+        {
+            return error;
+        }
+
+        if ( stopRequested.exchange( false ) )
+        {
+            return "";
+        }
+
+        TakeReadyRequest( request );
+        return "";
+    }
+
+    // Moves the next of the requests already received into request (Returns false if there are none)
+    bool TakeReadyRequest( Request& request )
     {
-        int sendResult = send( clientSocket, reinterpret_cast<const char*>( message.AsRaw() ), (int)message.Size(), 0 );
-        if ( sendResult == SOCKET_ERROR )
+        if ( nextReadyRequest == readyRequests.size() )
         {
             return false;
         }
+
+        request = std::move( readyRequests[nextReadyRequest++] );
+        metrics.Add( Counter::Requests );
+        if ( nextReadyRequest == readyRequests.size() )
+        {
+            readyRequests.clear();
+            nextReadyRequest = 0;
+        }
         return true;
     }
 
-    std::vector<unsigned char> Receive( SOCKET clientSocket )
+    // Accepts every pending connection (the listening socket is edge-triggered too)
+    std::string AcceptConnections( bool& fatal )
+    {
+        while ( true )
+        {
+            SOCKET clientSocket = accept( serverSocket, NULL, NULL );
+            if ( clientSocket == INVALID_SOCKET )
+            {
+                if ( isWouldBlock( lastError() ) )
+                {
+                    return "";
+                }
+                fatal = true;
+                metrics.Add( Counter::ConnectErrors );
+                return "accept() failed (error: " + std::to_string( lastError() ) + ")";
+            }
+
+            setNonBlocking( clientSocket );
+            disableSigPipe( clientSocket );
+
+            auto connection = std::make_shared<Connection>( clientSocket );
+            if ( poller.Add( clientSocket, connection.get() ) )
+            {
+                connections.emplace( connection.get(), connection );
+                metrics.Add( Counter::ConnectionsOpened );
+            }
+        }
+    }
+
+    // The io_uring counterpart of the loop in WaitForRequest(): the kernel accepts connections and receives their bytes
+    // by itself, so this just waits for those completions and feeds each to its connection's state machine
+    // (Returns as WaitForRequest() does, after handling everything that had completed)
+    std::string ReceiveCompletions( bool& fatal )
     {
-        std::vector<unsigned char> result;
+        metrics.Add( Counter::WaitCalls );
+        if ( !uring->Wait( completions ) )
+        {
+            fatal = true;
+            return "io_uring_enter() failed (error: " + std::to_string( lastError() ) + ")";
+        }
 
-        int recvResult = 0;
-        int recvFlags = 0;
-        do
+        std::string error;
+        for ( auto& completion : completions )
         {
-            recvResult = recv( clientSocket, reinterpret_cast<char*>( recvBytes ), c_recvBufferSize, recvFlags );
-            if ( recvResult > 0 )
+            if ( completion.context == nullptr )
             {
-                result.insert( result.end(), recvBytes, recvBytes + recvResult );
-#ifdef _WIN32
-                u_long opt = 1;
-                ioctlsocket( clientSocket, FIONBIO, &opt );
-#else
-                recvFlags = MSG_DONTWAIT;
-#endif
+                if ( completion.result < 0 )
+                {
+                    fatal = true;
+                    metrics.Add( Counter::ConnectErrors );
+                    error = "accept() failed (error: " + std::to_string( -completion.result ) + ")";
+                }
+                else
+                {
+                    disableSigPipe( completion.result );
+                    auto connection = std::make_shared<Connection>( completion.result );
+                    if ( uring->Receive( connection->socket, connection.get() ) )
+                    {
+                        connections.emplace( connection.get(), connection );
+                        metrics.Add( Counter::ConnectionsOpened );
+                    }
+                }
+
+                // An error ends the accept, so it has to be re-armed for the next call to go on accepting
+                if ( !completion.more && !uring->Accept( serverSocket, nullptr ) )
+                {
+                    fatal = true;
+                    error = "io_uring accept failed (error: " + std::to_string( lastError() ) + ")";
+                }
+                continue;
+            }
+
+            auto it = connections.find( static_cast<Connection*>( completion.context ) );
+            if ( it == connections.end() )
+            {
+                uring->Recycle( completion );
+                continue;
             }
-            else if ( recvResult < 0 )
+            auto& connection = it->second;
+
+            // Bytes still arriving after the connection was dropped are discarded
+            std::string connectionError;
+            if ( completion.result > 0 )
             {
-                auto const errCode = lastError();
-#ifdef _WIN32
-                if ( errCode != WSAEWOULDBLOCK )
-#else
-                if ( errCode != EWOULDBLOCK )
-#endif
+                metrics.Add( Counter::BytesIn, (uint64_t)completion.result );
+                Uring::TakeFds( completion, connection->receivedFds );
+                if ( !connection->closing )
                 {
-                    result.clear();
+                    connectionError = Consume( connection, completion.data, (size_t)completion.result );
                 }
             }
-        } while ( recvResult > 0 );
+            else if ( completion.result < 0 && completion.result != -ENOBUFS && !connection->closing )
+            {
+                metrics.Add( Counter::ReceiveErrors );
+                connectionError = "recv() failed (error: " + std::to_string( -completion.result ) + ")";
+            }
+            uring->Recycle( completion );
 
-#ifdef _WIN32
-        u_long opt = 0;
-        ioctlsocket( clientSocket, FIONBIO, &opt );
-#endif
+            if ( !connectionError.empty() && !connection->closing )
+            {
+                connection->closing = true;
+                uring->StopReceiving( connection->socket );
+            }
+            if ( error.empty() )
+            {
+                error = connectionError;
+            }
 
-        return result;
+            // The receive has to be re-armed after running out of buffers (and whenever else the kernel ends it while
+            // the connection is still open)
+            if ( !completion.more )
+            {
+                bool open = !connection->closing && ( completion.result > 0 || completion.result == -ENOBUFS );
+                if ( !open || !uring->Receive( connection->socket, connection.get() ) )
+                {
+                    EndStreams( *connection );
+                    connections.erase( it );
+                    metrics.Add( Counter::ConnectionsClosed );
+                }
+            }
+        }
+        return error;
     }
 
-    std::string initError;
-    SOCKET serverSocket = INVALID_SOCKET;
-    std::string socketPath = "";
-    sockaddr_un socketAddr;
-    unsigned char recvBytes[c_recvBufferSize] = {};
-};
+    // Reads everything the connection has available, queuing each request it completes
+    // (Returns an empty string on success, otherwise an error description. connectionClosed is set when the
+    // client hung up)
+    std::string ReadAvailable( const std::shared_ptr<Connection>& connection, bool& connectionClosed )
+    {
+        auto& c = *connection;
+        if ( c.stagingBuffer.empty() )
+        {
+            c.stagingBuffer.resize( stagingBufferSizeOf( options.socketType ) );
+        }
 
-}  // namespace Ipc::Private
+        unsigned char* target = nullptr;
+        size_t needed = 0;
+        size_t staged = 0;
+        while ( true )
+        {
+            auto error = Consume( connection, c.stagingBuffer.data(), staged );
+            if ( !error.empty() )
+            {
+                return error;
+            }
 
-Server::Server( const std::filesystem::path& socketPath )
-    : p( std::make_unique<Private::ServerImpl>( socketPath ) )
-{
-}
+            // Read more, directly into place if the stage needs more than the staging buffer holds (scattering anything
+            // beyond it, i.e. the start of the next request, into the staging buffer)
+            StageTarget( c, target, needed );
+            bool direct = c.readStage != Connection::ReadStage::Frame && needed >= c.stagingBuffer.size();
 
-Server::~Server() = default;
+            IoBuffer buffers[] = { { target, needed }, { c.stagingBuffer.data(), c.stagingBuffer.size() } };
+            int flags = recvFlagsOf( options.socketType );
+            auto recvResult = direct ? recvV( c.socket, buffers, 2, &metrics, &c.receivedFds, flags )
+                                     : recvV( c.socket, buffers + 1, 1, &metrics, &c.receivedFds, flags );
+            if ( recvResult == 0 )
+            {
+                connectionClosed = true;
+                return "";
+            }
+            if ( recvResult < 0 )
+            {
+                if ( isWouldBlock( lastError() ) )
+                {
+                    return "";
+                }
+                metrics.Add( Counter::ReceiveErrors );
+                return "recv() failed (error: " + std::to_string( lastError() ) + ")";
+            }
+            if ( (size_t)recvResult > ( direct ? needed : 0 ) + c.stagingBuffer.size() )
+            {
+                metrics.Add( Counter::ProtocolErrors );
+                return "recv() failed (record too large)";
+            }
 
-Message Server::Listen( const std::function<Message( const Message& header, const Message& message )>& callback )
-{
-    return p->Listen( callback );
-}
+            size_t intoTarget = direct ? std::min<size_t>( recvResult, needed ) : 0;
+            c.stageReceived += intoTarget;
+            staged = recvResult - intoTarget;
+        }
+    }
 
-Message Server::StopListening()
+    // Fills the connection's current stage from received bytes, completing stages (and requests) along the way, until
+    // all length bytes are used up (The stage left current then always needs more)
+    std::string Consume( const std::shared_ptr<Connection>& connection, const unsigned char* bytes, size_t length )
+    {
+        auto& c = *connection;
+        unsigned char* target = nullptr;
+        size_t needed = 0;
+        while ( true )
+        {
+            StageTarget( c, target, needed );
+            if ( needed == 0 )
+            {
+                auto error = CompleteStage( connection );
+                if ( !error.empty() )
+                {
+                    return error;
+                }
+                continue;
+            }
+            if ( length == 0 )
+            {
+                return "";
+            }
+
+            size_t count = std::min( needed, length );
+            memcpy( target, bytes, count );
+            bytes += count;
+            length -= count;
+            c.stageReceived += count;
+        }
+    }
+
+    // Where the current read stage's remaining bytes go, and how many it still needs
+    static void StageTarget( Connection& c, unsigned char*& target, size_t& needed )
+    {
+        switch ( c.readStage )
+        {
+            case Connection::ReadStage::Frame:
+                target = c.frameBytes + c.stageReceived;
+                needed = c_frameHeaderSize - c.stageReceived;
+                break;
+            case Connection::ReadStage::Header:
+                target = c.partialRequest.payload.data() + c.stageReceived;
+                needed = c.partialRequest.headerSize - c.stageReceived;
+                break;
+            case Connection::ReadStage::Message:
+                target = c.partialRequest.payload.data() + c.partialRequest.headerSize + c.stageReceived;
+                needed = c.partialRequest.payloadSize - c.partialRequest.headerSize - c.stageReceived;
+                break;
+        }
+    }
+
+    // Moves a connection's state machine on once its current stage has been fully received
+    std::string CompleteStage( const std::shared_ptr<Connection>& connection )
+    {
+        auto& c = *connection;
+        c.stageReceived = 0;
+
+        switch ( c.readStage )
+        {
+            case Connection::ReadStage::Frame:
+                if ( !decodeFrameHeader( c.frameBytes, c.frame ) )
+                {
+                    metrics.Add( Counter::ProtocolErrors );
+                    return "header recv() failed (invalid frame)";
+                }
+                if ( !frameSizeAllowed( c.frame, options.maxMessageSize ) )
+                {
+                    metrics.Add( Counter::ProtocolErrors );
+                    return "header recv() failed (message too large)";
+                }
+                c.frameReceivedAt = Metrics::Clock::now();
+
+                // A connection's region is set up once, as workers may be writing responses into it from then on
+                if ( ( c.frame.flags & c_frameFlagSharedMemorySetup ) && c.sharedMemory )
+                {
+                    metrics.Add( Counter::ProtocolErrors );
+                    return "header recv() failed (shared memory already set up)";
+                }
+
+                // Only plain requests and shared memory setups may carry file descriptors, and those arrive with the
+                // frame
+                if ( ( c.frame.flags & c_frameFlagFds ) &&
+                     ( ( c.frame.flags & c_frameFlagBatch ) ||
+                       !takeFrameFds( c.frame, c.receivedFds, c.partialRequest.fds ) ) )
+                {
+                    metrics.Add( Counter::ProtocolErrors );
+                    return "header recv() failed (file descriptors missing)";
+                }
+
+                // Only plain requests may be streamed
+                if ( ( c.frame.flags & c_frameFlagChunk ) &&
+                     ( c.frame.flags & ( c_frameFlagBatch | c_frameFlagSharedMemorySetup ) ) )
+                {
+                    metrics.Add( Counter::ProtocolErrors );
+                    return "header recv() failed (invalid stream)";
+                }
+                c.partialRequest.payloadSize = c.frame.headerLength + c.frame.bodyLength;
+                c.partialRequest.payload = bufferPool.Take( c.partialRequest.payloadSize );
+                c.partialRequest.headerSize = c.frame.headerLength;
+                c.partialRequest.requestId = c.frame.requestId;
+
+                // The header and message are already waiting in shared memory, so the request is complete
+                if ( c.frame.flags & c_frameFlagSharedMemory )
+                {
+                    if ( !c.sharedMemory || !c.sharedMemory->Read( c_requestRing, c.partialRequest.payload.data(),
+                                                                   c.partialRequest.payloadSize ) )
+                    {
+                        metrics.Add( Counter::ProtocolErrors );
+                        return "message recv() failed (shared memory out of sync)";
+                    }
+                    metrics.Add( Counter::BytesIn, c.partialRequest.payloadSize );
+                    c.readStage = Connection::ReadStage::Message;
+                    return CompleteStage( connection );
+                }
+
+                c.readStage = Connection::ReadStage::Header;
+                break;
+
+            case Connection::ReadStage::Header:
+                // Send ack (only if the client asked for one)
+                if ( c.frame.flags & c_frameFlagAck )
+                {
+                    std::lock_guard<std::mutex> lock( c.sendMutex );
+
+                    unsigned char ack = 1;
+                    if ( !sendAll( c.socket, &ack, 1, { deadlineAfter( options.sendTimeout ) }, &metrics ) )
+                    {
+                        metrics.Add( Counter::SendErrors );
+                        return "ack send() failed (" + lastErrorDescription() + ")";
+                    }
+                }
+                c.readStage = Connection::ReadStage::Message;
+                break;
+
+            case Connection::ReadStage::Message:
+                metrics.Record( Phase::Receive, c.frameReceivedAt );
+                c.partialRequest.connection = connection;
+                c.readStage = Connection::ReadStage::Frame;
+                if ( c.frame.flags & c_frameFlagSharedMemorySetup )
+                {
+                    SetupSharedMemory( c.partialRequest );
+                    c.partialRequest = Request();
+                    break;
+                }
+                if ( c.frame.flags & c_frameFlagBatch )
+                {
+                    QueueBatch( std::move( c.partialRequest ) );
+                    c.partialRequest = Request();
+                    break;
+                }
+                if ( ( ( c.frame.flags & c_frameFlagChunk ) || c.streams.count( c.frame.requestId ) ) &&
+                     QueueStreamPart( c.partialRequest, !( c.frame.flags & c_frameFlagChunk ) ) )
+                {
+                    c.partialRequest = Request();
+                    break;
+                }
+                readyRequests.push_back( std::move( c.partialRequest ) );
+                c.partialRequest = Request();
+                break;
+        }
+
+        return "";
+    }
+
+    // Queues a part of a streamed request for the callback reading it. The first part sets up the stream, and is left
+    // for the caller to queue like any request (returning false), unless RunStreaming() isn't serving, in which case
+    // the request is turned away and the rest of its parts are dropped as they arrive
+    bool QueueStreamPart( Request& request, bool last )
+    {
+        auto& streams = request.connection->streams;
+        auto it = streams.find( request.requestId );
+        if ( it == streams.end() )
+        {
+            auto stream = std::make_shared<RequestStream>();
+            streams.emplace( request.requestId, stream );
+            if ( !streaming )
+            {
+                stream->abandoned = true;
+                Respond( request, Message( "streamed requests need RunStreaming()", true ) );
+                Recycle( request );
+                return true;
+            }
+            request.stream = stream;
+            return false;
+        }
+
+        auto stream = it->second;
+        if ( last )
+        {
+            streams.erase( it );
+        }
+
+        std::lock_guard<std::mutex> lock( stream->mutex );
+        if ( stream->abandoned )
+        {
+            Recycle( request );
+            return true;
+        }
+        stream->parts.push_back( { std::move( request ), last } );
+        stream->arrived.notify_one();
+        return true;
+    }
+
+    // Lets any callbacks reading streamed requests from a connection know that no more parts will come
+    static void EndStreams( Connection& c )
+    {
+        for ( auto& stream : c.streams )
+        {
+            std::lock_guard<std::mutex> lock( stream.second->mutex );
+            stream.second->closed = true;
+            stream.second->arrived.notify_all();
+        }
+        c.streams.clear();
+    }
+
+    // Queues each of a batch request's items as a request of its own, or replies with an error if the batch is
+    // malformed
+    void QueueBatch( Request&& request )
+    {
+        auto batch = std::make_shared<Batch>();
+        batch->payload = std::move( request.payload );
+        batch->payloadSize = request.payloadSize;
+        auto& payload = batch->payload;
+        size_t payloadSize = batch->payloadSize;
+
+        size_t itemCount = 0;
+        uint32_t headerLength = 0;
+        uint64_t bodyLength = 0;
+        for ( size_t offset = request.headerSize; offset < payloadSize;
+              offset += c_batchItemHeaderSize + headerLength + bodyLength )
+        {
+            if ( !decodeBatchItem( payload.data() + offset, payloadSize - offset, true, headerLength, bodyLength ) )
+            {
+                itemCount = 0;
+                break;
+            }
+            ++itemCount;
+        }
+
+        if ( itemCount == 0 )
+        {
+            metrics.Add( Counter::ProtocolErrors );
+            Respond( request, Message( "invalid batch", true ) );
+            bufferPool.Return( std::move( payload ) );
+            return;
+        }
+
+        batch->responses.reserve( itemCount );
+        batch->remaining = itemCount;
+        for ( size_t offset = request.headerSize; offset < payloadSize;
+              offset += c_batchItemHeaderSize + headerLength + bodyLength )
+        {
+            decodeBatchItem( payload.data() + offset, payloadSize - offset, true, headerLength, bodyLength );
+
+            Request item;
+            item.connection = request.connection;
+            item.headerSize = headerLength;
+            item.requestId = request.requestId;
+            item.batch = batch;
+            item.batchItem = batch->responses.size();
+            item.batchOffset = offset + c_batchItemHeaderSize;
+            item.batchSize = headerLength + bodyLength;
+            readyRequests.push_back( std::move( item ) );
+
+            batch->responses.emplace_back( nullptr, 0 );
+        }
+    }
+
+    // Maps the shared memory region a client offers in place of a request, replying with an error if we can't (or
+    // mayn't) use it
+    void SetupSharedMemory( Request& request )
+    {
+        std::string error = "shared memory disabled";
+        if ( options.sharedMemory )
+        {
+            auto region = std::make_unique<SharedMemory>();
+#ifdef _WIN32
+            error = region->Open( std::string( request.payload.begin() + request.headerSize,
+                                               request.payload.begin() + request.payloadSize ) );
+#else
+            error = request.fds.size() == 1 ? region->Open( request.fds[0] ) : "invalid shared memory setup";
+#endif
+            if ( error.empty() )
+            {
+                // Workers check for the region under sendMutex as they send responses
+                std::lock_guard<std::mutex> lock( request.connection->sendMutex );
+                request.connection->sharedMemory = std::move( region );
+            }
+        }
+        closeFds( request.fds );
+
+        Respond( request, error.empty() ? Message( "" ) : Message( error, true ) );
+    }
+
+    // Invokes the request's route, or failing that callback, with views of the request's receive buffer and sends its
+    // response, then recycles the buffer
+    // (Returns an empty string on success, otherwise an error description)
+    std::string Dispatch( const StreamCallback& callback, Request& request )
+    {
+        auto dispatchedAt = Metrics::Clock::now();
+        Message header( request.Data(), request.headerSize );
+        Message response( nullptr, 0 );
+        if ( auto route = routes.Find( request.Data(), request.headerSize ) )
+        {
+            response = route->handler( header, RequestMessage( request ) );
+            route->Record( dispatchedAt, response.IsError() );
+        }
+        else if ( callback )
+        {
+            Stream stream( *this, request );
+            response = callback( header, RequestMessage( request ), stream );
+        }
+        else
+        {
+            response = Message( "no handler registered for header: " + header.AsString(), true );
+        }
+        metrics.Record( Phase::Callback, dispatchedAt );
+
+        // Any parts held back for an item of a batch go back with the rest
+        if ( !request.parts.empty() )
+        {
+            response = MessageBuilder::Join( request.parts, std::move( response ) );
+        }
+
+        auto error = Respond( request, std::move( response ) );
+
+        Recycle( request );
+        return error;
+    }
+
+    // Invokes callback with views of the request's receive buffer, which are kept alive until it responds
+    void DispatchAsync( const AsyncCallback& callback, Request&& request )
+    {
+        ++requestsQueued;
+
+        auto pending = std::make_shared<Request>( std::move( request ) );
+        auto dispatchedAt = Metrics::Clock::now();
+        callback( Message( pending->Data(), pending->headerSize ), RequestMessage( *pending ),
+                  [this, pending, dispatchedAt]( Message response )
+                  {
+                      metrics.Record( Phase::Callback, dispatchedAt );
+                      Respond( *pending, std::move( response ) );
+                      Recycle( *pending );
+                      ++requestsCompleted;
+                  } );
+    }
+
+    // A view of the request's message in its receive buffer, owning any file descriptors that came with it
+    static Message RequestMessage( Request& request )
+    {
+        Message message( request.Data() + request.headerSize, request.Size() - request.headerSize );
+        for ( int fd : request.fds )
+        {
+            message.AttachFd( fd );
+        }
+        request.fds.clear();
+        return message;
+    }
+
+    // Returns a dispatched request's receive buffer to the pool (a batch's goes back once the whole batch is answered)
+    void Recycle( Request& request )
+    {
+        if ( request.stream )
+        {
+            AbandonStream( *request.stream );
+        }
+        closeFds( request.fds );
+        if ( !request.batch )
+        {
+            bufferPool.Return( std::move( request.payload ) );
+        }
+        request = Request();
+    }
+
+    // Hands the callback the next part of a streamed request, crediting it back to the client so that it may send
+    // another (see Stream::Read())
+    bool ReadPart( Request& request, Message& chunk, bool& failed )
+    {
+        if ( !request.stream || request.stream->finished )
+        {
+            return false;
+        }
+
+        auto& stream = *request.stream;
+        if ( stream.current.connection )
+        {
+            Recycle( stream.current );
+        }
+
+        std::unique_lock<std::mutex> lock( stream.mutex );
+        stream.arrived.wait( lock, [&stream] { return !stream.parts.empty() || stream.closed; } );
+        if ( stream.parts.empty() )
+        {
+            stream.finished = true;
+            failed = true;
+            return false;
+        }
+        auto part = std::move( stream.parts.front() );
+        stream.parts.pop_front();
+        lock.unlock();
+
+        stream.current = std::move( part.request );
+        if ( part.last )
+        {
+            // (The client ends a stream with an empty part, see Streams in IpcCommon.h)
+            stream.finished = true;
+            if ( stream.current.Size() == 0 )
+            {
+                Recycle( stream.current );
+                return false;
+            }
+        }
+        else if ( !SendResponse( *request.connection, request.requestId, c_frameFlagCredit, nullptr, 0 ).empty() )
+        {
+            failed = true;
+        }
+
+        chunk = RequestMessage( stream.current );
+        return true;
+    }
+
+    // Sends a part of a response ahead of the rest, or for an item of a batch holds on to it (see Stream::Write())
+    bool WritePart( Request& request, const Message& chunk, bool& failed )
+    {
+        if ( request.batch )
+        {
+            auto part = MessageBuilder::Allocate( chunk.Size() );
+            if ( chunk.Size() > 0 )
+            {
+                memcpy( MessageBuilder::Data( part ), chunk.AsRaw(), chunk.Size() );
+            }
+            request.parts.push_back( std::move( part ) );
+            return true;
+        }
+
+        if ( !fdsAllowed( chunk.Fds() ) )
+        {
+            return false;
+        }
+        if ( !SendResponse( *request.connection, request.requestId, c_frameFlagChunk, chunk.AsRaw(), chunk.Size(),
+                            &chunk.Fds() )
+                  .empty() )
+        {
+            failed = true;
+            return false;
+        }
+        return true;
+    }
+
+    // Drops a streamed request's parts once its callback has returned, along with any that arrive later
+    void AbandonStream( RequestStream& stream )
+    {
+        {
+            std::lock_guard<std::mutex> lock( stream.mutex );
+            stream.abandoned = true;
+            for ( auto& part : stream.parts )
+            {
+                Recycle( part.request );
+            }
+            stream.parts.clear();
+        }
+        if ( stream.current.connection )
+        {
+            Recycle( stream.current );
+        }
+    }
+
+    // Sends the response to a request, or for an item of a batch holds on to it until every item has its response
+    // (Returns an empty string on success, otherwise an error description)
+    std::string Respond( const Request& request, Message&& response )
+    {
+        if ( !request.batch )
+        {
+            return SendResponse( *request.connection, request.requestId, response.IsError() ? c_frameFlagError : 0,
+                                 response.AsRaw(), response.Size(), &response.Fds() );
+        }
+
+        // The response may be a view of something that won't outlive the callback
+        auto& batch = *request.batch;
+        batch.responses[request.batchItem] = MessageBuilder::Own( std::move( response ) );
+        if ( --batch.remaining > 0 )
+        {
+            return "";
+        }
+
+        // The last item in answers for the whole batch
+        size_t packedSize = 0;
+        for ( auto& itemResponse : batch.responses )
+        {
+            packedSize += c_batchItemHeaderSize + itemResponse.Size();
+        }
+
+        auto packed = bufferPool.Take( packedSize );
+        size_t offset = 0;
+        for ( auto& itemResponse : batch.responses )
+        {
+            encodeBatchItem( itemResponse.IsError() ? c_frameFlagError : 0, itemResponse.Size(), &packed[offset] );
+            offset += c_batchItemHeaderSize;
+            if ( itemResponse.Size() > 0 )
+            {
+                memcpy( &packed[offset], itemResponse.AsRaw(), itemResponse.Size() );
+                offset += itemResponse.Size();
+            }
+        }
+
+        auto error =
+            SendResponse( *request.connection, request.requestId, c_frameFlagBatch, packed.data(), packedSize );
+        bufferPool.Return( std::move( packed ) );
+        bufferPool.Return( std::move( batch.payload ) );
+        batch.responses.clear();
+        return error;
+    }
+
+    // Sends a response frame and its body, passing any fds along with it
+    // (Returns an empty string on success, otherwise an error description. On failure the connection is shut down,
+    // so that whichever thread is waiting for requests drops it)
+    std::string SendResponse( Connection& connection,
+                              uint64_t requestId,
+                              uint8_t flags,
+                              const unsigned char* body,
+                              size_t size,
+                              const std::vector<int>* fds = nullptr )
+    {
+        auto sendStart = Metrics::Clock::now();
+
+        FrameHeader responseFrame;
+        responseFrame.flags = flags;
+        responseFrame.bodyLength = size;
+        responseFrame.requestId = requestId;
+        if ( fds && !fds->empty() )
+        {
+            if ( !fdsAllowed( *fds ) )
+            {
+                return SendResponse( connection, requestId, c_frameFlagError,
+                                     reinterpret_cast<const unsigned char*>( c_fdsError ), strlen( c_fdsError ) );
+            }
+            responseFrame.flags |= c_frameFlagFds;
+            responseFrame.fdCount = (uint16_t)fds->size();
+        }
+
+        IoBuffer buffers[] = { { nullptr, c_frameHeaderSize }, { body, size } };
+
+        std::lock_guard<std::mutex> lock( connection.sendMutex );
+
+        // Large responses go through shared memory if the client set it up, leaving just the frame for the socket
+        bool viaSharedMemory = connection.sharedMemory && size >= c_sharedMemoryMinSize &&
+                               connection.sharedMemory->Write( c_responseRing, buffers + 1, 1 );
+        if ( viaSharedMemory )
+        {
+            responseFrame.flags |= c_frameFlagSharedMemory;
+            metrics.Add( Counter::BytesOut, size );
+        }
+
+        unsigned char frameBytes[c_frameHeaderSize];
+        encodeFrameHeader( responseFrame, frameBytes );
+        buffers[0].data = frameBytes;
+
+        if ( !sendAllV( connection.socket, buffers, viaSharedMemory ? 1 : 2, { deadlineAfter( options.sendTimeout ) },
+                        &metrics, fds, recordSizeOf( options.socketType ) ) )
+        {
+            auto error = "response send() failed (" + lastErrorDescription() + ")";
+            shutdown( connection.socket, SHUT_RDWR );
+            metrics.Add( Counter::SendErrors );
+            return error;
+        }
+
+        metrics.Record( Phase::Send, sendStart );
+        return "";
+    }
+
+    void PushRequest( Request&& request )
+    {
+        std::unique_lock<std::mutex> lock( queueMutex );
+        if ( queueSize >= queue.size() )
+        {
+            // Backpressure: stop receiving until a worker frees a slot
+            ++queueFullWaits;
+            queueNotFull.wait( lock, [this] { return queueSize < queue.size(); } );
+        }
+        Enqueue( std::move( request ) );
+
+        lock.unlock();
+        queueNotEmpty.notify_one();
+    }
+
+    // Adds request to the back of the queue (queueMutex must be held, and the queue have room)
+    void Enqueue( Request&& request )
+    {
+        request.queuedAt = Metrics::Clock::now();
+        queue[( queueHead + queueSize ) % queue.size()] = std::move( request );
+        ++queueSize;
+        maxQueueDepth = std::max( maxQueueDepth, queueSize );
+        ++requestsQueued;
+    }
+
+    // Returns false once the queue is closed and empty
+    bool PopRequest( Request& request )
+    {
+        std::unique_lock<std::mutex> lock( queueMutex );
+        queueNotEmpty.wait( lock, [this] { return queueSize > 0 || queueClosed; } );
+        if ( queueSize == 0 )
+        {
+            return false;
+        }
+
+        request = std::move( queue[queueHead] );
+        queueHead = ( queueHead + 1 ) % queue.size();
+        --queueSize;
+
+        lock.unlock();
+        queueNotFull.notify_one();
+        metrics.Record( Phase::QueueWait, request.queuedAt );
+        return true;
+    }
+
+    std::string initError;
+    SOCKET serverSocket = INVALID_SOCKET;
+    std::string socketPath = "";
+    ServerOptions options;
+    sockaddr_un socketAddr;
+
+    // Accepted connections are kept open so that persistent clients can send many requests over each one
+    Poller poller;
+    std::vector<void*> readyContexts;
+
+    // Takes the poller's place when receiving through io_uring (see ServerOptions::ioUring)
+    std::unique_ptr<Uring> uring;
+    std::vector<Uring::Completion> completions;
+    std::unordered_map<Connection*, std::shared_ptr<Connection>> connections;
+
+    // Consumed from the front and only cleared once empty, so it settles at a capacity that never reallocates
+    std::vector<Request> readyRequests;
+    size_t nextReadyRequest = 0;
+
+    // Set by StopListening(), and cleared by the WaitForRequest() call it stops
+    std::atomic<bool> stopRequested = false;
+
+    // Set while RunStreaming() is serving, the only way of serving that takes streamed requests
+    bool streaming = false;
+
+    // Handlers given to Register(), tried before the callback
+    Routes routes;
+
+    BufferPool bufferPool;
+    Metrics metrics;
+
+    // Run()'s bounded queue of requests waiting for a worker (a fixed ring of queueCapacity slots)
+    std::mutex queueMutex;
+    std::condition_variable queueNotEmpty;
+    std::condition_variable queueNotFull;
+    std::vector<Request> queue;
+    size_t queueHead = 0;
+    size_t queueSize = 0;
+    bool queueClosed = false;
+
+    std::atomic<uint64_t> requestsQueued = 0;
+    std::atomic<uint64_t> requestsCompleted = 0;
+    size_t maxQueueDepth = 0;
+    uint64_t queueFullWaits = 0;
+};
+
+}  // namespace Ipc::Private
+
+Server::Server( const std::filesystem::path& socketPath, const ServerOptions& options )
+    : p( std::make_unique<Private::ServerImpl>( socketPath, options ) )
+{
+}
+
+Server::~Server() = default;
+
+// callback as a StreamCallback, null if callback is
+static Private::StreamCallback WithStream(
+    const std::function<Message( const Message& header, const Message& message )>& callback )
+{
+    if ( !callback )
+    {
+        return nullptr;
+    }
+    return [&callback]( const Message& header, const Message& message, Stream& )
+    { return callback( header, message ); };
+}
+
+Message Server::Register( const Message& headerKey,
+                          const std::function<Message( const Message& header, const Message& message )>& handler )
+{
+    return p->Register( headerKey, handler );
+}
+
+Message Server::Listen( const std::function<Message( const Message& header, const Message& message )>& callback )
+{
+    return p->Listen( WithStream( callback ) );
+}
+
+Message Server::Run( const std::function<Message( const Message& header, const Message& message )>& callback,
+                     const RunOptions& options )
+{
+    return p->Run( WithStream( callback ), options, false );
+}
+
+Message Server::RunStreaming(
+    const std::function<Message( const Message& header, const Message& message, Stream& stream )>& callback,
+    const RunOptions& options )
+{
+    return p->Run( callback, options, true );
+}
+
+Message Server::RunAsync(
+    const std::function<void( Message header, Message message, std::function<void( Message response )> respond )>&
+        callback )
+{
+    return p->RunAsync( callback );
+}
+
+Message Server::StopListening()
 {
     return p->StopListening();
 }
+
+ServerStats Server::Stats() const
+{
+    return p->Stats();
+}
+
+Stream::Stream( Private::ServerImpl& server, Private::Request& request )
+    : server( server )
+    , request( request )
+{
+}
+
+bool Stream::Read( Message& chunk )
+{
+    return server.ReadPart( request, chunk, failed );
+}
+
+bool Stream::Write( const Message& chunk )
+{
+    return server.WritePart( request, chunk, failed );
+}
+
+bool Stream::Failed() const
+{
+    return failed;
+}
@@ -28,11 +28,18 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #pragma once
 
+#include <IpcBufferPool.h>
 #include <IpcMessage.h>
+#include <IpcMetrics.h>
+#include <IpcSocketType.h>
 
+#include <chrono>
+#include <cstdint>
 #include <filesystem>
 #include <functional>
 #include <memory>
+#include <string>
+#include <vector>
 
 namespace Ipc
 {
@@ -40,25 +47,209 @@ namespace Ipc
 namespace Private
 {
 class ServerImpl;
+struct Request;
 }
 
+#ifdef __cpp_impl_coroutine
+class Executor;
+template <typename T>
+class Task;
+#endif
+
+struct ServerOptions
+{
+    // Allow clients to pass large payloads through shared memory ring buffers (see ClientOptions::sharedMemory)
+    bool sharedMemory = true;
+
+    // Recycling of the buffers requests are received into
+    BufferPoolOptions bufferPool;
+
+    // How long sending a response may wait for a client that isn't reading before the connection is dropped (0 for
+    // no limit)
+    std::chrono::microseconds sendTimeout = std::chrono::seconds( 2 );
+
+    // The largest request (header and message together) to accept in one frame, so that a client can't have the
+    // server allocate whatever its frame claims. A client sending more is dropped (0 for no limit)
+    size_t maxMessageSize = 1024 * 1024 * 1024;
+
+    // Linux only: receive through io_uring rather than epoll, the kernel accepting connections and receiving into
+    // registered buffers by itself, so that the receiving thread makes one system call per wakeup however many
+    // connections are active. Needs Linux 6.0 or later, otherwise (or if io_uring is disabled, as some containers do)
+    // epoll is used as usual (see ServerStats::ioUring). Best suited to small and medium requests, as unlike with epoll
+    // large ones are copied out of those buffers rather than received directly into place
+    bool ioUring = false;
+
+    // The kind of socket to listen on, which clients must match (see ClientOptions::socketType). ioUring is ignored
+    // with SocketType::SeqPacket
+    SocketType socketType = SocketType::Stream;
+};
+
+struct RunOptions
+{
+    // Number of worker threads invoking the callback (0 for one per hardware thread)
+    size_t workerCount = 0;
+
+    // Maximum number of received requests waiting for a worker. Once full, Run() stops receiving requests until a
+    // worker frees a slot
+    size_t queueCapacity = 256;
+
+    // Once StopListening() is called, how long the workers may keep handling requests already queued. Any still
+    // queued after that are answered with an error instead (callbacks already running are always let finish)
+    std::chrono::milliseconds drainTimeout = std::chrono::seconds( 5 );
+};
+
+// Counters for the requests served by a handler given to Server::Register()
+struct RouteStats
+{
+    std::string header;
+
+    // Requests handled, and those the handler answered with an error
+    uint64_t requests = 0;
+    uint64_t errors = 0;
+
+    // Time spent in the handler
+    LatencyHistogram latency;
+};
+
+struct ServerStats
+{
+    // Requests Run() has handed to its workers (or RunAsync() to its callback), and those since responded to
+    uint64_t requestsQueued = 0;
+    uint64_t requestsCompleted = 0;
+
+    // Backpressure: requests currently waiting for a worker, the most that have ever waited, and how many times
+    // Run() had to stop receiving because the queue was full
+    size_t queueDepth = 0;
+    size_t maxQueueDepth = 0;
+    uint64_t queueFullWaits = 0;
+
+    // Whether requests are received through io_uring (see ServerOptions::ioUring)
+    bool ioUring = false;
+
+    // Requests received (each item of a batch counting as one), and client connections accepted and still open
+    uint64_t requestsReceived = 0;
+    uint64_t connectionsAccepted = 0;
+    size_t activeConnections = 0;
+
+    IoStats io;
+    ErrorStats errors;
+
+    // Where each request's time goes: receiving it (from its frame header to its last byte), waiting for a Run()
+    // worker, in the callback (until respond is called, with RunAsync()), and sending the response
+    LatencyHistogram receiveLatency;
+    LatencyHistogram queueLatency;
+    LatencyHistogram callbackLatency;
+    LatencyHistogram sendLatency;
+
+    BufferPoolStats bufferPool;
+
+    // One for each handler given to Server::Register(), in the order they were registered
+    std::vector<RouteStats> routes;
+};
+
+// Handed to a RunStreaming() callback along with each request, to read the rest of a request the client streams in
+// parts (see Client::SendStreaming()) and to stream the response in parts, so that neither has to be held whole
+class Stream final
+{
+public:
+    Stream( const Stream& ) = delete;
+    Stream& operator=( const Stream& ) = delete;
+
+    // Waits for the request's next part, the callback's message being its first. Returns false once there are no more
+    // (at once for a request sent whole), or if the client hung up (see Failed())
+    // (chunk is a view of the server's receive buffer, only valid until the next Read() or the callback returns)
+    bool Read( Message& chunk );
+
+    // Sends a part of the response ahead of the rest, the callback's return value being its last part. Returns false
+    // if it couldn't be sent, e.g. as the client hung up (see Failed())
+    // (Clients that don't take the response in parts get them joined into one, and for an item of a batch the parts
+    // are held until the callback returns, to be joined likewise)
+    bool Write( const Message& chunk );
+
+    // Whether the client hung up part way through a streamed request or response, so that whatever the callback
+    // returns goes nowhere
+    bool Failed() const;
+
+private:
+    friend class Private::ServerImpl;
+
+    Stream( Private::ServerImpl& server, Private::Request& request );
+
+    Private::ServerImpl& server;
+    Private::Request& request;
+    bool failed = false;
+};
+
 class Server final
 {
 public:
-    explicit Server( const std::filesystem::path& socketPath );
+    explicit Server( const std::filesystem::path& socketPath, const ServerOptions& options = {} );
     ~Server();
 
     Server( const Server& ) = delete;
     Server& operator=( const Server& ) = delete;
 
+    // Register() routes requests whose header is exactly headerKey to handler rather than to the callback handed to
+    // Listen(), Run() or RunStreaming() (which may then be null, should every request have a route of its own: any
+    // other request is answered with an error). Routes are found by hashing a request's header bytes as received, so
+    // there is no need to compare the header against each in turn, and each route is counted separately in Stats()
+    // (Use IsError() on the return Message to determine if the call was successful, e.g. fails if headerKey is empty
+    // or already has a handler. Register every route before serving, as this isn't safe while serving. RunAsync()
+    // doesn't route, always invoking its own callback)
+    Message Register( const Message& headerKey,
+                      const std::function<Message( const Message& header, const Message& message )>& handler );
+
     // Listen() blocks for just one client message, run it in a loop in it's own thread
     // (Use IsError() on the return Message to determine if the call was successful)
+    // (The header and message handed to callback are views of the server's receive buffer, only valid until callback
+    // returns. Copy them, e.g. with AsByteVect(), to keep them any longer. Likewise any file descriptors that came
+    // with the message are closed after callback, and those attached to its response once sent)
     Message Listen( const std::function<Message( const Message& header, const Message& message )>& callback );
 
-    // StopListening() should be called from a different thread to Listen() to unblock it
+    // Run() blocks until StopListening() is called, receiving requests on the calling thread and invoking callback for
+    // each one on a pool of worker threads (so callback must be thread-safe, and Listen() must not be used meanwhile)
+    // (Use IsError() on the return Message to determine if the call was successful)
+    // (As with Listen(), the header and message are only valid until callback returns)
+    Message Run( const std::function<Message( const Message& header, const Message& message )>& callback,
+                 const RunOptions& options = {} );
+
+    // RunStreaming() serves requests like Run(), but also hands callback a Stream for reading requests that clients
+    // stream in parts and streaming responses in parts (requests sent whole come to callback too, with nothing more to
+    // read). Only RunStreaming() takes streamed requests, the other ways of serving turn them away with an error
+    // (A streamed request holds its worker until callback returns, so allow for as many as may be in flight at once
+    // in RunOptions::workerCount)
+    Message RunStreaming(
+        const std::function<Message( const Message& header, const Message& message, Stream& stream )>& callback,
+        const RunOptions& options = {} );
+
+    // RunAsync() blocks until StopListening() is called, like Run(), but invokes callback on the receiving thread and
+    // doesn't wait for a response: callback is handed a respond function to call exactly once, from any thread and
+    // at any later time. Meant for event-driven handlers (see RunCo()), so callback itself should never block
+    // (Use IsError() on the return Message to determine if the call was successful)
+    // (The header and message are views of the server's receive buffer, valid until respond is called, which must
+    // happen before the Server is destroyed)
+    Message RunAsync(
+        const std::function<void( Message header, Message message, std::function<void( Message response )> respond )>&
+            callback );
+
+#ifdef __cpp_impl_coroutine
+    // RunCo() serves requests through RunAsync() with a coroutine handler, each request running as its own coroutine
+    // on executor (so a handler that awaits, e.g. a SendCo() to another server, holds up neither a thread nor other
+    // requests). Run executor.Run() on some other thread
+    // (Include IpcCoroutine.h to use this. The header and message stay valid until the handler's Task completes)
+    Message RunCo( const std::function<Task<Message>( const Message& header, const Message& message )>& handler,
+                   Executor& executor );
+#endif
+
+    // StopListening() should be called from a different thread to Listen() or Run() to unblock it. It returns at once,
+    // without connecting to the server, and Run() then returns once the requests it has received are drained (see
+    // RunOptions::drainTimeout)
     // (Use IsError() on the return Message to determine if the call was successful)
     Message StopListening();
 
+    // Stats() returns a snapshot of the server's counters
+    ServerStats Stats() const;
+
 private:
     std::unique_ptr<Private::ServerImpl> p;
 };
@@ -0,0 +1,308 @@
+/******************************************************************************
+IPC - Simple cross-platform C++ IPC library
+Copyright (c) 2024, Marcus Tomlinson
+
+BSD 2-Clause License
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+******************************************************************************/
+
+#include <IpcSharedMemory.h>
+
+#include <cstdio>
+#include <new>
+#include <random>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace Ipc::Private;
+
+static const uint32_t c_sharedMemoryMagic = 0x4d435049;  // "IPCM"
+
+static_assert( std::atomic<uint64_t>::is_always_lock_free, "ring positions must be lock-free to share them" );
+
+// Lives at the start of the region. Positions only ever grow, the offset into a ring is position % ringSize. Each
+// ring's head is written by its producer and its tail by its consumer, on separate cache lines
+struct SharedMemory::Control
+{
+    uint32_t magic = 0;
+    uint64_t ringSize = 0;
+
+    struct Ring
+    {
+        alignas( 64 ) std::atomic<uint64_t> head = 0;
+        alignas( 64 ) std::atomic<uint64_t> tail = 0;
+    };
+
+    Ring rings[2];
+};
+
+// A name no other process can guess, so it can't be opened (or taken first) by anyone but the peer it is handed to
+[[maybe_unused]] static std::string randomName( const char* prefix )
+{
+    std::random_device random;
+    char suffix[17];
+    snprintf( suffix, sizeof( suffix ), "%08x%08x", (unsigned)random(), (unsigned)random() );
+    return prefix + std::string( suffix );
+}
+
+SharedMemory::~SharedMemory()
+{
+    if ( address )
+    {
+#ifdef _WIN32
+        UnmapViewOfFile( address );
+#else
+        munmap( address, size );
+#endif
+    }
+
+#ifdef _WIN32
+    if ( mapping )
+    {
+        CloseHandle( mapping );
+    }
+#else
+    Release();
+#endif
+}
+
+std::string SharedMemory::Create( size_t requestedRingSize )
+{
+    ringSize = requestedRingSize;
+    size = sizeof( Control ) + 2 * ringSize;
+
+#ifdef _WIN32
+    // There is no passing handles over the socket here, so the peer opens the mapping by its name
+    name = randomName( "Local\\ipc-" );
+
+    mapping = CreateFileMappingA( INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, (DWORD)( (uint64_t)size >> 32 ),
+                                  (DWORD)( size & 0xffffffff ), name.c_str() );
+    if ( !mapping )
+    {
+        return "CreateFileMapping() failed (error: " + std::to_string( GetLastError() ) + ")";
+    }
+    if ( GetLastError() == ERROR_ALREADY_EXISTS )
+    {
+        return "CreateFileMapping() failed (name already taken)";
+    }
+
+    void* view = MapViewOfFile( mapping, FILE_MAP_ALL_ACCESS, 0, 0, size );
+    if ( !view )
+    {
+        return "MapViewOfFile() failed (error: " + std::to_string( GetLastError() ) + ")";
+    }
+#else
+#ifdef __linux__
+    fd = memfd_create( "ipc-ring", MFD_CLOEXEC );
+    if ( fd == -1 )
+    {
+        return "memfd_create() failed (error: " + std::to_string( errno ) + ")";
+    }
+#else
+    // Named only for as long as it takes to open it (kept short, as macOS limits shared memory names to 31 characters)
+    auto name = randomName( "/ipc-" );
+    fd = shm_open( name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600 );
+    if ( fd == -1 )
+    {
+        return "shm_open() failed (error: " + std::to_string( errno ) + ")";
+    }
+    shm_unlink( name.c_str() );
+#endif
+
+    if ( ftruncate( fd, (off_t)size ) == -1 )
+    {
+        return "ftruncate() failed (error: " + std::to_string( errno ) + ")";
+    }
+
+    void* view = mmap( nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    if ( view == MAP_FAILED )
+    {
+        return "mmap() failed (error: " + std::to_string( errno ) + ")";
+    }
+#endif
+
+    Map( view, size );
+
+    new ( control ) Control();
+    control->magic = c_sharedMemoryMagic;
+    control->ringSize = ringSize;
+
+    return "";
+}
+
+#ifdef _WIN32
+std::string SharedMemory::Open( const std::string& regionName )
+{
+    // Only ever map regions made by Create()
+    if ( regionName.rfind( "Local\\ipc-", 0 ) != 0 )
+    {
+        return "invalid shared memory name";
+    }
+
+    name = regionName;
+    mapping = OpenFileMappingA( FILE_MAP_ALL_ACCESS, FALSE, name.c_str() );
+    if ( !mapping )
+    {
+        return "OpenFileMapping() failed (error: " + std::to_string( GetLastError() ) + ")";
+    }
+
+    void* view = MapViewOfFile( mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0 );
+    if ( !view )
+    {
+        return "MapViewOfFile() failed (error: " + std::to_string( GetLastError() ) + ")";
+    }
+
+    MEMORY_BASIC_INFORMATION info = {};
+    VirtualQuery( view, &info, sizeof( info ) );
+    size_t viewSize = info.RegionSize;
+#else
+std::string SharedMemory::Open( int regionFd )
+{
+    struct stat info;
+    if ( fstat( regionFd, &info ) == -1 )
+    {
+        return "fstat() failed (error: " + std::to_string( errno ) + ")";
+    }
+    size_t viewSize = (size_t)info.st_size;
+
+    void* view = viewSize < sizeof( Control )
+                     ? MAP_FAILED
+                     : mmap( nullptr, viewSize, PROT_READ | PROT_WRITE, MAP_SHARED, regionFd, 0 );
+    if ( view == MAP_FAILED )
+    {
+        return "mmap() failed (error: " + std::to_string( errno ) + ")";
+    }
+#endif
+
+    Map( view, viewSize );
+
+    // Never trust the peer's description of the region further than its actual size
+    if ( control->magic != c_sharedMemoryMagic || control->ringSize == 0 ||
+         control->ringSize > ( viewSize - sizeof( Control ) ) / 2 )
+    {
+        return "invalid shared memory region";
+    }
+
+    ringSize = control->ringSize;
+    rings[c_requestRing] = static_cast<unsigned char*>( address ) + sizeof( Control );
+    rings[c_responseRing] = rings[c_requestRing] + ringSize;
+    return "";
+}
+
+void SharedMemory::Map( void* view, size_t viewSize )
+{
+    address = view;
+    size = viewSize;
+    control = static_cast<Control*>( address );
+    rings[c_requestRing] = static_cast<unsigned char*>( address ) + sizeof( Control );
+    rings[c_responseRing] = rings[c_requestRing] + ringSize;
+}
+
+void SharedMemory::Release()
+{
+#ifndef _WIN32
+    if ( fd != -1 )
+    {
+        close( fd );
+        fd = -1;
+    }
+#endif
+}
+
+#ifdef _WIN32
+const std::string& SharedMemory::Name() const
+{
+    return name;
+}
+#else
+int SharedMemory::Fd() const
+{
+    return fd;
+}
+#endif
+
+bool SharedMemory::Write( int ring, const IoBuffer* buffers, size_t count )
+{
+    auto& positions = control->rings[ring];
+
+    size_t length = 0;
+    for ( size_t i = 0; i < count; ++i )
+    {
+        length += buffers[i].length;
+    }
+
+    uint64_t head = positions.head.load( std::memory_order_relaxed );
+    uint64_t tail = positions.tail.load( std::memory_order_acquire );
+    if ( length > ringSize - ( head - tail ) )
+    {
+        return false;
+    }
+
+    for ( size_t i = 0; i < count; ++i )
+    {
+        auto bytes = static_cast<const unsigned char*>( buffers[i].data );
+        size_t remaining = buffers[i].length;
+        while ( remaining > 0 )
+        {
+            size_t offset = head % ringSize;
+            size_t chunk = std::min( remaining, ringSize - offset );
+            memcpy( rings[ring] + offset, bytes, chunk );
+            bytes += chunk;
+            remaining -= chunk;
+            head += chunk;
+        }
+    }
+
+    positions.head.store( head, std::memory_order_release );
+    return true;
+}
+
+bool SharedMemory::Read( int ring, void* data, size_t length )
+{
+    auto& positions = control->rings[ring];
+
+    uint64_t head = positions.head.load( std::memory_order_acquire );
+    uint64_t tail = positions.tail.load( std::memory_order_relaxed );
+    if ( length > head - tail || head - tail > ringSize )
+    {
+        return false;
+    }
+
+    auto bytes = static_cast<unsigned char*>( data );
+    size_t remaining = length;
+    while ( remaining > 0 )
+    {
+        size_t offset = tail % ringSize;
+        size_t chunk = std::min( remaining, ringSize - offset );
+        memcpy( bytes, rings[ring] + offset, chunk );
+        bytes += chunk;
+        remaining -= chunk;
+        tail += chunk;
+    }
+
+    positions.tail.store( tail, std::memory_order_release );
+    return true;
+}
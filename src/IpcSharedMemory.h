@@ -0,0 +1,105 @@
+/******************************************************************************
+IPC - Simple cross-platform C++ IPC library
+Copyright (c) 2024, Marcus Tomlinson
+
+BSD 2-Clause License
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+******************************************************************************/
+
+#pragma once
+
+#include <IpcCommon.h>
+
+#include <atomic>
+
+namespace Ipc::Private
+{
+
+// Ring 0 carries requests from client to server, ring 1 carries responses back
+static const int c_requestRing = 0;
+static const int c_responseRing = 1;
+
+// A region of memory shared by one client and one server, holding a single-producer / single-consumer ring buffer
+// per direction. Payloads are copied straight into and out of the rings, the socket only carries the frame headers
+// that say a payload is waiting. Since payloads are written and frames sent in the same order, a reader always finds
+// the next payload at the ring's current read position
+class SharedMemory final
+{
+public:
+    SharedMemory() = default;
+    ~SharedMemory();
+
+    SharedMemory( const SharedMemory& ) = delete;
+    SharedMemory& operator=( const SharedMemory& ) = delete;
+
+    // Creates a new region with two rings of ringSize bytes each
+    // (Returns an empty string on success, otherwise an error description)
+    std::string Create( size_t ringSize );
+
+#ifdef _WIN32
+    // Maps a region created by the peer, by the random name it was created with
+    // (Returns an empty string on success, otherwise an error description)
+    std::string Open( const std::string& name );
+
+    const std::string& Name() const;
+#else
+    // Maps a region created by the peer, from the descriptor it passed over the socket (which is left open)
+    // (Returns an empty string on success, otherwise an error description)
+    std::string Open( int fd );
+
+    // The created region's descriptor, for passing to the peer. The region has no name, so this is the only way in
+    int Fd() const;
+#endif
+
+    // Lets go of the created region's descriptor once the peer has mapped it (or never will), so that the memory goes
+    // away with the last mapping
+    void Release();
+
+    // Copies buffers into the ring, returning false (having written nothing) if they don't fit in its free space
+    bool Write( int ring, const IoBuffer* buffers, size_t count );
+
+    // Copies the next length bytes out of the ring, returning false if the ring doesn't hold that many
+    bool Read( int ring, void* data, size_t length );
+
+private:
+    struct Control;
+
+    void Map( void* address, size_t size );
+
+#ifdef _WIN32
+    std::string name;
+#else
+    int fd = -1;
+#endif
+    void* address = nullptr;
+    size_t size = 0;
+    size_t ringSize = 0;
+    Control* control = nullptr;
+    unsigned char* rings[2] = {};
+
+#ifdef _WIN32
+    HANDLE mapping = nullptr;
+#endif
+};
+
+}  // namespace Ipc::Private
@@ -0,0 +1,425 @@
+/******************************************************************************
+IPC - Simple cross-platform C++ IPC library
+Copyright (c) 2024, Marcus Tomlinson
+
+BSD 2-Clause License
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+******************************************************************************/
+
+#include <IpcUring.h>
+
+// The multishot receive this relies on came with Linux 6.0, so needs headers at least that new to build
+#if defined( __linux__ ) && __has_include( <linux/io_uring.h> )
+#include <linux/io_uring.h>
+#endif
+
+#ifdef IORING_RECV_MULTISHOT
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace Ipc::Private;
+
+#ifdef IORING_RECV_MULTISHOT
+
+static const unsigned c_submitEntries = 256;
+static const unsigned c_completeEntries = 4096;
+
+// The receive buffers, each large enough for a small request whole (or a large one's next chunk) along with its
+// control messages. The count must be a power of two
+static const unsigned c_bufferCount = 128;
+static const size_t c_bufferSize = 16 * 1024;
+static const unsigned short c_bufferGroup = 0;
+
+// What each receive asks for besides the bytes themselves: no address, and room for a message's file descriptors.
+// The kernel lays out every buffer it fills as an io_uring_recvmsg_out, this much control data, then the bytes
+static const size_t c_controlSpace = sizeof( FdControlBuffer );
+static const msghdr c_receiveTemplate = []
+{
+    msghdr msg = {};
+    msg.msg_controllen = c_controlSpace;
+    return msg;
+}();
+
+static std::string errorDescription( const char* call )
+{
+    return std::string( call ) + " failed (error: " + std::to_string( errno ) + ")";
+}
+
+Uring::Uring()
+{
+    if ( !Setup() && ringFd != -1 )
+    {
+        close( ringFd );
+        ringFd = -1;
+    }
+}
+
+Uring::~Uring()
+{
+    // Closing the ring cancels everything still armed, so only then can the buffers go
+    if ( ringFd != -1 )
+    {
+        close( ringFd );
+    }
+    if ( wakeFd != -1 )
+    {
+        close( wakeFd );
+    }
+    if ( ringMemory )
+    {
+        munmap( ringMemory, ringMemorySize );
+    }
+    if ( entries )
+    {
+        munmap( entries, entriesSize );
+    }
+    if ( bufferRing )
+    {
+        munmap( bufferRing, c_bufferCount * sizeof( io_uring_buf ) );
+    }
+    if ( buffers )
+    {
+        munmap( buffers, c_bufferCount * c_bufferSize );
+    }
+}
+
+bool Uring::Setup()
+{
+    io_uring_params params = {};
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = c_completeEntries;
+    ringFd = (int)syscall( __NR_io_uring_setup, c_submitEntries, &params );
+    if ( ringFd == -1 )
+    {
+        initError = errorDescription( "io_uring_setup()" );
+        return false;
+    }
+    if ( !( params.features & IORING_FEAT_SINGLE_MMAP ) || !( params.features & IORING_FEAT_NODROP ) )
+    {
+        initError = "io_uring is missing features (kernel too old)";
+        return false;
+    }
+
+    // Multishot receives can't be probed for directly, but came in the same release as zero copy sends, which can
+    std::vector<unsigned char> probeBytes( sizeof( io_uring_probe ) + 256 * sizeof( io_uring_probe_op ) );
+    auto probe = reinterpret_cast<io_uring_probe*>( probeBytes.data() );
+    if ( syscall( __NR_io_uring_register, ringFd, IORING_REGISTER_PROBE, probe, 256 ) == -1 ||
+         probe->last_op < IORING_OP_SEND_ZC || !( probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED ) )
+    {
+        initError = "io_uring is missing multishot receives (kernel too old)";
+        return false;
+    }
+
+    // The submission and completion rings share one mapping, the entries have their own
+    ringMemorySize = std::max<size_t>( params.sq_off.array + params.sq_entries * sizeof( unsigned ),
+                                       params.cq_off.cqes + params.cq_entries * sizeof( io_uring_cqe ) );
+    ringMemory =
+        mmap( nullptr, ringMemorySize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING );
+    entriesSize = params.sq_entries * sizeof( io_uring_sqe );
+    entries = mmap( nullptr, entriesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES );
+    if ( ringMemory == MAP_FAILED || entries == MAP_FAILED )
+    {
+        ringMemory = ringMemory == MAP_FAILED ? nullptr : ringMemory;
+        entries = entries == MAP_FAILED ? nullptr : entries;
+        initError = errorDescription( "io_uring mmap()" );
+        return false;
+    }
+
+    auto rings = static_cast<unsigned char*>( ringMemory );
+    submitHead = reinterpret_cast<unsigned*>( rings + params.sq_off.head );
+    submitTail = reinterpret_cast<unsigned*>( rings + params.sq_off.tail );
+    submitMask = *reinterpret_cast<unsigned*>( rings + params.sq_off.ring_mask );
+    submitArray = reinterpret_cast<unsigned*>( rings + params.sq_off.array );
+    completeHead = reinterpret_cast<unsigned*>( rings + params.cq_off.head );
+    completeTail = reinterpret_cast<unsigned*>( rings + params.cq_off.tail );
+    completeMask = *reinterpret_cast<unsigned*>( rings + params.cq_off.ring_mask );
+    completeEntries = rings + params.cq_off.cqes;
+
+    // Entries are always queued in order, so each slot of the submission ring just points at the entry of its index
+    for ( unsigned i = 0; i < params.sq_entries; ++i )
+    {
+        submitArray[i] = i;
+    }
+
+    // Register the ring receives take their buffers from, then fill it
+    bufferRing = mmap( nullptr, c_bufferCount * sizeof( io_uring_buf ), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    void* bufferMemory =
+        mmap( nullptr, c_bufferCount * c_bufferSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if ( bufferRing == MAP_FAILED || bufferMemory == MAP_FAILED )
+    {
+        bufferRing = bufferRing == MAP_FAILED ? nullptr : bufferRing;
+        buffers = bufferMemory == MAP_FAILED ? nullptr : static_cast<unsigned char*>( bufferMemory );
+        initError = errorDescription( "io_uring buffer mmap()" );
+        return false;
+    }
+    buffers = static_cast<unsigned char*>( bufferMemory );
+
+    io_uring_buf_reg registration = {};
+    registration.ring_addr = reinterpret_cast<uint64_t>( bufferRing );
+    registration.ring_entries = c_bufferCount;
+    registration.bgid = c_bufferGroup;
+    if ( syscall( __NR_io_uring_register, ringFd, IORING_REGISTER_PBUF_RING, &registration, 1 ) == -1 )
+    {
+        initError = errorDescription( "io_uring buffer registration" );
+        return false;
+    }
+    for ( unsigned i = 0; i < c_bufferCount; ++i )
+    {
+        ProvideBuffer( (int)i );
+    }
+
+    wakeFd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    if ( wakeFd == -1 || !PollWakes() )
+    {
+        initError = errorDescription( "eventfd()" );
+        return false;
+    }
+    return true;
+}
+
+const std::string& Uring::InitError() const
+{
+    return initError;
+}
+
+bool Uring::Accept( SOCKET listenSocket, void* context )
+{
+    io_uring_sqe entry = {};
+    entry.opcode = IORING_OP_ACCEPT;
+    entry.fd = listenSocket;
+    entry.ioprio = IORING_ACCEPT_MULTISHOT;
+    entry.accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    entry.user_data = reinterpret_cast<uint64_t>( context );
+    return Queue( &entry );
+}
+
+bool Uring::Receive( SOCKET socket, void* context )
+{
+    io_uring_sqe entry = {};
+    entry.opcode = IORING_OP_RECVMSG;
+    entry.fd = socket;
+    entry.addr = reinterpret_cast<uint64_t>( &c_receiveTemplate );
+    entry.len = 1;
+    entry.msg_flags = MSG_CMSG_CLOEXEC;
+    entry.ioprio = IORING_RECV_MULTISHOT;
+    entry.flags = IOSQE_BUFFER_SELECT;
+    entry.buf_group = c_bufferGroup;
+    entry.user_data = reinterpret_cast<uint64_t>( context );
+    return Queue( &entry );
+}
+
+void Uring::StopReceiving( SOCKET socket )
+{
+    shutdown( socket, SHUT_RD );
+}
+
+bool Uring::Wait( std::vector<Completion>& completions )
+{
+    completions.clear();
+    if ( !Enter( 1 ) )
+    {
+        return false;
+    }
+
+    auto cqes = static_cast<io_uring_cqe*>( completeEntries );
+    unsigned head = *completeHead;
+    unsigned tail = __atomic_load_n( completeTail, __ATOMIC_ACQUIRE );
+    for ( ; head != tail; ++head )
+    {
+        auto& cqe = cqes[head & completeMask];
+        if ( cqe.user_data == reinterpret_cast<uint64_t>( &wakeFd ) )
+        {
+            uint64_t count = 0;
+            while ( read( wakeFd, &count, sizeof( count ) ) > 0 )
+            {
+            }
+            if ( !( cqe.flags & IORING_CQE_F_MORE ) )
+            {
+                PollWakes();
+            }
+            continue;
+        }
+
+        Completion completion;
+        completion.context = reinterpret_cast<void*>( cqe.user_data );
+        completion.result = cqe.res;
+        completion.more = cqe.flags & IORING_CQE_F_MORE;
+        if ( cqe.flags & IORING_CQE_F_BUFFER )
+        {
+            completion.buffer = (int)( cqe.flags >> IORING_CQE_BUFFER_SHIFT );
+            auto bytes = buffers + completion.buffer * c_bufferSize;
+
+            io_uring_recvmsg_out out;
+            memcpy( &out, bytes, sizeof( out ) );
+            completion.control = bytes + sizeof( out );
+            completion.controlLength = out.controllen;
+            completion.data = completion.control + c_controlSpace;
+            completion.result = cqe.res < 0 ? cqe.res : (int)out.payloadlen;
+        }
+        completions.push_back( completion );
+    }
+    __atomic_store_n( completeHead, head, __ATOMIC_RELEASE );
+    return true;
+}
+
+void Uring::Recycle( const Completion& completion )
+{
+    if ( completion.buffer != -1 )
+    {
+        ProvideBuffer( completion.buffer );
+    }
+}
+
+void Uring::TakeFds( const Completion& completion, std::vector<int>& fds )
+{
+    if ( completion.controlLength == 0 )
+    {
+        return;
+    }
+
+    msghdr msg = {};
+    msg.msg_control = completion.control;
+    msg.msg_controllen = completion.controlLength;
+    appendControlFds( msg, fds );
+}
+
+void Uring::Wake()
+{
+    uint64_t one = 1;
+    while ( write( wakeFd, &one, sizeof( one ) ) == -1 && errno == EINTR )
+    {
+    }
+}
+
+// Copies entry into the next free slot of the submission ring, first submitting what's queued if that's full
+bool Uring::Queue( const void* entry )
+{
+    unsigned tail = *submitTail;
+    if ( tail - __atomic_load_n( submitHead, __ATOMIC_ACQUIRE ) > submitMask &&
+         ( !Enter( 0 ) || tail - __atomic_load_n( submitHead, __ATOMIC_ACQUIRE ) > submitMask ) )
+    {
+        return false;
+    }
+
+    memcpy( static_cast<io_uring_sqe*>( entries ) + ( tail & submitMask ), entry, sizeof( io_uring_sqe ) );
+    __atomic_store_n( submitTail, tail + 1, __ATOMIC_RELEASE );
+    return true;
+}
+
+bool Uring::PollWakes()
+{
+    io_uring_sqe entry = {};
+    entry.opcode = IORING_OP_POLL_ADD;
+    entry.fd = wakeFd;
+    entry.len = IORING_POLL_ADD_MULTI;
+    entry.poll32_events = POLLIN;
+    entry.user_data = reinterpret_cast<uint64_t>( &wakeFd );
+    return Queue( &entry );
+}
+
+// Submits everything queued, and waits for at least minComplete operations to complete
+bool Uring::Enter( unsigned minComplete )
+{
+    while ( true )
+    {
+        unsigned toSubmit = *submitTail - __atomic_load_n( submitHead, __ATOMIC_ACQUIRE );
+        if ( syscall( __NR_io_uring_enter, ringFd, toSubmit, minComplete, minComplete ? IORING_ENTER_GETEVENTS : 0,
+                      nullptr, 0 ) != -1 )
+        {
+            return true;
+        }
+
+        // EBUSY means the kernel is holding completions back until those already posted are reaped
+        if ( errno == EBUSY )
+        {
+            return true;
+        }
+        if ( errno != EINTR )
+        {
+            return false;
+        }
+    }
+}
+
+// (The ring is addressed as a plain array rather than through io_uring_buf_ring, whose flexible array member sits at
+// the wrong offset when compiled as C++. Its tail overlays the first entry's resv field)
+void Uring::ProvideBuffer( int buffer )
+{
+    auto ring = static_cast<io_uring_buf*>( bufferRing );
+    auto& entry = ring[bufferTail & ( c_bufferCount - 1 )];
+    entry.addr = reinterpret_cast<uint64_t>( buffers + buffer * c_bufferSize );
+    entry.len = (uint32_t)c_bufferSize;
+    entry.bid = (uint16_t)buffer;
+    __atomic_store_n( &ring[0].resv, ++bufferTail, __ATOMIC_RELEASE );
+}
+
+#else
+
+Uring::Uring()
+    : initError( "io_uring is not supported on this platform" )
+{
+}
+
+Uring::~Uring() = default;
+
+const std::string& Uring::InitError() const
+{
+    return initError;
+}
+
+bool Uring::Accept( SOCKET, void* )
+{
+    return false;
+}
+
+bool Uring::Receive( SOCKET, void* )
+{
+    return false;
+}
+
+void Uring::StopReceiving( SOCKET )
+{
+}
+
+bool Uring::Wait( std::vector<Completion>& completions )
+{
+    completions.clear();
+    return false;
+}
+
+void Uring::Recycle( const Completion& )
+{
+}
+
+void Uring::TakeFds( const Completion&, std::vector<int>& )
+{
+}
+
+void Uring::Wake()
+{
+}
+
+#endif
@@ -0,0 +1,130 @@
+/******************************************************************************
+IPC - Simple cross-platform C++ IPC library
+Copyright (c) 2024, Marcus Tomlinson
+
+BSD 2-Clause License
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+******************************************************************************/
+
+#pragma once
+
+#include <IpcCommon.h>
+
+#include <vector>
+
+namespace Ipc::Private
+{
+
+// The server's optional alternative to Poller on Linux (see ServerOptions::ioUring): an io_uring the kernel accepts
+// connections and receives into by itself, with one multishot accept for the listening socket and one multishot
+// recvmsg per connection, each armed once and then completing again and again. Received bytes land in a ring of
+// buffers registered with the kernel up front, and everything queued (re-arms and returned buffers) is submitted by
+// the same io_uring_enter() call that waits for completions. Talks to the kernel directly rather than through
+// liburing. Any thread can interrupt a Wait() with Wake(), through an eventfd polled by the ring
+class Uring final
+{
+public:
+    struct Completion
+    {
+        // As given to Accept() or Receive()
+        void* context = nullptr;
+
+        // The accepted socket, the number of bytes received (0 once the peer hangs up), or a negated error number
+        int result = 0;
+
+        // Whether the operation is still armed and will complete again. If not it has to be re-armed, e.g. after
+        // -ENOBUFS once the buffers run out, to go on receiving
+        bool more = false;
+
+        // Where the received bytes and their control messages lie, until the buffer is handed back with Recycle()
+        unsigned char* data = nullptr;
+        int buffer = -1;
+        unsigned char* control = nullptr;
+        size_t controlLength = 0;
+    };
+
+    Uring();
+    ~Uring();
+
+    Uring( const Uring& ) = delete;
+    Uring& operator=( const Uring& ) = delete;
+
+    // Returns an empty string on success, otherwise an error description (e.g. if the kernel is older than 6.0 or
+    // io_uring is disabled, in which case callers fall back to Poller)
+    const std::string& InitError() const;
+
+    // Queue a multishot accept on a listening socket, or a multishot receive on a connected one, each completion of
+    // which is handed back by Wait() with context. Once the peer hangs up a receive completes one last time without
+    // more
+    bool Accept( SOCKET listenSocket, void* context );
+    bool Receive( SOCKET socket, void* context );
+
+    // Shuts a connected socket down for reading, so that its receive completes one last time (without more) even
+    // though the peer may still be sending
+    void StopReceiving( SOCKET socket );
+
+    // Submits everything queued, then blocks until at least one operation completes, replacing the contents of
+    // completions with what has. Returns false on error
+    bool Wait( std::vector<Completion>& completions );
+
+    // Hands a completion's buffer back to the kernel, and appends any file descriptors that came with it to fds
+    void Recycle( const Completion& completion );
+    static void TakeFds( const Completion& completion, std::vector<int>& fds );
+
+    // Makes the current or next Wait() return, if need be with nothing completed
+    void Wake();
+
+private:
+    std::string initError;
+
+    int ringFd = -1;
+    int wakeFd = -1;
+
+    // The submission and completion rings (mapped as one), and the submission queue entries
+    void* ringMemory = nullptr;
+    size_t ringMemorySize = 0;
+    void* entries = nullptr;
+    size_t entriesSize = 0;
+
+    unsigned* submitHead = nullptr;
+    unsigned* submitTail = nullptr;
+    unsigned submitMask = 0;
+    unsigned* submitArray = nullptr;
+    unsigned* completeHead = nullptr;
+    unsigned* completeTail = nullptr;
+    unsigned completeMask = 0;
+    void* completeEntries = nullptr;
+
+    // The registered ring of receive buffers, and the buffers themselves
+    void* bufferRing = nullptr;
+    unsigned char* buffers = nullptr;
+    unsigned short bufferTail = 0;
+
+    bool Setup();
+    bool Queue( const void* entry );
+    bool PollWakes();
+    bool Enter( unsigned minComplete );
+    void ProvideBuffer( int buffer );
+};
+
+}  // namespace Ipc::Private
@@ -27,21 +27,85 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 ******************************************************************************/
 
 #include <IpcClient.h>
+#include <IpcClientPool.h>
+#include <IpcCoroutine.h>
+#include <IpcMemfd.h>
 #include <IpcServer.h>
+#include <IpcSharedMemory.h>
 
 #include <gtest/gtest.h>
 
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
 #include <future>
+#include <new>
 #include <thread>
 
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
 static const char* c_serverSocket = "server.sock";
 
+#if defined( __GNUC__ ) && !defined( __clang__ )
+// GCC takes the free() in our replacement operator delete for a mismatch once it is inlined
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+// Every heap allocation in the process is counted, so tests can check that a code path makes none
+static std::atomic<size_t> allocationCount = 0;
+
+void* operator new( std::size_t size )
+{
+    ++allocationCount;
+    if ( auto ptr = std::malloc( size > 0 ? size : 1 ) )
+    {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[]( std::size_t size )
+{
+    return operator new( size );
+}
+
+void operator delete( void* ptr ) noexcept
+{
+    std::free( ptr );
+}
+
+void operator delete[]( void* ptr ) noexcept
+{
+    std::free( ptr );
+}
+
+void operator delete( void* ptr, std::size_t ) noexcept
+{
+    std::free( ptr );
+}
+
+void operator delete[]( void* ptr, std::size_t ) noexcept
+{
+    std::free( ptr );
+}
+
 Ipc::Message RecvCallback( const Ipc::Message& recvHeader, const Ipc::Message& recvMessage )
 {
     if ( recvMessage.AsString() != "Hello?" )
     {
         EXPECT_FALSE( recvHeader.IsError() );
         EXPECT_EQ( recvHeader.AsString(), "bin" );
+        EXPECT_EQ( recvHeader.AsStringView(), "bin" );
         EXPECT_EQ( recvHeader.Size(), 3 );
         for ( size_t i = 0; i < recvHeader.Size(); ++i )
         {
@@ -122,67 +186,1945 @@ TEST( Ipc, SeparateProcess )
         testing::ExitedWithCode( 0 ), "" );
 }
 
-TEST( Ipc, StopListening )
+TEST( Ipc, PersistentConnection )
+{
+    Ipc::ClientOptions options;
+    options.persistentConnection = true;
+    Ipc::Client client( c_serverSocket, options );
+
+    // The second server replaces the first, so the client has to reconnect
+    for ( int run = 0; run < 2; ++run )
+    {
+        Ipc::Server server( c_serverSocket );
+        auto listenThread = std::thread(
+            [&server]
+            {
+                for ( int i = 0; i < 3; ++i )
+                {
+                    ASSERT_FALSE( server.Listen( RecvCallback ).IsError() );
+                }
+            } );
+
+        for ( int i = 0; i < 3; ++i )
+        {
+            auto response = client.Send( std::string( "bin" ), std::vector<unsigned char>{ 0 } );
+            ASSERT_FALSE( response.IsError() );
+            ASSERT_EQ( response.AsByteVect(), std::vector<unsigned char>{ 1 } );
+        }
+
+        listenThread.join();
+    }
+}
+
+TEST( Ipc, AckHandshake )
 {
     Ipc::Server server( c_serverSocket );
-    auto listenThread = std::thread( [&server] { ASSERT_FALSE( server.Listen( RecvCallback ).IsError() ); } );
+    auto listenThread = std::thread(
+        [&server]
+        {
+            ASSERT_FALSE( server.Listen( RecvCallback ).IsError() );
+            ASSERT_FALSE( server.Listen( RecvCallback ).IsError() );
+        } );
 
-    server.StopListening();
+    // Clients with and without the ack handshake are served alike
+    Ipc::ClientOptions options;
+    options.ackHandshake = true;
+    Ipc::Client ackClient( c_serverSocket, options );
+    Ipc::Client client( c_serverSocket );
+
+    auto response = ackClient.Send( std::string( "bin" ), std::vector<unsigned char>{ 0 } );
+    ASSERT_FALSE( response.IsError() );
+    ASSERT_EQ( response.AsByteVect(), std::vector<unsigned char>{ 1 } );
+
+    auto response2 = client.Send( std::vector<unsigned char>{ 0 }, std::string( "Hello?" ) );
+    ASSERT_FALSE( response2.IsError() );
+    ASSERT_EQ( response2.AsString(), "Unix Domain Sockets!" );
 
     listenThread.join();
 }
 
-TEST( Ipc, PathTooLong )
+TEST( Ipc, LargeMessage )
 {
-    auto longPath =
-        "really/really/really/really/really/really/really/really/really/really/really/really/really/really/really/"
-        "really/really/really/really/really/really/really/really/really/really/really/really/really/really/long/path";
+    std::vector<unsigned char> payload( 8 * 1024 * 1024 );
+    for ( size_t i = 0; i < payload.size(); ++i )
+    {
+        payload[i] = (unsigned char)( i * 31 );
+    }
 
-    // Server
-    Ipc::Server server( longPath );
+    Ipc::Server server( c_serverSocket );
+    auto listenThread = std::thread(
+        [&server]
+        {
+            ASSERT_FALSE( server
+                              .Listen( []( const Ipc::Message&, const Ipc::Message& recvMessage )
+                                       { return recvMessage.AsByteVect(); } )
+                              .IsError() );
+        } );
 
-    auto result = server.Listen( RecvCallback );
-    ASSERT_TRUE( result.IsError() );
-    ASSERT_EQ( result.AsString(), std::string( "socket path too long: " ) + longPath );
+    Ipc::Client client( c_serverSocket );
+    auto response = client.Send( std::string( "echo" ), payload );
+    ASSERT_FALSE( response.IsError() );
+    ASSERT_EQ( response.AsByteVect(), payload );
 
-    // Client
-    Ipc::Client client( longPath );
-    auto response = client.Send( Ipc::Message( "header" ), Ipc::Message( "message" ) );
+    listenThread.join();
+}
+
+TEST( Ipc, ResponseBuffer )
+{
+    Ipc::Server server( c_serverSocket );
+    auto runThread = std::thread(
+        [&server]
+        {
+            ASSERT_FALSE( server
+                              .Run(
+                                  []( const Ipc::Message& recvHeader, const Ipc::Message& recvMessage )
+                                  {
+                                      if ( recvHeader.AsString() == "fail" )
+                                      {
+                                          return Ipc::Message( "failed", true );
+                                      }
+                                      return Ipc::Message( recvMessage.AsByteVect() );
+                                  } )
+                              .IsError() );
+        } );
+
+    Ipc::ClientOptions options;
+    options.persistentConnection = true;
+    Ipc::Client client( c_serverSocket, options );
+
+    // Responses that fit are received straight into the caller's buffer, small and large alike
+    std::vector<unsigned char> buffer( 1024 * 1024 );
+    auto response = client.Send( std::string( "echo" ), std::string( "hello" ), buffer.data(), buffer.size() );
+    ASSERT_FALSE( response.IsError() );
+    ASSERT_EQ( response.AsRaw(), buffer.data() );
+    ASSERT_EQ( response.AsString(), "hello" );
+
+    std::vector<unsigned char> payload( buffer.size() );
+    for ( size_t i = 0; i < payload.size(); ++i )
+    {
+        payload[i] = (unsigned char)( i * 31 );
+    }
+    response = client.Send( std::string( "echo" ), payload, buffer.data(), buffer.size() );
+    ASSERT_FALSE( response.IsError() );
+    ASSERT_EQ( response.AsRaw(), buffer.data() );
+    ASSERT_EQ( buffer, payload );
+
+    // Those that don't, and errors, are returned as usual
+    response = client.Send( std::string( "echo" ), payload, buffer.data(), 1024 );
+    ASSERT_FALSE( response.IsError() );
+    ASSERT_NE( response.AsRaw(), buffer.data() );
+    ASSERT_EQ( response.AsByteVect(), payload );
+
+    response = client.Send( std::string( "fail" ), std::string( "hello" ), buffer.data(), buffer.size() );
     ASSERT_TRUE( response.IsError() );
-    ASSERT_EQ( response.AsString(), std::string( "socket path too long: " ) + longPath );
+    ASSERT_EQ( response.AsString(), "failed" );
+
+    // Threads pipelining over the one connection each get their own response in their own buffer
+    std::atomic<int> mismatches = 0;
+    std::vector<std::thread> threads;
+    for ( int t = 0; t < 8; ++t )
+    {
+        threads.emplace_back(
+            [&client, &mismatches, t]
+            {
+                unsigned char threadBuffer[64];
+                for ( int i = 0; i < 100; ++i )
+                {
+                    auto message = std::to_string( t ) + ":" + std::to_string( i );
+                    auto threadResponse =
+                        client.Send( std::string( "echo" ), message, threadBuffer, sizeof( threadBuffer ) );
+                    if ( threadResponse.AsRaw() != threadBuffer || threadResponse.AsString() != message )
+                    {
+                        ++mismatches;
+                    }
+                }
+            } );
+    }
+    for ( auto& thread : threads )
+    {
+        thread.join();
+    }
+    ASSERT_EQ( mismatches, 0 );
+
+    server.StopListening();
+    runThread.join();
 }
 
-TEST( Ipc, EmptyMessage )
+TEST( Ipc, SharedMemory )
+{
+    auto echo = []( const Ipc::Message&, const Ipc::Message& recvMessage ) { return recvMessage.AsByteVect(); };
+
+    std::vector<unsigned char> payload( 3 * 1024 * 1024 );
+    for ( size_t i = 0; i < payload.size(); ++i )
+    {
+        payload[i] = (unsigned char)( i * 7 );
+    }
+
+    Ipc::ClientOptions clientOptions;
+    clientOptions.persistentConnection = true;
+    clientOptions.sharedMemory = true;
+    clientOptions.sharedMemorySize = 4 * 1024 * 1024;
+
+    // Payloads wrap around the rings, and ones that don't fit fall back to the socket. The second server doesn't
+    // allow shared memory at all, so the client falls back to the socket for everything
+    for ( bool allowSharedMemory : { true, false } )
+    {
+        Ipc::ServerOptions serverOptions;
+        serverOptions.sharedMemory = allowSharedMemory;
+        Ipc::Server server( c_serverSocket, serverOptions );
+        auto runThread = std::thread( [&server, &echo] { ASSERT_FALSE( server.Run( echo ).IsError() ); } );
+
+        Ipc::Client client( c_serverSocket, clientOptions );
+        for ( int i = 0; i < 5; ++i )
+        {
+            auto response = client.Send( std::string( "echo" ), payload );
+            ASSERT_FALSE( response.IsError() );
+            ASSERT_EQ( response.AsByteVect(), payload );
+
+            auto smallResponse = client.Send( std::string( "echo" ), std::string( "small" ) );
+            ASSERT_FALSE( smallResponse.IsError() );
+            ASSERT_EQ( smallResponse.AsString(), "small" );
+        }
+
+        std::vector<unsigned char> tooLarge( 5 * 1024 * 1024, 42 );
+        auto response = client.Send( std::string( "echo" ), tooLarge );
+        ASSERT_FALSE( response.IsError() );
+        ASSERT_EQ( response.AsByteVect(), tooLarge );
+
+        server.StopListening();
+        runThread.join();
+    }
+}
+
+TEST( Ipc, Run )
 {
+    Ipc::Server server( c_serverSocket );
+
+    std::promise<void> slowStarted;
+    std::promise<void> releaseSlow;
+    auto releaseSlowFuture = releaseSlow.get_future().share();
+
+    Ipc::RunOptions options;
+    options.workerCount = 2;
+    auto runThread = std::thread(
+        [&]
+        {
+            ASSERT_FALSE( server
+                              .Run(
+                                  [&]( const Ipc::Message& recvHeader, const Ipc::Message& recvMessage )
+                                  {
+                                      if ( recvHeader.AsString() == "slow" )
+                                      {
+                                          slowStarted.set_value();
+                                          releaseSlowFuture.wait();
+                                      }
+                                      return recvMessage.AsString();
+                                  },
+                                  options )
+                              .IsError() );
+        } );
+
+    // A slow callback occupies one worker while the other keeps serving
+    auto slowResponse = std::async( std::launch::async,
+                                    []
+                                    {
+                                        Ipc::Client client( c_serverSocket );
+                                        return client.Send( std::string( "slow" ), std::string( "tortoise" ) )
+                                            .AsString();
+                                    } );
+    slowStarted.get_future().wait();
+
     Ipc::Client client( c_serverSocket );
+    auto response = client.Send( std::string( "fast" ), std::string( "hare" ) );
+    ASSERT_FALSE( response.IsError() );
+    ASSERT_EQ( response.AsString(), "hare" );
 
-    auto response1 = client.Send( Ipc::Message( "" ), Ipc::Message( "message" ) );
-    ASSERT_TRUE( response1.IsError() );
-    ASSERT_EQ( response1.AsString(), "header can not be empty" );
+    releaseSlow.set_value();
+    ASSERT_EQ( slowResponse.get(), "tortoise" );
 
-    auto response2 = client.Send( Ipc::Message( "header" ), Ipc::Message( "" ) );
-    ASSERT_TRUE( response2.IsError() );
-    ASSERT_EQ( response2.AsString(), "message can not be empty" );
+    server.StopListening();
+    runThread.join();
+
+    auto stats = server.Stats();
+    ASSERT_EQ( stats.requestsQueued, 2 );
+    ASSERT_EQ( stats.requestsCompleted, 2 );
+    ASSERT_EQ( stats.queueDepth, 0 );
 }
 
-TEST( Ipc, MessageConversion )
+TEST( Ipc, ManyConnections )
 {
-    std::string messageStr = "test message 1 2 3";
-    Ipc::Message message( reinterpret_cast<unsigned char*>( &messageStr[0] ), messageStr.size() );
+    Ipc::Server server( c_serverSocket );
+    auto runThread = std::thread( [&server] { ASSERT_FALSE( server.Run( RecvCallback ).IsError() ); } );
 
-    ASSERT_FALSE( message.IsError() );
+    Ipc::ClientOptions options;
+    options.persistentConnection = true;
 
-    ASSERT_EQ( message.Size(), messageStr.size() );
-    ASSERT_EQ( message.AsString().size(), messageStr.size() );
-    ASSERT_EQ( message.AsByteVect().size(), messageStr.size() );
+    std::vector<std::unique_ptr<Ipc::Client>> clients;
+    for ( int i = 0; i < 200; ++i )
+    {
+        clients.push_back( std::make_unique<Ipc::Client>( c_serverSocket, options ) );
+        ASSERT_FALSE( clients.back()->Send( std::string( "bin" ), std::vector<unsigned char>{ 0 } ).IsError() );
+    }
 
-    ASSERT_EQ( message.AsString(), messageStr );
+    // Every connection stays open and keeps being served
+    for ( auto& client : clients )
+    {
+        auto response = client->Send( std::vector<unsigned char>{ 0 }, std::string( "Hello?" ) );
+        ASSERT_FALSE( response.IsError() );
+        ASSERT_EQ( response.AsString(), "Unix Domain Sockets!" );
+    }
 
-    for ( size_t i = 0; i < messageStr.size(); ++i )
+    server.StopListening();
+    runThread.join();
+}
+
+TEST( Ipc, Pipelining )
+{
+    Ipc::Server server( c_serverSocket );
+
+    std::promise<void> slowStarted;
+    std::promise<void> releaseSlow;
+    auto releaseSlowFuture = releaseSlow.get_future().share();
+
+    Ipc::RunOptions runOptions;
+    runOptions.workerCount = 4;
+    auto runThread = std::thread(
+        [&]
+        {
+            ASSERT_FALSE( server
+                              .Run(
+                                  [&]( const Ipc::Message& recvHeader, const Ipc::Message& recvMessage )
+                                  {
+                                      if ( recvHeader.AsString() == "slow" )
+                                      {
+                                          slowStarted.set_value();
+                                          releaseSlowFuture.wait();
+                                      }
+                                      return recvMessage.AsString();
+                                  },
+                                  runOptions )
+                              .IsError() );
+        } );
+
+    Ipc::ClientOptions options;
+    options.persistentConnection = true;
+    Ipc::Client client( c_serverSocket, options );
+
+    // A slow request doesn't hold up those sent after it over the same connection, their responses overtake it
+    auto slowResponse =
+        std::async( std::launch::async,
+                    [&client] { return client.Send( std::string( "slow" ), std::string( "tortoise" ) ).AsString(); } );
+    slowStarted.get_future().wait();
+
+    auto response = client.Send( std::string( "fast" ), std::string( "hare" ) );
+    ASSERT_FALSE( response.IsError() );
+    ASSERT_EQ( response.AsString(), "hare" );
+
+    releaseSlow.set_value();
+    ASSERT_EQ( slowResponse.get(), "tortoise" );
+
+    // Each of many threads sharing the connection gets its own responses back
+    std::atomic<int> mismatches = 0;
+    std::vector<std::thread> threads;
+    for ( int t = 0; t < 8; ++t )
     {
-        ASSERT_EQ( message.AsByteVect()[i], (unsigned char)messageStr[i] );
-        ASSERT_EQ( message.AsRaw()[i], (unsigned char)messageStr[i] );
+        threads.emplace_back(
+            [&client, &mismatches, t]
+            {
+                for ( int i = 0; i < 100; ++i )
+                {
+                    auto message = std::to_string( t ) + ":" + std::to_string( i );
+                    if ( client.Send( std::string( "echo" ), message ).AsString() != message )
+                    {
+                        ++mismatches;
+                    }
+                }
+            } );
+    }
+    for ( auto& thread : threads )
+    {
+        thread.join();
+    }
+    ASSERT_EQ( mismatches, 0 );
+
+    server.StopListening();
+    runThread.join();
+}
+
+TEST( Ipc, SendAsync )
+{
+    Ipc::Server server( c_serverSocket );
+    auto runThread = std::thread(
+        [&server]
+        {
+            ASSERT_FALSE(
+                server.Run( []( const Ipc::Message&, const Ipc::Message& message ) { return message.AsString(); } )
+                    .IsError() );
+        } );
+
+    for ( bool persistent : { true, false } )
+    {
+        Ipc::ClientOptions options;
+        options.persistentConnection = persistent;
+        Ipc::Client client( c_serverSocket, options );
+
+        // Many requests in flight at once from one thread
+        std::vector<std::future<Ipc::Message>> responses;
+        for ( int i = 0; i < 100; ++i )
+        {
+            responses.push_back( client.SendAsync( std::string( "future" ), std::to_string( i ) ) );
+        }
+        for ( int i = 0; i < 100; ++i )
+        {
+            auto response = responses[i].get();
+            ASSERT_FALSE( response.IsError() );
+            ASSERT_EQ( response.AsString(), std::to_string( i ) );
+        }
+
+        std::atomic<int> callbackCount = 0;
+        std::atomic<int> mismatches = 0;
+        std::promise<void> allDone;
+        for ( int i = 0; i < 100; ++i )
+        {
+            client.SendAsync( std::string( "callback" ), std::to_string( i ),
+                              [&, i]( Ipc::Message response )
+                              {
+                                  if ( response.AsString() != std::to_string( i ) )
+                                  {
+                                      ++mismatches;
+                                  }
+                                  if ( ++callbackCount == 100 )
+                                  {
+                                      allDone.set_value();
+                                  }
+                              } );
+        }
+        allDone.get_future().wait();
+        ASSERT_EQ( mismatches, 0 );
+
+        // Errors come back through the response too
+        auto error = client.SendAsync( std::string( "header" ), std::string( "" ) ).get();
+        ASSERT_TRUE( error.IsError() );
+        ASSERT_EQ( error.AsString(), "message can not be empty" );
+    }
+
+    server.StopListening();
+    runThread.join();
+}
+
+TEST( Ipc, SendAsyncSlowResponse )
+{
+    Ipc::Server server( c_serverSocket );
+
+    std::promise<void> releaseSlow;
+    auto releaseSlowFuture = releaseSlow.get_future().share();
+    Ipc::RunOptions options;
+    options.workerCount = 2;
+    auto runThread = std::thread(
+        [&]
+        {
+            ASSERT_FALSE( server
+                              .Run(
+                                  [&]( const Ipc::Message& recvHeader, const Ipc::Message& recvMessage )
+                                  {
+                                      if ( recvHeader.AsString() == "slow" )
+                                      {
+                                          releaseSlowFuture.wait();
+                                      }
+                                      return recvMessage.AsString();
+                                  },
+                                  options )
+                              .IsError() );
+        } );
+
+    // Each request gets a connection of its own, and the one still waiting holds up no other's response
+    Ipc::ClientOptions clientOptions;
+    clientOptions.persistentConnection = false;
+    Ipc::Client client( c_serverSocket, clientOptions );
+    auto slowResponse = client.SendAsync( std::string( "slow" ), std::string( "tortoise" ) );
+    auto fastResponse = client.SendAsync( std::string( "fast" ), std::string( "hare" ) );
+    ASSERT_EQ( fastResponse.wait_for( std::chrono::seconds( 5 ) ), std::future_status::ready );
+    ASSERT_EQ( fastResponse.get().AsString(), "hare" );
+    ASSERT_EQ( slowResponse.wait_for( std::chrono::milliseconds( 0 ) ), std::future_status::timeout );
+
+    releaseSlow.set_value();
+    ASSERT_EQ( slowResponse.get().AsString(), "tortoise" );
+
+    server.StopListening();
+    runThread.join();
+}
+
+#ifdef __cpp_impl_coroutine
+static Ipc::Task<int> Add( int a, int b )
+{
+    co_return a + b;
+}
+
+static Ipc::Task<void> Throw()
+{
+    throw std::runtime_error( "thrown" );
+    co_return;
+}
+
+static Ipc::Task<void>
+SendCoRequest( Ipc::Client& client, Ipc::Executor& executor, int i, int& remaining, int& mismatches )
+{
+    // Tasks compose, passing results and exceptions back to their awaiter
+    if ( co_await Add( i, 1 ) != i + 1 )
+    {
+        ++mismatches;
+    }
+    try
+    {
+        co_await Throw();
+        ++mismatches;
+    }
+    catch ( const std::runtime_error& )
+    {
+    }
+
+    auto message = std::to_string( i );
+    auto response = co_await client.SendCo( std::string( "co" ), message );
+    if ( response.IsError() || response.AsString() != message + "!" )
+    {
+        ++mismatches;
+    }
+
+    if ( --remaining == 0 )
+    {
+        executor.Stop();
+    }
+}
+
+TEST( Ipc, Coroutines )
+{
+    // A backend for the coroutine handlers to await
+    Ipc::Server backend( "backend.sock" );
+    auto backendThread = std::thread(
+        [&backend]
+        {
+            ASSERT_FALSE(
+                backend
+                    .Run( []( const Ipc::Message&, const Ipc::Message& message ) { return message.AsString() + "!"; } )
+                    .IsError() );
+        } );
+
+    Ipc::ClientOptions options;
+    options.persistentConnection = true;
+    Ipc::Client backendClient( "backend.sock", options );
+
+    // Every request is forwarded to the backend without tying up a thread while it waits
+    Ipc::Server server( c_serverSocket );
+    Ipc::Executor serverExecutor;
+    auto serverExecutorThread = std::thread( [&serverExecutor] { ASSERT_FALSE( serverExecutor.Run().IsError() ); } );
+    auto serverThread = std::thread(
+        [&]
+        {
+            ASSERT_FALSE( server
+                              .RunCo(
+                                  [&backendClient]( const Ipc::Message& header,
+                                                    const Ipc::Message& message ) -> Ipc::Task<Ipc::Message>
+                                  { co_return co_await backendClient.SendCo( header, message ); },
+                                  serverExecutor )
+                              .IsError() );
+        } );
+
+    // Many coroutines in flight at once, all on this thread
+    Ipc::Client client( c_serverSocket, options );
+    Ipc::Executor executor;
+    int remaining = 50;
+    int mismatches = 0;
+    for ( int i = 0; i < 50; ++i )
+    {
+        executor.Spawn( SendCoRequest( client, executor, i, remaining, mismatches ) );
+    }
+    ASSERT_FALSE( executor.Run().IsError() );
+    ASSERT_EQ( remaining, 0 );
+    ASSERT_EQ( mismatches, 0 );
+
+    server.StopListening();
+    serverThread.join();
+    serverExecutor.Stop();
+    serverExecutorThread.join();
+    backend.StopListening();
+    backendThread.join();
+}
+#endif
+
+TEST( Ipc, SendBatch )
+{
+    Ipc::Server server( c_serverSocket );
+
+    std::atomic<int> callbackCount = 0;
+    Ipc::RunOptions runOptions;
+    runOptions.workerCount = 4;
+    auto runThread = std::thread(
+        [&]
+        {
+            ASSERT_FALSE( server
+                              .Run(
+                                  [&]( const Ipc::Message& recvHeader, const Ipc::Message& recvMessage )
+                                  {
+                                      ++callbackCount;
+                                      if ( recvHeader.AsString() == "fail" )
+                                      {
+                                          return Ipc::Message( "failed", true );
+                                      }
+                                      return Ipc::Message( recvMessage.AsByteVect() );
+                                  },
+                                  runOptions )
+                              .IsError() );
+        } );
+
+    // The callback runs once per request, and the responses come back in request order
+    std::vector<std::pair<Ipc::Message, Ipc::Message>> requests;
+    for ( int i = 0; i < 100; ++i )
+    {
+        requests.emplace_back( std::string( i == 50 ? "fail" : "echo" ), std::to_string( i ) );
     }
+    requests.emplace_back( std::string( "echo" ), std::vector<unsigned char>( 64 * 1024, 7 ) );
+
+    Ipc::Client client( c_serverSocket );
+    auto responses = client.SendBatch( requests );
+    ASSERT_EQ( responses.size(), requests.size() );
+    ASSERT_EQ( callbackCount, (int)requests.size() );
+    for ( int i = 0; i < 100; ++i )
+    {
+        ASSERT_EQ( responses[i].IsError(), i == 50 );
+        ASSERT_EQ( responses[i].AsString(), i == 50 ? "failed" : std::to_string( i ) );
+    }
+    ASSERT_EQ( responses[100].AsByteVect(), std::vector<unsigned char>( 64 * 1024, 7 ) );
+
+    // Through shared memory and with the ack handshake too
+    Ipc::ClientOptions options;
+    options.persistentConnection = true;
+    options.sharedMemory = true;
+    options.ackHandshake = true;
+    Ipc::Client sharedMemoryClient( c_serverSocket, options );
+    responses = sharedMemoryClient.SendBatch( requests );
+    ASSERT_EQ( responses.size(), requests.size() );
+    ASSERT_EQ( responses[99].AsString(), "99" );
+    ASSERT_EQ( responses[100].AsByteVect(), std::vector<unsigned char>( 64 * 1024, 7 ) );
+
+    // A request that couldn't be sent on its own fails the batch
+    requests.emplace_back( std::string( "echo" ), std::string( "" ) );
+    responses = client.SendBatch( requests );
+    ASSERT_EQ( responses.size(), requests.size() );
+    ASSERT_TRUE( responses[0].IsError() );
+    ASSERT_EQ( responses[0].AsString(), "message can not be empty" );
+
+    ASSERT_TRUE( client.SendBatch( {} ).empty() );
+
+    server.StopListening();
+    runThread.join();
+}
+
+TEST( Ipc, ClientPool )
+{
+    Ipc::ClientPoolOptions options;
+    options.maxConnections = 4;
+    options.maxIdleConnections = 2;
+    options.healthCheckInterval = std::chrono::milliseconds( 0 );
+    Ipc::ClientPool pool( c_serverSocket, options );
+
+    // The second server replaces the first, so the pool's connections fail their health checks
+    for ( int run = 0; run < 2; ++run )
+    {
+        Ipc::Server server( c_serverSocket );
+        auto runThread = std::thread(
+            [&server]
+            {
+                ASSERT_FALSE( server
+                                  .Run( []( const Ipc::Message& recvHeader, const Ipc::Message& recvMessage )
+                                        { return recvHeader.AsString() + recvMessage.AsString(); } )
+                                  .IsError() );
+            } );
+
+        std::vector<std::thread> threads;
+        for ( int t = 0; t < 8; ++t )
+        {
+            threads.emplace_back(
+                [&pool, t]
+                {
+                    for ( int i = 0; i < 200; ++i )
+                    {
+                        auto response = pool.Send( std::to_string( t ), std::to_string( i ) );
+                        ASSERT_EQ( response.AsString(), std::to_string( t ) + std::to_string( i ) );
+                    }
+                } );
+        }
+        for ( auto& thread : threads )
+        {
+            thread.join();
+        }
+
+        // Never more connections than allowed, nor more of them left idle
+        auto stats = pool.Stats();
+        ASSERT_LE( stats.client.connectionsOpened, 4u * ( run + 1 ) );
+        ASSERT_LE( stats.openConnections, 2u );
+        ASSERT_EQ( stats.idleConnections, stats.openConnections );
+        ASSERT_EQ( stats.client.requestsSent, 1600u * ( run + 1 ) );
+        if ( run == 1 )
+        {
+            ASSERT_GT( stats.healthCheckFailures, 0u );
+        }
+
+        server.StopListening();
+        runThread.join();
+    }
+}
+
+TEST( Ipc, ClientPoolAckTimeout )
+{
+    Ipc::Server server( c_serverSocket );
+
+    std::promise<void> slowStarted;
+    std::promise<void> releaseSlow;
+    auto releaseSlowFuture = releaseSlow.get_future().share();
+    Ipc::RunOptions runOptions;
+    runOptions.workerCount = 2;
+    auto runThread = std::thread(
+        [&]
+        {
+            ASSERT_FALSE( server
+                              .Run(
+                                  [&]( const Ipc::Message& recvHeader, const Ipc::Message& recvMessage )
+                                  {
+                                      if ( recvHeader.AsString() == "slow" )
+                                      {
+                                          slowStarted.set_value();
+                                          releaseSlowFuture.wait();
+                                      }
+                                      return recvMessage.AsString();
+                                  },
+                                  runOptions )
+                              .IsError() );
+        } );
+
+    // With the ack handshake the only connection isn't shared, so a call waiting for it gives up by its total timeout
+    Ipc::ClientPoolOptions options;
+    options.maxConnections = 1;
+    options.client.ackHandshake = true;
+    Ipc::ClientPool pool( c_serverSocket, options );
+    auto slowResponse =
+        std::async( std::launch::async, [&] { return pool.Send( std::string( "slow" ), std::string( "tortoise" ) ); } );
+    slowStarted.get_future().wait();
+
+    Ipc::Timeouts timeouts;
+    timeouts.total = std::chrono::milliseconds( 100 );
+    auto start = std::chrono::steady_clock::now();
+    auto response = pool.Send( std::string( "fast" ), std::string( "hare" ), timeouts );
+    ASSERT_TRUE( response.IsError() );
+    ASSERT_EQ( response.AsString(), "no connection came free (timed out)" );
+    ASSERT_LT( std::chrono::steady_clock::now() - start, std::chrono::seconds( 1 ) );
+
+    releaseSlow.set_value();
+    ASSERT_EQ( slowResponse.get().AsString(), "tortoise" );
+    ASSERT_EQ( pool.Send( std::string( "fast" ), std::string( "hare" ), timeouts ).AsString(), "hare" );
+
+    server.StopListening();
+    runThread.join();
+}
+
+TEST( Ipc, Streaming )
+{
+    Ipc::Server server( c_serverSocket );
+
+    const size_t partSize = 64 * 1024;
+    std::atomic<bool> streamFailed = false;
+    Ipc::RunOptions runOptions;
+    runOptions.workerCount = 4;
+    auto runThread = std::thread(
+        [&]
+        {
+            ASSERT_FALSE( server
+                              .RunStreaming(
+                                  [&]( const Ipc::Message& recvHeader, const Ipc::Message& recvMessage,
+                                       Ipc::Stream& stream )
+                                  {
+                                      auto command = recvHeader.AsString();
+                                      if ( command == "generate" )
+                                      {
+                                          // As many parts as asked for, each filled with its index
+                                          int count = std::stoi( recvMessage.AsString() );
+                                          std::vector<unsigned char> part( partSize );
+                                          for ( int i = 0; i < count; ++i )
+                                          {
+                                              std::fill( part.begin(), part.end(), (unsigned char)i );
+                                              if ( !stream.Write( Ipc::Message( part.data(), part.size() ) ) )
+                                              {
+                                                  return Ipc::Message( "write failed", true );
+                                              }
+                                          }
+                                          return Ipc::Message( std::string( "end" ) );
+                                      }
+                                      if ( command == "count" || command == "echo" )
+                                      {
+                                          // Every part of the request, sent back as it comes in if asked to
+                                          bool echo = command == "echo";
+                                          size_t total = recvMessage.Size();
+                                          if ( echo )
+                                          {
+                                              stream.Write( recvMessage );
+                                          }
+                                          Ipc::Message part( nullptr, 0 );
+                                          while ( stream.Read( part ) )
+                                          {
+                                              total += part.Size();
+                                              if ( echo )
+                                              {
+                                                  stream.Write( part );
+                                              }
+                                          }
+                                          streamFailed = streamFailed || stream.Failed();
+                                          return Ipc::Message( std::to_string( total ) );
+                                      }
+                                      return Ipc::Message( "unknown command", true );
+                                  },
+                                  runOptions )
+                              .IsError() );
+        } );
+
+    for ( bool persistent : { false, true } )
+    {
+        Ipc::ClientOptions options;
+        options.persistentConnection = persistent;
+        Ipc::Client client( c_serverSocket, options );
+
+        // A streamed response arrives part by part, in order
+        int partCount = 0;
+        bool inOrder = true;
+        auto response = client.SendStreaming( std::string( "generate" ), std::string( "100" ),
+                                              [&]( Ipc::Message chunk )
+                                              {
+                                                  inOrder = inOrder && chunk.Size() == partSize &&
+                                                            chunk.AsRaw()[0] == (unsigned char)partCount &&
+                                                            chunk.AsRaw()[partSize - 1] == (unsigned char)partCount;
+                                                  ++partCount;
+                                              } );
+        ASSERT_FALSE( response.IsError() ) << response.AsString();
+        ASSERT_EQ( response.AsString(), "end" );
+        ASSERT_EQ( partCount, 100 );
+        ASSERT_TRUE( inOrder );
+
+        // Or whole, to a client that doesn't ask for parts
+        response = client.Send( std::string( "generate" ), std::string( "3" ) );
+        ASSERT_EQ( response.Size(), 3 * partSize + 3 );
+        ASSERT_EQ( response.AsRaw()[2 * partSize], 2 );
+
+        // A streamed request, its parts coming from one reused buffer
+        std::vector<unsigned char> buffer( 100 * 1024 );
+        int partsSent = 0;
+        auto nextChunk = [&]( Ipc::Message& chunk )
+        {
+            if ( partsSent == 50 )
+            {
+                return false;
+            }
+            std::fill( buffer.begin(), buffer.end(), (unsigned char)partsSent++ );
+            chunk = Ipc::Message( buffer.data(), buffer.size() );
+            return true;
+        };
+        response = client.SendStreaming( std::string( "count" ), nextChunk );
+        ASSERT_EQ( response.AsString(), std::to_string( 50 * 100 * 1024 ) );
+
+        // Both ways at once
+        partsSent = 0;
+        size_t echoed = 0;
+        response = client.SendStreaming( std::string( "echo" ), nextChunk,
+                                         [&]( Ipc::Message chunk )
+                                         {
+                                             inOrder = inOrder && chunk.Size() == buffer.size() &&
+                                                       chunk.AsRaw()[0] == (unsigned char)( echoed / buffer.size() );
+                                             echoed += chunk.Size();
+                                         } );
+        ASSERT_EQ( response.AsString(), std::to_string( 50 * 100 * 1024 ) );
+        ASSERT_EQ( echoed, 50 * 100 * 1024u );
+        ASSERT_TRUE( inOrder );
+
+        // Answered before the request is all sent, which stops the client asking for more parts
+        int partsAsked = 0;
+        response = client.SendStreaming( std::string( "nonsense" ),
+                                         [&]( Ipc::Message& chunk )
+                                         {
+                                             ++partsAsked;
+                                             chunk = Ipc::Message( buffer.data(), buffer.size() );
+                                             return true;
+                                         } );
+        ASSERT_TRUE( response.IsError() );
+        ASSERT_EQ( response.AsString(), "unknown command" );
+        ASSERT_LE( partsAsked, 10 );
+        ASSERT_EQ( client.Send( std::string( "generate" ), std::string( "0" ) ).AsString(), "end" );
+    }
+
+    // Parts written for an item of a batch go back joined
+    Ipc::Client client( c_serverSocket );
+    std::vector<std::pair<Ipc::Message, Ipc::Message>> requests;
+    requests.emplace_back( std::string( "generate" ), std::string( "2" ) );
+    requests.emplace_back( std::string( "count" ), std::string( "four" ) );
+    auto responses = client.SendBatch( requests );
+    ASSERT_EQ( responses[0].Size(), 2 * partSize + 3 );
+    ASSERT_EQ( responses[1].AsString(), "4" );
+
+    server.StopListening();
+    runThread.join();
+    ASSERT_FALSE( streamFailed );
+
+    // Only RunStreaming() takes streamed requests
+    Ipc::Server plainServer( c_serverSocket );
+    runThread = std::thread(
+        [&]
+        {
+            ASSERT_FALSE(
+                plainServer.Run( []( const Ipc::Message&, const Ipc::Message& message ) { return message.AsString(); } )
+                    .IsError() );
+        } );
+    int partsSent = 0;
+    auto response = Ipc::Client( c_serverSocket )
+                        .SendStreaming( std::string( "stream" ),
+                                        [&]( Ipc::Message& chunk )
+                                        {
+                                            chunk = Ipc::Message( std::string( "part" ) );
+                                            return ++partsSent <= 3;
+                                        } );
+    ASSERT_TRUE( response.IsError() );
+    ASSERT_EQ( response.AsString(), "streamed requests need RunStreaming()" );
+
+    plainServer.StopListening();
+    runThread.join();
+}
+
+TEST( Ipc, Register )
+{
+    std::atomic<int> fallbackCount = 0;
+    {
+        Ipc::Server server( c_serverSocket );
+        ASSERT_FALSE( server
+                          .Register( std::string( "echo" ),
+                                     []( const Ipc::Message&, const Ipc::Message& recvMessage )
+                                     { return Ipc::Message( recvMessage.AsByteVect() ); } )
+                          .IsError() );
+        ASSERT_FALSE( server
+                          .Register( std::string( "fail" ),
+                                     []( const Ipc::Message& recvHeader, const Ipc::Message& )
+                                     { return Ipc::Message( recvHeader.AsString() + "ed", true ); } )
+                          .IsError() );
+
+        // Each header can only have one handler
+        auto result = server.Register( std::string( "echo" ),
+                                       []( const Ipc::Message&, const Ipc::Message& ) { return std::string( "" ); } );
+        ASSERT_TRUE( result.IsError() );
+        ASSERT_EQ( result.AsString(), "header already registered: echo" );
+        ASSERT_TRUE( server.Register( std::string( "none" ), nullptr ).IsError() );
+
+        // Nor can a route have an empty header, which no request has
+        result = server.Register( std::string( "" ),
+                                  []( const Ipc::Message&, const Ipc::Message& ) { return std::string( "" ); } );
+        ASSERT_TRUE( result.IsError() );
+        ASSERT_EQ( result.AsString(), "header can not be empty" );
+
+        Ipc::RunOptions runOptions;
+        runOptions.workerCount = 4;
+        auto runThread = std::thread(
+            [&]
+            {
+                ASSERT_FALSE( server
+                                  .Run(
+                                      [&]( const Ipc::Message& recvHeader, const Ipc::Message& )
+                                      {
+                                          ++fallbackCount;
+                                          return Ipc::Message( "fallback for " + recvHeader.AsString() );
+                                      },
+                                      runOptions )
+                                  .IsError() );
+            } );
+
+        Ipc::ClientOptions options;
+        options.persistentConnection = true;
+        Ipc::Client client( c_serverSocket, options );
+        for ( int i = 0; i < 100; ++i )
+        {
+            ASSERT_EQ( client.Send( std::string( "echo" ), std::to_string( i ) ).AsString(), std::to_string( i ) );
+        }
+        auto response = client.Send( std::string( "fail" ), std::string( "ping" ) );
+        ASSERT_TRUE( response.IsError() );
+        ASSERT_EQ( response.AsString(), "failed" );
+
+        // Headers that only start like a route's, or that have none, go to the callback
+        ASSERT_EQ( client.Send( std::string( "echoes" ), std::string( "ping" ) ).AsString(), "fallback for echoes" );
+        ASSERT_EQ( client.Send( std::string( "ech" ), std::string( "ping" ) ).AsString(), "fallback for ech" );
+
+        // Items of a batch are routed too
+        std::vector<std::pair<Ipc::Message, Ipc::Message>> requests;
+        requests.emplace_back( std::string( "echo" ), std::string( "a" ) );
+        requests.emplace_back( std::string( "other" ), std::string( "b" ) );
+        auto responses = client.SendBatch( requests );
+        ASSERT_EQ( responses.size(), 2u );
+        ASSERT_EQ( responses[0].AsString(), "a" );
+        ASSERT_EQ( responses[1].AsString(), "fallback for other" );
+        ASSERT_EQ( fallbackCount, 3 );
+
+        // Each route is counted on its own, in the order registered
+        auto stats = server.Stats();
+        ASSERT_EQ( stats.routes.size(), 2u );
+        ASSERT_EQ( stats.routes[0].header, "echo" );
+        ASSERT_EQ( stats.routes[0].requests, 101u );
+        ASSERT_EQ( stats.routes[0].errors, 0u );
+        ASSERT_EQ( stats.routes[0].latency.count, 101u );
+        ASSERT_EQ( stats.routes[1].header, "fail" );
+        ASSERT_EQ( stats.routes[1].requests, 1u );
+        ASSERT_EQ( stats.routes[1].errors, 1u );
+
+        server.StopListening();
+        runThread.join();
+    }
+
+    // Without a callback, requests with no route are answered with an error
+    Ipc::Server server( c_serverSocket );
+    for ( int i = 0; i < 100; ++i )
+    {
+        auto route = "route" + std::to_string( i );
+        ASSERT_FALSE( server
+                          .Register( route, [route]( const Ipc::Message&, const Ipc::Message& ) { return route; } )
+                          .IsError() );
+    }
+
+    auto runThread = std::thread( [&] { ASSERT_FALSE( server.Run( nullptr ).IsError() ); } );
+
+    Ipc::Client client( c_serverSocket );
+    for ( int i = 0; i < 100; ++i )
+    {
+        auto route = "route" + std::to_string( i );
+        ASSERT_EQ( client.Send( route, std::string( "ping" ) ).AsString(), route );
+    }
+    auto response = client.Send( std::string( "route100" ), std::string( "ping" ) );
+    ASSERT_TRUE( response.IsError() );
+    ASSERT_EQ( response.AsString(), "no handler registered for header: route100" );
+
+    server.StopListening();
+    runThread.join();
+}
+
+#ifndef _WIN32
+#ifdef __linux__
+TEST( Ipc, FdPassing )
+{
+    Ipc::Server server( c_serverSocket );
+    auto runThread = std::thread(
+        [&]
+        {
+            ASSERT_FALSE( server
+                              .Run(
+                                  []( const Ipc::Message& recvHeader, const Ipc::Message& recvMessage )
+                                  {
+                                      if ( recvMessage.Fds().size() != 1 )
+                                      {
+                                          return Ipc::Message( "expected one fd", true );
+                                      }
+
+                                      // Write to the pipe we were handed
+                                      if ( recvHeader.AsString() == "pipe" )
+                                      {
+                                          auto written = write( recvMessage.Fds()[0], "hi", 2 );
+                                          return Ipc::Message( std::to_string( written ) );
+                                      }
+
+                                      // Read the payload where it lies, and answer with one of our own
+                                      Ipc::MemfdPayload request;
+                                      auto error = request.Map( recvMessage.Fds()[0] );
+                                      if ( !error.empty() )
+                                      {
+                                          return Ipc::Message( error, true );
+                                      }
+                                      Ipc::MemfdPayload response;
+                                      response.Create( request.Size() );
+                                      for ( size_t i = 0; i < request.Size(); ++i )
+                                      {
+                                          response.Data()[i] = (unsigned char)( request.Data()[i] + 1 );
+                                      }
+                                      Ipc::Message responseMessage( std::string( "payload" ) );
+                                      response.AttachTo( responseMessage );
+                                      return responseMessage;
+                                  } )
+                              .IsError() );
+        } );
+
+    Ipc::ClientOptions options;
+    options.persistentConnection = true;
+    Ipc::Client client( c_serverSocket, options );
+
+    // Any descriptor can be passed
+    int pipeFds[2];
+    ASSERT_EQ( pipe( pipeFds ), 0 );
+    Ipc::Message pipeMessage( std::string( "write end" ) );
+    pipeMessage.AttachFd( pipeFds[1] );
+    ASSERT_EQ( client.Send( std::string( "pipe" ), pipeMessage ).AsString(), "2" );
+    char readBack[2] = {};
+    ASSERT_EQ( read( pipeFds[0], readBack, 2 ), 2 );
+    ASSERT_EQ( std::string( readBack, 2 ), "hi" );
+    close( pipeFds[0] );
+
+    // Memfd payloads travel both ways without passing through the socket
+    for ( int i = 0; i < 3; ++i )
+    {
+        Ipc::MemfdPayload payload;
+        ASSERT_EQ( payload.Create( 8 * 1024 * 1024 ), "" );
+        memset( payload.Data(), i, payload.Size() );
+        Ipc::Message message( std::string( "payload" ) );
+        ASSERT_EQ( payload.AttachTo( message ), "" );
+
+        auto bytesOut = client.Stats().io.bytesOut;
+        auto response = client.Send( std::string( "memfd" ), message );
+        ASSERT_FALSE( response.IsError() ) << response.AsString();
+        ASSERT_LT( client.Stats().io.bytesOut - bytesOut, 1024u );
+        ASSERT_EQ( response.Fds().size(), 1u );
+
+        Ipc::MemfdPayload echoed;
+        ASSERT_EQ( echoed.Map( response.Fds()[0] ), "" );
+        ASSERT_EQ( echoed.Size(), payload.Size() );
+        ASSERT_EQ( echoed.Data()[0], i + 1 );
+        ASSERT_EQ( echoed.Data()[echoed.Size() - 1], i + 1 );
+    }
+
+    // A payload the sender could still change is refused
+    int unsealedFd = memfd_create( "unsealed", MFD_CLOEXEC );
+    ASSERT_EQ( ftruncate( unsealedFd, 4096 ), 0 );
+    Ipc::MemfdPayload unsealed;
+    ASSERT_EQ( unsealed.Map( unsealedFd ), "payload not sealed" );
+    close( unsealedFd );
+
+    server.StopListening();
+    runThread.join();
+}
+
+TEST( Ipc, IoUring )
+{
+    // Falls back to epoll where io_uring isn't available, so everything here must work either way
+    Ipc::ServerOptions serverOptions;
+    serverOptions.ioUring = true;
+    Ipc::Server server( c_serverSocket, serverOptions );
+    auto runThread = std::thread(
+        [&]
+        {
+            ASSERT_FALSE( server
+                              .Run(
+                                  []( const Ipc::Message& recvHeader, const Ipc::Message& recvMessage )
+                                  {
+                                      if ( recvHeader.AsString() == "fds" )
+                                      {
+                                          return Ipc::Message( std::to_string( recvMessage.Fds().size() ) );
+                                      }
+                                      return Ipc::Message( recvMessage.AsByteVect() );
+                                  } )
+                              .IsError() );
+        } );
+
+    // Concurrent clients, with messages spanning many receive buffers among small ones
+    const size_t messageSizes[] = { 1, 100, 100 * 1024, 1024 * 1024 };
+    std::vector<std::thread> clientThreads;
+    for ( int i = 0; i < 4; ++i )
+    {
+        clientThreads.emplace_back(
+            [&, i]
+            {
+                Ipc::ClientOptions options;
+                options.persistentConnection = i % 2 == 0;
+                Ipc::Client client( c_serverSocket, options );
+                for ( int j = 0; j < 20; ++j )
+                {
+                    std::vector<unsigned char> message( messageSizes[j % std::size( messageSizes )], (unsigned char)j );
+                    message.back() = (unsigned char)i;
+                    auto response = client.Send( std::string( "echo" ), message );
+                    ASSERT_FALSE( response.IsError() ) << response.AsString();
+                    ASSERT_EQ( response.AsByteVect(), message );
+                }
+            } );
+    }
+    for ( auto& clientThread : clientThreads )
+    {
+        clientThread.join();
+    }
+
+    // File descriptors arrive with their message
+    Ipc::ClientOptions options;
+    options.persistentConnection = true;
+    Ipc::Client client( c_serverSocket, options );
+    int pipeFds[2];
+    ASSERT_EQ( pipe( pipeFds ), 0 );
+    Ipc::Message fdMessage( std::string( "pipe" ) );
+    fdMessage.AttachFd( pipeFds[0] );
+    fdMessage.AttachFd( pipeFds[1] );
+    ASSERT_EQ( client.Send( std::string( "fds" ), fdMessage ).AsString(), "2" );
+
+    // A connection sending garbage is dropped (and closed once its receive has wound down) without disturbing others
+    sockaddr_un socketAddr = {};
+    socketAddr.sun_family = AF_UNIX;
+    strncpy( socketAddr.sun_path, c_serverSocket, sizeof( socketAddr.sun_path ) - 1 );
+    int garbageSocket = socket( AF_UNIX, SOCK_STREAM, 0 );
+    ASSERT_EQ( connect( garbageSocket, reinterpret_cast<const sockaddr*>( &socketAddr ), sizeof( socketAddr ) ), 0 );
+    timeval timeout = { 5, 0 };
+    setsockopt( garbageSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( timeout ) );
+    std::string garbage( 64, 'x' );
+    ASSERT_EQ( send( garbageSocket, garbage.data(), garbage.size(), 0 ), (ssize_t)garbage.size() );
+    char byte;
+    ASSERT_EQ( recv( garbageSocket, &byte, 1, 0 ), 0 );
+    close( garbageSocket );
+    ASSERT_EQ( client.Send( std::string( "echo" ), std::string( "still here" ) ).AsString(), "still here" );
+
+    // Through io_uring the receiving thread never calls recv() itself
+    auto stats = server.Stats();
+    if ( stats.ioUring )
+    {
+        ASSERT_EQ( stats.io.recvCalls, 0u );
+        ASSERT_GT( stats.io.waitCalls, 0u );
+    }
+    ASSERT_EQ( stats.errors.protocol, 1u );
+
+    server.StopListening();
+    runThread.join();
+}
+
+TEST( Ipc, SeqPacket )
+{
+    // io_uring is ignored for SOCK_SEQPACKET sockets
+    Ipc::ServerOptions serverOptions;
+    serverOptions.socketType = Ipc::SocketType::SeqPacket;
+    serverOptions.ioUring = true;
+    Ipc::Server server( c_serverSocket, serverOptions );
+    auto runThread = std::thread(
+        [&]
+        {
+            ASSERT_FALSE( server
+                              .Run(
+                                  []( const Ipc::Message& recvHeader, const Ipc::Message& recvMessage )
+                                  {
+                                      if ( recvHeader.AsString() == "fds" )
+                                      {
+                                          return Ipc::Message( std::to_string( recvMessage.Fds().size() ) );
+                                      }
+                                      return Ipc::Message( recvMessage.AsByteVect() );
+                                  } )
+                              .IsError() );
+        } );
+
+    // Messages from a byte to many records' worth, over every kind of connection
+    const size_t messageSizes[] = { 1, 100, 64 * 1024 - 28, 64 * 1024, 100 * 1024, 1024 * 1024 };
+    std::vector<std::thread> clientThreads;
+    for ( int i = 0; i < 4; ++i )
+    {
+        clientThreads.emplace_back(
+            [&, i]
+            {
+                Ipc::ClientOptions options;
+                options.socketType = Ipc::SocketType::SeqPacket;
+                options.persistentConnection = i != 0;
+                options.ackHandshake = i == 2;
+                options.sharedMemory = i == 3;
+                Ipc::Client client( c_serverSocket, options );
+                for ( int j = 0; j < 24; ++j )
+                {
+                    std::vector<unsigned char> message( messageSizes[j % std::size( messageSizes )], (unsigned char)j );
+                    message.back() = (unsigned char)i;
+                    auto response = client.Send( std::string( "echo" ), message );
+                    ASSERT_FALSE( response.IsError() ) << response.AsString();
+                    ASSERT_EQ( response.AsByteVect(), message );
+                }
+            } );
+    }
+    for ( auto& clientThread : clientThreads )
+    {
+        clientThread.join();
+    }
+
+    // Pipelined requests, batches, and file descriptors
+    Ipc::ClientOptions options;
+    options.socketType = Ipc::SocketType::SeqPacket;
+    options.persistentConnection = true;
+    Ipc::Client client( c_serverSocket, options );
+    std::vector<std::future<Ipc::Message>> responses;
+    for ( int i = 0; i < 100; ++i )
+    {
+        responses.push_back( client.SendAsync( std::string( "echo" ), std::to_string( i ) ) );
+    }
+    for ( int i = 0; i < 100; ++i )
+    {
+        ASSERT_EQ( responses[i].get().AsString(), std::to_string( i ) );
+    }
+
+    std::vector<std::pair<Ipc::Message, Ipc::Message>> requests;
+    for ( int i = 0; i < 10; ++i )
+    {
+        requests.emplace_back( std::string( "echo" ), std::vector<unsigned char>( 20 * 1024, (unsigned char)i ) );
+    }
+    auto batchResponses = client.SendBatch( requests );
+    ASSERT_EQ( batchResponses.size(), requests.size() );
+    for ( size_t i = 0; i < requests.size(); ++i )
+    {
+        ASSERT_EQ( batchResponses[i].AsByteVect(), requests[i].second.AsByteVect() );
+    }
+
+    int pipeFds[2];
+    ASSERT_EQ( pipe( pipeFds ), 0 );
+    Ipc::Message fdMessage( std::string( "pipe" ) );
+    fdMessage.AttachFd( pipeFds[0] );
+    fdMessage.AttachFd( pipeFds[1] );
+    ASSERT_EQ( client.Send( std::string( "fds" ), fdMessage ).AsString(), "2" );
+
+    // A record larger than any our peers send is refused, and its connection dropped
+    sockaddr_un socketAddr = {};
+    socketAddr.sun_family = AF_UNIX;
+    strncpy( socketAddr.sun_path, c_serverSocket, sizeof( socketAddr.sun_path ) - 1 );
+    int rogueSocket = socket( AF_UNIX, SOCK_SEQPACKET, 0 );
+    ASSERT_EQ( connect( rogueSocket, reinterpret_cast<const sockaddr*>( &socketAddr ), sizeof( socketAddr ) ), 0 );
+    timeval timeout = { 5, 0 };
+    setsockopt( rogueSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( timeout ) );
+    std::string record( 100 * 1024, 'x' );
+    ASSERT_EQ( send( rogueSocket, record.data(), record.size(), 0 ), (ssize_t)record.size() );
+    char byte;
+    ASSERT_EQ( recv( rogueSocket, &byte, 1, 0 ), 0 );
+    close( rogueSocket );
+    ASSERT_EQ( client.Send( std::string( "echo" ), std::string( "still here" ) ).AsString(), "still here" );
+
+    auto stats = server.Stats();
+    ASSERT_FALSE( stats.ioUring );
+    ASSERT_EQ( stats.errors.protocol, 1u );
+
+    // A stream client can't talk to a SOCK_SEQPACKET server
+    ASSERT_TRUE( Ipc::Client( c_serverSocket ).Send( std::string( "echo" ), std::string( "stream" ) ).IsError() );
+
+    server.StopListening();
+    runThread.join();
+}
+#endif
+
+TEST( Ipc, PartialFrame )
+{
+    Ipc::Server server( c_serverSocket );
+    auto listenThread = std::thread( [&server] { ASSERT_FALSE( server.Listen( RecvCallback ).IsError() ); } );
+
+    // A client that stalls part way through a frame must not hold up anyone else
+    sockaddr_un socketAddr = {};
+    socketAddr.sun_family = AF_UNIX;
+    strncpy( socketAddr.sun_path, c_serverSocket, sizeof( socketAddr.sun_path ) - 1 );
+
+    int stalledSocket = socket( AF_UNIX, SOCK_STREAM, 0 );
+    ASSERT_EQ( connect( stalledSocket, reinterpret_cast<const sockaddr*>( &socketAddr ), sizeof( socketAddr ) ), 0 );
+    ASSERT_EQ( send( stalledSocket, "IPCF", 4, 0 ), 4 );
+
+    Ipc::Client client( c_serverSocket );
+    auto response = client.Send( std::vector<unsigned char>{ 0 }, std::string( "Hello?" ) );
+    ASSERT_FALSE( response.IsError() );
+    ASSERT_EQ( response.AsString(), "Unix Domain Sockets!" );
+
+    listenThread.join();
+    close( stalledSocket );
+}
+
+TEST( Ipc, MaxMessageSize )
+{
+    Ipc::ServerOptions serverOptions;
+    serverOptions.maxMessageSize = 1024;
+    Ipc::Server server( c_serverSocket, serverOptions );
+    auto runThread = std::thread(
+        [&server]
+        {
+            ASSERT_FALSE( server
+                              .Run( []( const Ipc::Message&, const Ipc::Message& recvMessage )
+                                    { return Ipc::Message( recvMessage.AsByteVect() ); } )
+                              .IsError() );
+        } );
+
+    // A frame claiming more than the server takes (or more than fits in memory at all) drops its connection before
+    // anything is allocated for it
+    sockaddr_un socketAddr = {};
+    socketAddr.sun_family = AF_UNIX;
+    strncpy( socketAddr.sun_path, c_serverSocket, sizeof( socketAddr.sun_path ) - 1 );
+    for ( uint64_t bodyLength : { uint64_t( 1 ) << 40, UINT64_MAX - 2 } )
+    {
+        unsigned char frame[28] = { 'I', 'P', 'C', 'F', 2 };
+        uint32_t headerLength = 4;
+        memcpy( frame + 8, &headerLength, 4 );
+        memcpy( frame + 12, &bodyLength, 8 );
+
+        int rogueSocket = socket( AF_UNIX, SOCK_STREAM, 0 );
+        ASSERT_EQ( connect( rogueSocket, reinterpret_cast<const sockaddr*>( &socketAddr ), sizeof( socketAddr ) ), 0 );
+        timeval timeout = { 5, 0 };
+        setsockopt( rogueSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( timeout ) );
+        ASSERT_EQ( send( rogueSocket, frame, sizeof( frame ), 0 ), (ssize_t)sizeof( frame ) );
+        char byte;
+        ASSERT_EQ( recv( rogueSocket, &byte, 1, 0 ), 0 );
+        close( rogueSocket );
+    }
+
+    // Requests up to the limit are served as usual, larger ones fail
+    Ipc::Client client( c_serverSocket );
+    ASSERT_EQ( client.Send( std::string( "echo" ), std::string( 1000, 'x' ) ).AsString(), std::string( 1000, 'x' ) );
+    ASSERT_TRUE( client.Send( std::string( "echo" ), std::string( 1021, 'x' ) ).IsError() );
+    ASSERT_EQ( server.Stats().errors.protocol, 3u );
+
+    // Likewise for responses larger than the client takes
+    Ipc::ClientOptions clientOptions;
+    clientOptions.maxMessageSize = 100;
+    Ipc::Client smallClient( c_serverSocket, clientOptions );
+    ASSERT_EQ( smallClient.Send( std::string( "echo" ), std::string( 100, 'x' ) ).AsString(), std::string( 100, 'x' ) );
+    auto response = smallClient.Send( std::string( "echo" ), std::string( 101, 'x' ) );
+    ASSERT_TRUE( response.IsError() );
+    ASSERT_EQ( response.AsString(), "response recv() failed (message too large)" );
+    ASSERT_EQ( smallClient.Stats().errors.protocol, 1u );
+
+    server.StopListening();
+    runThread.join();
+}
+
+TEST( Ipc, SharedMemorySetup )
+{
+    Ipc::Server server( c_serverSocket );
+    auto runThread = std::thread(
+        [&server]
+        {
+            ASSERT_FALSE( server
+                              .Run( []( const Ipc::Message&, const Ipc::Message& recvMessage )
+                                    { return Ipc::Message( recvMessage.AsByteVect() ); } )
+                              .IsError() );
+        } );
+
+    // A region offered by name rather than by descriptor is turned away, so no client can have the server map a
+    // region it didn't create itself (such as another connection's)
+    sockaddr_un socketAddr = {};
+    socketAddr.sun_family = AF_UNIX;
+    strncpy( socketAddr.sun_path, c_serverSocket, sizeof( socketAddr.sun_path ) - 1 );
+    int rogueSocket = socket( AF_UNIX, SOCK_STREAM, 0 );
+    ASSERT_EQ( connect( rogueSocket, reinterpret_cast<const sockaddr*>( &socketAddr ), sizeof( socketAddr ) ), 0 );
+
+    std::string name = "/ipc-" + std::to_string( getpid() ) + "-0";
+    unsigned char frame[28] = { 'I', 'P', 'C', 'F', 2, 0x08 };
+    uint64_t bodyLength = name.size();
+    memcpy( frame + 12, &bodyLength, 8 );
+    ASSERT_EQ( send( rogueSocket, frame, sizeof( frame ), 0 ), (ssize_t)sizeof( frame ) );
+    ASSERT_EQ( send( rogueSocket, name.data(), name.size(), 0 ), (ssize_t)name.size() );
+
+    std::string error = "invalid shared memory setup";
+    std::vector<char> response( sizeof( frame ) + error.size() );
+    ASSERT_EQ( recv( rogueSocket, response.data(), response.size(), MSG_WAITALL ), (ssize_t)response.size() );
+    ASSERT_EQ( response[5] & 0x01, 0x01 );
+    ASSERT_EQ( std::string( response.data() + sizeof( frame ), error.size() ), error );
+    close( rogueSocket );
+
+    // Whereas a client's own region is taken up
+    Ipc::ClientOptions options;
+    options.persistentConnection = true;
+    options.sharedMemory = true;
+    Ipc::Client client( c_serverSocket, options );
+    std::vector<unsigned char> payload( 1024 * 1024, 42 );
+    ASSERT_EQ( client.Send( std::string( "echo" ), payload ).AsByteVect(), payload );
+#ifdef __linux__
+    std::ifstream maps( "/proc/self/maps" );
+    int ringMappings = 0;
+    for ( std::string line; std::getline( maps, line ); )
+    {
+        ringMappings += line.find( "/memfd:ipc-ring" ) != std::string::npos;
+    }
+    ASSERT_EQ( ringMappings, 2 );
+#endif
+
+    // A connection's region can't be replaced, as responses may be on their way through it
+    Ipc::Private::SharedMemory region;
+    ASSERT_TRUE( region.Create( options.sharedMemorySize ).empty() );
+    rogueSocket = socket( AF_UNIX, SOCK_STREAM, 0 );
+    ASSERT_EQ( connect( rogueSocket, reinterpret_cast<const sockaddr*>( &socketAddr ), sizeof( socketAddr ) ), 0 );
+    for ( int setup = 0; setup < 2; ++setup )
+    {
+        unsigned char fdFrame[28] = { 'I', 'P', 'C', 'F', 2, 0x08 | 0x20, 1 };
+        iovec iov = { fdFrame, sizeof( fdFrame ) };
+        alignas( cmsghdr ) char control[CMSG_SPACE( sizeof( int ) )] = {};
+        msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof( control );
+        auto cmsg = CMSG_FIRSTHDR( &msg );
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN( sizeof( int ) );
+        int fd = region.Fd();
+        memcpy( CMSG_DATA( cmsg ), &fd, sizeof( int ) );
+        ASSERT_EQ( sendmsg( rogueSocket, &msg, 0 ), (ssize_t)sizeof( fdFrame ) );
+    }
+    ASSERT_EQ( recv( rogueSocket, response.data(), sizeof( frame ), MSG_WAITALL ), (ssize_t)sizeof( frame ) );
+    ASSERT_EQ( response[5] & 0x01, 0 );
+    char byte;
+    ASSERT_EQ( recv( rogueSocket, &byte, 1, 0 ), 0 );
+    ASSERT_EQ( server.Stats().errors.protocol, 1u );
+    close( rogueSocket );
+
+    server.StopListening();
+    runThread.join();
+}
+#endif
+
+TEST( Ipc, StopListening )
+{
+    Ipc::Server server( c_serverSocket );
+    auto listenThread = std::thread( [&server] { ASSERT_FALSE( server.Listen( RecvCallback ).IsError() ); } );
+
+    server.StopListening();
+
+    listenThread.join();
+
+    // Stopping needs neither the socket path nor any client, and takes effect at once
+    std::filesystem::remove( c_serverSocket );
+    auto start = std::chrono::steady_clock::now();
+    listenThread = std::thread( [&server] { ASSERT_FALSE( server.Listen( RecvCallback ).IsError() ); } );
+    ASSERT_FALSE( server.StopListening().IsError() );
+    listenThread.join();
+    ASSERT_LT( std::chrono::steady_clock::now() - start, std::chrono::milliseconds( 500 ) );
+}
+
+TEST( Ipc, StopListeningDrain )
+{
+    Ipc::Server server( c_serverSocket );
+
+    std::promise<void> slowStarted;
+    std::promise<void> releaseSlow;
+    auto releaseSlowFuture = releaseSlow.get_future().share();
+
+    Ipc::RunOptions options;
+    options.workerCount = 1;
+    options.drainTimeout = std::chrono::milliseconds( 50 );
+    auto runThread = std::thread(
+        [&]
+        {
+            ASSERT_FALSE( server
+                              .Run(
+                                  [&]( const Ipc::Message& recvHeader, const Ipc::Message& recvMessage )
+                                  {
+                                      if ( recvHeader.AsString() == "slow" )
+                                      {
+                                          slowStarted.set_value();
+                                          releaseSlowFuture.wait();
+                                      }
+                                      return recvMessage.AsString();
+                                  },
+                                  options )
+                              .IsError() );
+        } );
+
+    // The only worker is held up by the first request, so the second waits in the queue
+    Ipc::ClientOptions clientOptions;
+    clientOptions.persistentConnection = true;
+    Ipc::Client client( c_serverSocket, clientOptions );
+    auto slowResponse = client.SendAsync( std::string( "slow" ), std::string( "tortoise" ) );
+    slowStarted.get_future().wait();
+    auto queuedResponse = client.SendAsync( std::string( "fast" ), std::string( "hare" ) );
+    while ( server.Stats().requestsQueued < 2 )
+    {
+        std::this_thread::yield();
+    }
+
+    // Past the drain timeout, the queued request is answered with an error while the running one finishes
+    server.StopListening();
+    auto response = queuedResponse.get();
+    ASSERT_TRUE( response.IsError() );
+    ASSERT_EQ( response.AsString(), "server stopped before handling request" );
+
+    releaseSlow.set_value();
+    ASSERT_EQ( slowResponse.get().AsString(), "tortoise" );
+
+    runThread.join();
+}
+
+TEST( Ipc, StopListeningBatch )
+{
+    Ipc::Server server( c_serverSocket );
+
+    std::promise<void> releaseSlow;
+    auto releaseSlowFuture = releaseSlow.get_future().share();
+
+    Ipc::RunOptions options;
+    options.workerCount = 1;
+    options.queueCapacity = 1;
+    auto runThread = std::thread(
+        [&]
+        {
+            ASSERT_FALSE( server
+                              .Run(
+                                  [&]( const Ipc::Message& recvHeader, const Ipc::Message& recvMessage )
+                                  {
+                                      if ( recvHeader.AsString() == "slow" )
+                                      {
+                                          releaseSlowFuture.wait();
+                                      }
+                                      return recvMessage.AsString();
+                                  },
+                                  options )
+                              .IsError() );
+        } );
+
+    // The worker is held up by the first request and the queue by the second, so the third waits for room and the
+    // fourth is still to be dispatched when the server is stopped
+    std::vector<std::pair<Ipc::Message, Ipc::Message>> requests;
+    requests.emplace_back( std::string( "slow" ), std::string( "0" ) );
+    for ( int i = 1; i < 4; ++i )
+    {
+        requests.emplace_back( std::string( "echo" ), std::to_string( i ) );
+    }
+    Ipc::Client client( c_serverSocket );
+    auto responses = std::async( std::launch::async, [&] { return client.SendBatch( requests ); } );
+    while ( server.Stats().queueFullWaits < 1 )
+    {
+        std::this_thread::yield();
+    }
+    server.StopListening();
+
+    // The rest of the batch is drained along with the queue
+    releaseSlow.set_value();
+    auto batchResponses = responses.get();
+    ASSERT_EQ( batchResponses.size(), requests.size() );
+    for ( int i = 0; i < 4; ++i )
+    {
+        ASSERT_FALSE( batchResponses[i].IsError() );
+        ASSERT_EQ( batchResponses[i].AsString(), std::to_string( i ) );
+    }
+
+    runThread.join();
+}
+
+TEST( Ipc, Timeouts )
+{
+    Ipc::Server server( c_serverSocket );
+
+    Ipc::RunOptions options;
+    options.workerCount = 2;
+    auto runThread = std::thread(
+        [&]
+        {
+            ASSERT_FALSE( server
+                              .Run(
+                                  []( const Ipc::Message& recvHeader, const Ipc::Message& recvMessage )
+                                  {
+                                      if ( recvHeader.AsString() == "slow" )
+                                      {
+                                          std::this_thread::sleep_for( std::chrono::milliseconds( 300 ) );
+                                      }
+                                      return recvMessage.AsString();
+                                  },
+                                  options )
+                              .IsError() );
+        } );
+
+    Ipc::ClientOptions clientOptions;
+    clientOptions.persistentConnection = true;
+    clientOptions.timeouts.receive = std::chrono::milliseconds( 50 );
+    Ipc::Client client( c_serverSocket, clientOptions );
+
+    // A response later than the receive timeout fails the request, and promptly
+    auto start = std::chrono::steady_clock::now();
+    auto response = client.Send( std::string( "slow" ), std::string( "tortoise" ) );
+    ASSERT_TRUE( response.IsError() );
+    ASSERT_EQ( response.AsString(), "response recv() failed (timed out)" );
+    ASSERT_LT( std::chrono::steady_clock::now() - start, std::chrono::milliseconds( 250 ) );
+
+    // The connection carries on, discarding the late response when it arrives
+    ASSERT_EQ( client.Send( std::string( "fast" ), std::string( "hare" ) ).AsString(), "hare" );
+    std::this_thread::sleep_for( std::chrono::milliseconds( 300 ) );
+    ASSERT_EQ( client.Send( std::string( "fast" ), std::string( "hare" ) ).AsString(), "hare" );
+    ASSERT_EQ( client.Stats().connectionsOpened, 1u );
+
+    // Limits can be raised (or lowered) per call
+    Ipc::Timeouts timeouts;
+    timeouts.receive = std::chrono::seconds( 2 );
+    ASSERT_EQ( client.Send( std::string( "slow" ), std::string( "tortoise" ), timeouts ).AsString(), "tortoise" );
+
+    timeouts.total = std::chrono::milliseconds( 20 );
+    ASSERT_EQ( client.Send( std::string( "slow" ), std::string( "tortoise" ), timeouts ).AsString(),
+               "response recv() failed (timed out)" );
+
+    // SendAsync() requests time out alike
+    ASSERT_EQ( client.SendAsync( std::string( "slow" ), std::string( "tortoise" ) ).get().AsString(),
+               "response recv() failed (timed out)" );
+
+    server.StopListening();
+    runThread.join();
+}
+
+TEST( Ipc, PathTooLong )
+{
+    auto longPath =
+        "really/really/really/really/really/really/really/really/really/really/really/really/really/really/really/"
+        "really/really/really/really/really/really/really/really/really/really/really/really/really/really/long/path";
+
+    // Server
+    Ipc::Server server( longPath );
+
+    auto result = server.Listen( RecvCallback );
+    ASSERT_TRUE( result.IsError() );
+    ASSERT_EQ( result.AsString(), std::string( "socket path too long: " ) + longPath );
+
+    // Client
+    Ipc::Client client( longPath );
+    auto response = client.Send( Ipc::Message( "header" ), Ipc::Message( "message" ) );
+    ASSERT_TRUE( response.IsError() );
+    ASSERT_EQ( response.AsString(), std::string( "socket path too long: " ) + longPath );
+}
+
+TEST( Ipc, EmptyMessage )
+{
+    Ipc::Client client( c_serverSocket );
+
+    auto response1 = client.Send( Ipc::Message( "" ), Ipc::Message( "message" ) );
+    ASSERT_TRUE( response1.IsError() );
+    ASSERT_EQ( response1.AsString(), "header can not be empty" );
+
+    auto response2 = client.Send( Ipc::Message( "header" ), Ipc::Message( "" ) );
+    ASSERT_TRUE( response2.IsError() );
+    ASSERT_EQ( response2.AsString(), "message can not be empty" );
+}
+
+TEST( Ipc, MessageConversion )
+{
+    std::string messageStr = "test message 1 2 3";
+    Ipc::Message message( reinterpret_cast<unsigned char*>( &messageStr[0] ), messageStr.size() );
+
+    ASSERT_FALSE( message.IsError() );
+
+    ASSERT_EQ( message.Size(), messageStr.size() );
+    ASSERT_EQ( message.AsString().size(), messageStr.size() );
+    ASSERT_EQ( message.AsByteVect().size(), messageStr.size() );
+
+    ASSERT_EQ( message.AsString(), messageStr );
+    ASSERT_EQ( message.AsStringView(), messageStr );
+
+    // A view of the caller's bytes, not a copy
+    ASSERT_EQ( message.AsRaw(), reinterpret_cast<unsigned char*>( &messageStr[0] ) );
+    ASSERT_EQ( message.AsStringView().data(), messageStr.data() );
+
+    for ( size_t i = 0; i < messageStr.size(); ++i )
+    {
+        ASSERT_EQ( message.AsByteVect()[i], (unsigned char)messageStr[i] );
+        ASSERT_EQ( message.AsRaw()[i], (unsigned char)messageStr[i] );
+    }
+}
+
+TEST( Ipc, MessageMove )
+{
+    // Payloads are moved into Messages and between them, never reallocated
+    std::vector<unsigned char> bytes( 1024, 42 );
+    auto bytesData = bytes.data();
+
+    Ipc::Message message( std::move( bytes ) );
+    ASSERT_EQ( message.AsRaw(), bytesData );
+    ASSERT_EQ( message.AsByteVect().data(), bytesData );
+
+    Ipc::Message moved( std::move( message ) );
+    ASSERT_EQ( moved.AsRaw(), bytesData );
+    ASSERT_EQ( moved.Size(), 1024 );
+    ASSERT_EQ( message.Size(), 0 );
+    ASSERT_EQ( message.AsRaw(), nullptr );
+
+    std::string str( 1024, 'x' );
+    auto strData = str.data();
+
+    Ipc::Message error( std::move( str ), true );
+    ASSERT_TRUE( error.IsError() );
+    ASSERT_EQ( error.AsString().data(), strData );
+
+    moved = std::move( error );
+    ASSERT_TRUE( moved.IsError() );
+    ASSERT_EQ( moved.AsStringView().data(), strData );
+
+    // Small copies are held inline, and must still be intact once moved
+    Ipc::Message small( std::vector<unsigned char>{ 1, 2, 3 } );
+    Ipc::Message smallCopy( std::string( "abc" ) );
+    Ipc::Message smallMoved( std::move( small ) );
+    Ipc::Message smallCopyMoved( std::move( smallCopy ) );
+    ASSERT_EQ( smallMoved.AsByteVect(), ( std::vector<unsigned char>{ 1, 2, 3 } ) );
+    ASSERT_EQ( smallCopyMoved.AsStringView(), "abc" );
+    ASSERT_EQ( small.Size(), 0 );
+}
+
+TEST( Ipc, BufferPool )
+{
+    Ipc::Server server( c_serverSocket );
+    auto listenThread = std::thread(
+        [&server]
+        {
+            for ( int i = 0; i < 10; ++i )
+            {
+                ASSERT_FALSE( server.Listen( []( const Ipc::Message&, const Ipc::Message& message )
+                                             { return message.AsByteVect(); } )
+                                  .IsError() );
+            }
+        } );
+
+    Ipc::ClientOptions options;
+    options.persistentConnection = true;
+    options.bufferPool.highWaterMark = 64 * 1024;
+    Ipc::Client client( c_serverSocket, options );
+
+    // 40 KB payloads fit the 64 KB class, each buffer is reused once the previous response is destroyed
+    std::vector<unsigned char> payload( 40 * 1024, 7 );
+    for ( int i = 0; i < 9; ++i )
+    {
+        auto response = client.Send( std::string( "bin" ), payload );
+        ASSERT_FALSE( response.IsError() );
+        ASSERT_EQ( response.AsByteVect(), payload );
+    }
+
+    // Beyond the high-water mark buffers aren't kept
+    std::vector<unsigned char> bigPayload( 100 * 1024, 8 );
+    ASSERT_EQ( client.Send( std::string( "bin" ), bigPayload ).AsByteVect(), bigPayload );
+
+    listenThread.join();
+
+    auto clientStats = client.Stats().bufferPool;
+    ASSERT_EQ( clientStats.takes, 10 );
+    ASSERT_EQ( clientStats.hits, 8 );
+    ASSERT_EQ( clientStats.returns, 10 );
+    ASSERT_EQ( clientStats.drops, 1 );
+    ASSERT_EQ( clientStats.pooledBuffers, 1 );
+    ASSERT_EQ( clientStats.pooledBytes, 64 * 1024 );
+
+    auto serverStats = server.Stats().bufferPool;
+    ASSERT_EQ( serverStats.takes, 10 );
+    ASSERT_EQ( serverStats.hits, 8 );
+    ASSERT_EQ( serverStats.returns, 10 );
+
+    // A reused buffer is handed out as it was left rather than cleared, as whoever takes it overwrites it anyway
+    Ipc::Private::BufferPool pool;
+    auto buffer = pool.Take( 1000 );
+    ASSERT_EQ( buffer.size(), 1000u );
+    memset( buffer.data(), 9, buffer.size() );
+    auto bufferData = buffer.data();
+    pool.Return( std::move( buffer ) );
+    buffer = pool.Take( 600 );
+    ASSERT_EQ( buffer.data(), bufferData );
+    ASSERT_GE( buffer.size(), 600u );
+    ASSERT_EQ( buffer[599], 9 );
+
+    // However high the high-water mark, the size classes past it don't overflow
+    Ipc::BufferPoolOptions hugeOptions;
+    hugeOptions.highWaterMark = SIZE_MAX;
+    Ipc::Private::BufferPool hugePool( hugeOptions );
+    ASSERT_EQ( hugePool.Take( 100 ).size(), 100u );
+}
+
+TEST( Ipc, Metrics )
+{
+    static const int c_requestCount = 20;
+
+    Ipc::Server server( c_serverSocket );
+    auto listenThread = std::thread(
+        [&server]
+        {
+            for ( int i = 0; i < c_requestCount; ++i )
+            {
+                ASSERT_FALSE( server.Listen( []( const Ipc::Message&, const Ipc::Message& )
+                                             { return std::string( "pong" ); } )
+                                  .IsError() );
+            }
+        } );
+
+    Ipc::ClientOptions options;
+    options.persistentConnection = true;
+    Ipc::Client client( c_serverSocket, options );
+    for ( int i = 0; i < c_requestCount; ++i )
+    {
+        ASSERT_EQ( client.Send( std::string( "bin" ), std::string( "ping" ) ).AsString(), "pong" );
+    }
+
+    listenThread.join();
+
+    // Each request is a 28 byte frame, "bin" and "ping", and each response a frame and "pong"
+    auto clientStats = client.Stats();
+    ASSERT_EQ( clientStats.requestsSent, c_requestCount );
+    ASSERT_EQ( clientStats.connectionsOpened, 1 );
+    ASSERT_EQ( clientStats.activeConnections, 1 );
+    ASSERT_EQ( clientStats.io.bytesOut, c_requestCount * 35 );
+    ASSERT_EQ( clientStats.io.bytesIn, c_requestCount * 32 );
+    ASSERT_GE( clientStats.io.sendCalls, c_requestCount );
+    ASSERT_GE( clientStats.io.recvCalls, c_requestCount );
+    ASSERT_EQ( clientStats.connectLatency.count, 1 );
+    ASSERT_EQ( clientStats.ackLatency.count, 0 );
+    ASSERT_EQ( clientStats.sendLatency.count, c_requestCount );
+    ASSERT_EQ( clientStats.roundTripLatency.count, c_requestCount );
+    ASSERT_GT( clientStats.roundTripLatency.MeanMicroseconds(), 0 );
+    ASSERT_GE( clientStats.roundTripLatency.PercentileMicroseconds( 0.99 ),
+               clientStats.roundTripLatency.PercentileMicroseconds( 0.5 ) );
+
+    auto serverStats = server.Stats();
+    ASSERT_EQ( serverStats.requestsReceived, c_requestCount );
+    ASSERT_EQ( serverStats.connectionsAccepted, 1 );
+    ASSERT_EQ( serverStats.activeConnections, 1 );
+    ASSERT_EQ( serverStats.io.bytesIn, c_requestCount * 35 );
+    ASSERT_EQ( serverStats.io.bytesOut, c_requestCount * 32 );
+    ASSERT_EQ( serverStats.receiveLatency.count, c_requestCount );
+    ASSERT_EQ( serverStats.queueLatency.count, 0 );
+    ASSERT_EQ( serverStats.callbackLatency.count, c_requestCount );
+    ASSERT_EQ( serverStats.sendLatency.count, c_requestCount );
+
+    uint64_t bucketTotal = 0;
+    for ( auto bucket : serverStats.callbackLatency.buckets )
+    {
+        bucketTotal += bucket;
+    }
+    ASSERT_EQ( bucketTotal, c_requestCount );
+
+    // Failures are counted by category
+    Ipc::Client orphan( "no_server.sock" );
+    ASSERT_TRUE( orphan.Send( std::string( "bin" ), std::string( "ping" ) ).IsError() );
+    auto orphanStats = orphan.Stats();
+    ASSERT_EQ( orphanStats.errors.connect, 1 );
+    ASSERT_EQ( orphanStats.requestsSent, 0 );
+    ASSERT_EQ( orphanStats.activeConnections, 0 );
+}
+
+Ipc::Message PingCallback( const Ipc::Message&, const Ipc::Message& recvMessage )
+{
+    return recvMessage.AsStringView() == "ping" ? Ipc::Message( "pong" ) : Ipc::Message( "unexpected", true );
+}
+
+TEST( Ipc, ZeroAllocations )
+{
+    static const int c_warmUpCount = 10;
+    static const int c_requestCount = 100;
+
+    Ipc::Server server( c_serverSocket );
+    auto listenThread = std::thread(
+        [&server]
+        {
+            for ( int i = 0; i < c_warmUpCount + c_requestCount; ++i )
+            {
+                ASSERT_FALSE( server.Listen( PingCallback ).IsError() );
+            }
+        } );
+
+    Ipc::ClientOptions options;
+    options.persistentConnection = true;
+    Ipc::Client client( c_serverSocket, options );
+
+    // Let the connection and the server's receive buffers get set up first
+    for ( int i = 0; i < c_warmUpCount; ++i )
+    {
+        ASSERT_EQ( client.Send( Ipc::Message( "bin" ), Ipc::Message( "ping" ) ).AsStringView(), "pong" );
+    }
+
+    // From here on neither side of a small request / response should touch the heap
+    size_t failures = 0;
+    auto allocationsBefore = allocationCount.load();
+    for ( int i = 0; i < c_requestCount; ++i )
+    {
+        auto response = client.Send( Ipc::Message( "bin" ), Ipc::Message( "ping" ) );
+        if ( response.IsError() || response.AsStringView() != "pong" )
+        {
+            ++failures;
+        }
+    }
+    auto allocations = allocationCount.load() - allocationsBefore;
+
+    listenThread.join();
+
+    ASSERT_EQ( failures, 0 );
+    ASSERT_EQ( allocations, 0 );
 }
 
 int main( int argc, char** argv )